@@ -6,6 +6,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "ticklish_util.h"
 #include "ticklish.h"
@@ -37,17 +38,21 @@ bool tkh_timed_is_valid(TkhTimed *tkt) {
         tkh_timeval_is_valid(&(tkt->board_at));
 }
 
-char* tkh_timed_to_string(TkhTimed *tkt) {
-    char buffer[144];
-    snprintf(
-        buffer, 144,
+int tkh_timed_to_string_into(TkhTimed *tkt, char *target, int max_length) {
+    int n = snprintf(
+        target, max_length,
         "%ld.%06ld + <= %ld.%06ld; here %ld.%06ld, there %ld.%06ld",
         tkt->zero.tv_sec, tkt->zero.tv_usec,
         tkt->window.tv_sec, tkt->window.tv_usec,
         tkt->timestamp.tv_sec, tkt->timestamp.tv_usec,
         tkt->board_at.tv_sec, tkt->board_at.tv_usec
     );
-    buffer[143] = 0;
+    return (n >= 0 && n < max_length) ? n : -1;
+}
+
+char* tkh_timed_to_string(TkhTimed *tkt) {
+    char buffer[144];
+    if (tkh_timed_to_string_into(tkt, buffer, 144) < 0) buffer[143] = 0;
     return strdup(buffer);
 }
 
@@ -119,7 +124,7 @@ TkhDigital tkh_pulsed_digital(char channel, double delay, double interval, unsig
     return result;
 }
 
-char* tkh_digital_to_string(TkhDigital *tdg, bool command) {
+int tkh_digital_to_string_into(TkhDigital *tdg, bool command, char *target, int max_length) {
     char buffer[80];
     int stride = (command) ? 9 : 10;
     strcpy(
@@ -137,23 +142,90 @@ char* tkh_digital_to_string(TkhDigital *tdg, bool command) {
     tv = tkh_timeval_from_micros(tdg->pulse_high); tkh_encode_time_into(&tv, buffer + 1 + 4*stride, 8);
     tv = tkh_timeval_from_micros(tdg->pulse_low);  tkh_encode_time_into(&tv, buffer + 1 + 5*stride, 8);
     buffer[6*stride] = (tdg->upright) ? 'u' : 'i';
+    int n = strnlen(buffer, 79);
+    if (n >= max_length) return -1;
+    memcpy(target, buffer, n + 1);
+    return n;
+}
+
+char* tkh_digital_to_string(TkhDigital *tdg, bool command) {
+    char buffer[80];
+    if (tkh_digital_to_string_into(tdg, command, buffer, 80) < 0) return NULL;
     return strdup(buffer);
 }
 
 
+/*********************/
+/* TkhEdge functions */
+/*********************/
+
+TkhJitter tkh_trace_jitter(const TkhEdge *edges, int n, char channel) {
+    TkhJitter result;
+    result.n = 0;
+    result.mean = result.sd = result.min = result.max = 0;
+    double sum = 0, sumsq = 0;
+    for (int i = 0; i < n; i++) {
+        if (channel && edges[i].channel != channel) continue;
+        double x = edges[i].late / (double)TKH_TICKS_PER_SECOND;
+        if (result.n == 0 || x < result.min) result.min = x;
+        if (result.n == 0 || x > result.max) result.max = x;
+        sum += x;
+        sumsq += x*x;
+        result.n++;
+    }
+    if (result.n > 0) {
+        result.mean = sum / result.n;
+        double var = sumsq / result.n - result.mean*result.mean;
+        result.sd = (result.n > 1 && var > 0) ? sqrt(var * result.n / (result.n - 1)) : 0;
+    }
+    return result;
+}
+
+
+double tkh_lateness_bucket_limit(int k) {
+    if (k >= TKH_LATENESS_BUCKETS - 1) return INFINITY;
+    return (double)(1 << (k + 4)) / TKH_TICKS_PER_SECOND;
+}
+
+double tkh_lateness_quantile(const TkhLateness *lateness, double q) {
+    double total = 0;
+    for (int k = 0; k < TKH_LATENESS_BUCKETS; k++) total += lateness->counts[k];
+    if (total <= 0) return 0;
+    double sofar = 0;
+    for (int k = 0; k < TKH_LATENESS_BUCKETS; k++) {
+        sofar += lateness->counts[k];
+        if (sofar >= q * total) {
+            double limit = tkh_lateness_bucket_limit(k);
+            return (limit < lateness->max) ? limit : lateness->max;
+        }
+    }
+    return lateness->max;
+}
+
+
 /*****************************/
 /* Ticklish struct functions */
 /*****************************/
 
+void tkh_private_free_spares(Ticklish *tkh);
+
 Ticklish* tkh_construct(struct sp_port* port) {
     Ticklish *tv = (Ticklish*)malloc(sizeof(Ticklish));
     tv->my_port = port;
     tv->portname = strdup(sp_get_port_name(tv->my_port));
     tv->my_id = NULL;
+    tv->cache_path = NULL;
+    tv->vouched = true;
     tv->buffer = NULL;
     tv->buffer_start = 0;
     tv->buffer_end = 0;
     tv->error_value = 0;
+    tv->reader = NULL;
+    tv->spares = NULL;
+    tv->clock = NULL;
+    tv->acquisition = NULL;
+    tv->arrivals = 0;
+    pthread_cond_init(&(tv->arrived), NULL);
     pthread_mutexattr_t pmat;
     pthread_mutexattr_init(&pmat);
     pthread_mutexattr_settype(&pmat, PTHREAD_MUTEX_RECURSIVE);
@@ -164,14 +236,22 @@ Ticklish* tkh_construct(struct sp_port* port) {
 
 void tkh_destruct(Ticklish *tkh) {
     if (tkh->portname != NULL) {
+        tkh_clock_stop(tkh);
+        tkh_acquire_stop(tkh);
+        tkh_reader_stop(tkh);
         LOCKON;
+        if (tkh->clock != NULL) { free((void*)tkh->clock); tkh->clock = NULL; }
+        if (tkh->acquisition != NULL) { free((void*)tkh->acquisition); tkh->acquisition = NULL; }
+        tkh_private_free_spares(tkh);
         tkh_disconnect(tkh);
         if (tkh->my_port != NULL) { sp_free_port((struct sp_port*)tkh->my_port); tkh->my_port = NULL; }
         if (tkh->my_id != NULL) { free((void*)tkh->my_id); tkh->my_id = NULL; }
+        if (tkh->cache_path != NULL) { free((void*)tkh->cache_path); tkh->cache_path = NULL; }
         if (tkh->buffer != NULL) { free((void*)tkh->buffer); tkh->buffer = NULL; }
         if (tkh->portname != NULL) { free((void*)tkh->portname); tkh->portname = NULL; }
         UNLOCK;
         pthread_mutex_destroy(&(tkh->my_mutex));
+        pthread_cond_destroy(&(tkh->arrived));
     }
     free(tkh);
 }
@@ -208,6 +288,7 @@ void tkh_connect(Ticklish *tkh) {
 
 void tkh_disconnect(Ticklish *tkh) {
     if (tkh_is_connected(tkh)) {
+        tkh_reader_stop(tkh);
         LOCKON;
         if (tkh->buffer != NULL && tkh->my_port != NULL) {
             enum sp_return sp_ok = sp_close(tkh->my_port);
@@ -224,109 +305,215 @@ void tkh_disconnect(Ticklish *tkh) {
     }
 }
 
+#define TKH_ACQUIRE_PACKET 62
+#define TKH_ACQUIRE_HEADER 6
+#define TKH_ACQUIRE_QUEUE 256
+#define TKH_ACQUIRE_GIVE_UP 4
+#define TKH_READER_STALL 50
+#define TKH_SPARE_ROOM 128
+
+typedef struct TkhAcquisition {
+    volatile bool stopping;      // Asked the board to stop
+    volatile bool ended;         // Board sent its last block (or stopped answering)
+    int size;                    // Bytes per sample
+    int nana;                    // Analog inputs per sample...
+    int analog[TKH_ANALOG_INPUTS];  // ...and which ones they are
+    int epoch;                   // Epoch of the last sample, for unwrapping ticks
+    long long last;              // Ticks of the last sample
+    TkhBlock queue[TKH_ACQUIRE_QUEUE];  // Blocks not yet handed out
+    int head;
+    int count;
+    bool dropped;                // Queue overflowed since the last block was queued
+} TkhAcquisition;
+
+struct TkhRequest {
+    struct TkhRequest *next;
+    int n;                       // Bytes after `~` in the reply, or 0 for `$` and a line
+    bool started;                // Seen the `~` or `$` that starts the reply
+    char *reply;
+    int got;                     // Bytes of the reply so far...
+    int room;                    // ...and room for them
+    volatile bool done;          // Reply is in...
+    bool failed;                 // ...but garbled, too long, or never came
+    bool abandoned;              // Nobody is waiting for it any more
+    bool borrowed;               // Caller owns the request and the reply's room (which can't grow)
+    bool pooled;                 // Goes back to the spares when done with
+    TkhReplied callback;
+    void *data;
+};
+
+typedef struct TkhReader {
+    pthread_t thread;
+    volatile bool running;       // Thread is running and doing all the reading
+    volatile bool stopping;      // Asked to stop
+    unsigned char stage[2*TKH_ACQUIRE_PACKET + 128];  // Read but not yet sorted
+    int staged;
+    TkhRequest *first;           // Requests waiting for replies, oldest first...
+    TkhRequest *last;            // ...and newest
+    bool stalled;                // Gave up waiting for room in the ring...
+    unsigned int stalled_at;     // ...when nothing had been taken from it past here
+    bool held;                   // Only this thread may join the line for now
+    pthread_t holder;
+} TkhReader;
+
+bool tkh_private_line_up(Ticklish *tkh, const char *ask, TkhRequest *req);
+bool tkh_private_line_up_bytes(Ticklish *tkh, const char *ask, int n, TkhRequest *req);
+bool tkh_private_wait_for_reply(Ticklish *tkh, TkhRequest *req, int patience);
+void tkh_private_hold_line(Ticklish *tkh, bool hold);
+
+bool tkh_private_is_pumped(Ticklish *tkh) {
+    LOCKON;
+    bool ans = tkh->reader != NULL && tkh->reader->running && !pthread_equal(pthread_self(), tkh->reader->thread);
+    UNLOCK;
+    return ans;
+}
+
+void tkh_private_deadline(struct timespec *ts, int millis) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += millis / 1000;
+    ts->tv_nsec += (millis % 1000) * 1000000l;
+    if (ts->tv_nsec >= 1000000000l) { ts->tv_sec += 1; ts->tv_nsec -= 1000000000l; }
+}
+
+// Instead of reading the port, wait for the reader thread to pass more along
+int tkh_private_wait_for_pump(Ticklish *tkh) {
+    struct timespec until;
+    tkh_private_deadline(&until, TICKLISH_PATIENCE);
+    LOCKON;
+    unsigned long seen = tkh->arrivals;
+    int ret = 0;
+    while (
+        ret == 0 && seen == tkh->arrivals && tkh->buffer_end == tkh->buffer_start &&
+        tkh->reader != NULL && tkh->reader->running
+    ) ret = pthread_cond_timedwait(&(tkh->arrived), &(tkh->my_mutex), &until);
+    UNLOCK;
+    return (ret == 0) ? 0 : -1;
+}
+
+// Where the oldest unread bytes in the ring start, and how many follow without wrapping around
+int tkh_private_ring_peek(Ticklish *tkh, const char **p) {
+    unsigned int start = tkh->buffer_start;
+    unsigned int end = __atomic_load_n(&(tkh->buffer_end), __ATOMIC_ACQUIRE);
+    unsigned int k = start & (TICKLISH_BUFFER_N - 1);
+    int n = (int)(end - start);
+    if (n > TICKLISH_BUFFER_N - (int)k) n = TICKLISH_BUFFER_N - k;
+    *p = (const char*)(tkh->buffer + k);
+    return n;
+}
+
+// Lets the producer reuse the first n unread bytes
+void tkh_private_ring_consume(Ticklish *tkh, int n) {
+    __atomic_store_n(&(tkh->buffer_start), tkh->buffer_start + n, __ATOMIC_RELEASE);
+}
+
+// Where the producer may write next, and how many bytes will fit there without wrapping around
+int tkh_private_ring_space(Ticklish *tkh, char **p) {
+    unsigned int end = tkh->buffer_end;
+    unsigned int start = __atomic_load_n(&(tkh->buffer_start), __ATOMIC_ACQUIRE);
+    unsigned int k = end & (TICKLISH_BUFFER_N - 1);
+    int n = TICKLISH_BUFFER_N - (int)(end - start);
+    if (n > TICKLISH_BUFFER_N - (int)k) n = TICKLISH_BUFFER_N - k;
+    *p = (char*)(tkh->buffer + k);
+    return n;
+}
+
+// How many more bytes the ring can take
+int tkh_private_ring_free(Ticklish *tkh) {
+    return TICKLISH_BUFFER_N - (int)(tkh->buffer_end - __atomic_load_n(&(tkh->buffer_start), __ATOMIC_ACQUIRE));
+}
+
+// Hands n newly written bytes over to the consumer
+void tkh_private_ring_commit(Ticklish *tkh, int n) {
+    __atomic_store_n(&(tkh->buffer_end), tkh->buffer_end + n, __ATOMIC_RELEASE);
+}
+
 int tkh_wait_for_next_buffer(Ticklish *tkh) {
-    char buffer[128];
-    int N = TICKLISH_BUFFER_N - (tkh->buffer_end - tkh->buffer_start);
-    if (N > 128) N = 128;
-    if (N <= 0) return -1;
-    enum sp_return ret = sp_blocking_read_next(tkh->my_port, buffer, N, TICKLISH_PATIENCE);
+    if (tkh_private_is_pumped(tkh)) return tkh_private_wait_for_pump(tkh);
+    // Nobody else is reading the port, so read it straight into the ring
+    char *p;
+    int n = tkh_private_ring_space(tkh, &p);
+    if (n <= 0) return -1;
+    enum sp_return ret = sp_blocking_read_next(tkh->my_port, p, n, TICKLISH_PATIENCE);
     if (ret <= 0) return -1;
-    else {
-        int n = (ret >= 128) ? 128 : ret;
-        ;
-        if (n < TICKLISH_BUFFER_N - tkh->buffer_end) {
-            memcpy((void*)(tkh->buffer + tkh->buffer_end), buffer, n);
-            tkh->buffer_end += n;
-            n = 0;
-        }
-        else {
-            if (tkh->buffer_start > 0) {            
-                memmove((void*)(tkh->buffer + tkh->buffer_start), (void*)tkh->buffer, tkh->buffer_end - tkh->buffer_start);
-                tkh->buffer_end -= tkh->buffer_start;
-                tkh->buffer_start = 0;
-            }
-            int m = TICKLISH_BUFFER_N - tkh->buffer_end;
-            if (n < m) m = n;
-            memcpy((void*)(tkh->buffer + tkh->buffer_end), buffer, m);
-            tkh->buffer_end += m;
-            n -= m;
-        }
-        pthread_mutex_unlock(&(tkh->my_mutex));
-        return n;
-    }
+    tkh_private_ring_commit(tkh, ret);
+    return 0;
 }
 
 
-char* tkh_fixed_read(Ticklish *tkh, int n, bool twiddled) {
-    if (tkh->buffer == NULL || n <= 0) return NULL;
-    char* buffer = (char*)malloc(n+1);
+int tkh_fixed_read_into(Ticklish *tkh, int n, bool twiddled, char *target, int max_length) {
+    if (tkh->buffer == NULL || n <= 0 || n >= max_length) return -1;
     int i = 0;
     int ret = 0;
     do {
-        LOCKON;
-        while (!twiddled && tkh->buffer_start < tkh->buffer_end) { 
-            twiddled = tkh->buffer[tkh->buffer_start] == '~';
-            tkh->buffer_start++;
-        }
-        if (tkh->buffer_end - tkh->buffer_start >= n - i) {
-            memcpy(buffer + i, (char*)(tkh->buffer + tkh->buffer_start), n - i);
-            tkh->buffer_start += n - i;
-            i = n;
-        }
-        else if (tkh->buffer_end > tkh->buffer_start) {
-            memcpy(buffer + i, (char*)(tkh->buffer + tkh->buffer_start), tkh->buffer_end - tkh->buffer_start);
-            i += tkh->buffer_end - tkh->buffer_start;
-            tkh->buffer_start = tkh->buffer_end = 0;
+        const char *p;
+        int m;
+        while (i < n && (m = tkh_private_ring_peek(tkh, &p)) > 0) {
+            if (!twiddled) {
+                const char *t = (const char*)memchr(p, '~', m);
+                twiddled = t != NULL;
+                tkh_private_ring_consume(tkh, twiddled ? (int)(t - p) + 1 : m);
+                continue;
+            }
+            if (m > n - i) m = n - i;
+            memcpy(target + i, p, m);
+            i += m;
+            tkh_private_ring_consume(tkh, m);
         }
-        UNLOCK;
         if (i < n) ret = tkh_wait_for_next_buffer(tkh);
     } while (!(i == n || ret != 0));
-    if (ret != 0) {
+    if (ret != 0) return -1;
+    target[n] = 0;
+    return n;
+}
+
+char* tkh_fixed_read(Ticklish *tkh, int n, bool twiddled) {
+    if (tkh->buffer == NULL || n <= 0) return NULL;
+    char* buffer = (char*)malloc(n+1);
+    if (tkh_fixed_read_into(tkh, n, twiddled, buffer, n+1) < 0) {
         free((void*)buffer);
         return NULL;
     }
-    else {
-        buffer[n] = 0;
-        return buffer;
-    }
+    return buffer;
 }
 
 
-char* tkh_flex_read(Ticklish *tkh, bool dollared) {
-    if (tkh->buffer == NULL) return NULL;
-    char* buffer = (char*)malloc(64);
-    int N = 64;
+// Reads the line after the next `$` into *target, which grows to fit if `grow`.
+// Returns its length, or -1 if it didn't come or (not growing) didn't fit.
+int tkh_private_flex_read(Ticklish *tkh, bool dollared, char **target, int *room, bool grow) {
     int i = 0;
     bool mistake = false;
     bool newlined = false;
     do {
-        LOCKON;
-        while (!dollared && tkh->buffer_start < tkh->buffer_end) { 
-            dollared = tkh->buffer[tkh->buffer_start] == '$';
-            tkh->buffer_start++;
-        }
-        while (dollared && tkh->buffer_end > tkh->buffer_start && !newlined) {
-            char c = tkh->buffer[tkh->buffer_start];
-            tkh->buffer_start++;
-            if (c == '\n') newlined = true;
-            else if (c == '~') {
-                tkh->buffer_start--;
+        const char *p;
+        int m;
+        while (!newlined && (m = tkh_private_ring_peek(tkh, &p)) > 0) {
+            if (!dollared) {
+                const char *d = (const char*)memchr(p, '$', m);
+                dollared = d != NULL;
+                tkh_private_ring_consume(tkh, dollared ? (int)(d - p) + 1 : m);
+                continue;
+            }
+            // Take everything up to the newline, unless a ~ shows this isn't the reply after all
+            const char *nl = (const char*)memchr(p, '\n', m);
+            int k = (nl == NULL) ? m : (int)(nl - p);
+            const char *t = (const char*)memchr(p, '~', k);
+            if (t != NULL) {
+                k = (int)(t - p);
                 newlined = true;
                 mistake = true;
             }
-            else {
-                buffer[i] = c;
-                i++;
-                if (i >= N) {
-                    char* temp = (char*)malloc(N*2);
-                    memcpy(temp, buffer, N);
-                    free((void*)buffer);
-                    buffer = temp;
-                    N *= 2;
-                }
+            else newlined = nl != NULL;
+            if (i + k >= *room && grow) {
+                while (i + k >= *room) *room *= 2;
+                *target = (char*)realloc(*target, *room);
+            }
+            if (i + k < *room) {
+                memcpy(*target + i, p, k);
+                i += k;
             }
+            else mistake = true;   // Too long; read on to the end of it anyway
+            tkh_private_ring_consume(tkh, (newlined && t == NULL) ? k + 1 : k);
         }
-        UNLOCK;
         if (!newlined) {
             int ret = tkh_wait_for_next_buffer(tkh);
             if (ret < 0) {
@@ -335,17 +522,40 @@ char* tkh_flex_read(Ticklish *tkh, bool dollared) {
             }
         }
     } while (!newlined);
-    if (mistake) {
+    if (mistake) return -1;
+    (*target)[i] = 0;
+    return i;
+}
+
+int tkh_flex_read_into(Ticklish *tkh, bool dollared, char *target, int max_length) {
+    if (tkh->buffer == NULL || max_length < 1) return -1;
+    return tkh_private_flex_read(tkh, dollared, &target, &max_length, false);
+}
+
+char* tkh_flex_read(Ticklish *tkh, bool dollared) {
+    if (tkh->buffer == NULL) return NULL;
+    int N = 64;
+    char* buffer = (char*)malloc(N);
+    if (tkh_private_flex_read(tkh, dollared, &buffer, &N, true) < 0) {
         free((void*)buffer);
         return NULL;
     }
-    else {
-        buffer[i] = 0;
-        return buffer;
-    }
+    return buffer;
 }
 
 void tkh_write(Ticklish *tkh, const char *s) {
+    tkh_write_bytes(tkh, s, strnlen(s, TICKLISH_MAX_OUT));
+}
+
+bool tkh_private_vouch(Ticklish *tkh);
+
+// Writes to a port already open, saying whether it worked rather than setting error_value
+bool tkh_private_put_bytes(Ticklish *tkh, const char *s, int n) {
+    if (n > TICKLISH_MAX_OUT) n = TICKLISH_MAX_OUT;
+    return sp_blocking_write(tkh->my_port, s, n, TICKLISH_PATIENCE) == n;
+}
+
+void tkh_write_bytes(Ticklish *tkh, const char *s, int n) {
     LOCKON;
     tkh->error_value = 0;
     if (!tkh_is_connected(tkh)) {
@@ -353,9 +563,8 @@ void tkh_write(Ticklish *tkh, const char *s) {
     }
     UNLOCK;
     if (tkh->error_value != 0) return;
-    int n = strnlen(s, TICKLISH_MAX_OUT);
-    enum sp_return ret = sp_blocking_write(tkh->my_port, s, n, TICKLISH_PATIENCE);
-    if (ret != n) {
+    if (!tkh->vouched && !tkh_private_vouch(tkh)) return;
+    if (!tkh_private_put_bytes(tkh, s, n)) {
         LOCKON;
         tkh->error_value = -1;
         UNLOCK;
@@ -363,13 +572,53 @@ void tkh_write(Ticklish *tkh, const char *s) {
 }
 
 
-char* tkh_query(Ticklish *tkh, const char *ask, int n) {
+// Sends a query and reads its reply into target: `n` bytes after `~`, or if n is 0, a line after `$`
+int tkh_private_query_into(Ticklish *tkh, const char *ask, int n, char *target, int max_length) {
     LOCKON;
     tkh->error_value = 0;
     UNLOCK;
+    if (n >= max_length) return -1;
+    if (tkh_private_is_pumped(tkh)) {
+        // Wait in line like any other request, but with the reply going straight to the caller
+        TkhRequest req;
+        memset(&req, 0, sizeof(TkhRequest));
+        req.n = n;
+        req.reply = target;
+        req.room = max_length;
+        req.borrowed = true;
+        if (!tkh_private_line_up(tkh, ask, &req)) {
+            LOCKON;
+            tkh->error_value = -1;
+            UNLOCK;
+            return -1;
+        }
+        if (!tkh_private_wait_for_reply(tkh, &req, TICKLISH_PATIENCE) || req.failed) return -1;
+        return req.got;
+    }
     tkh_write(tkh, ask);
-    if (tkh->error_value) return NULL;
-    return tkh_fixed_read(tkh, n, false);
+    if (tkh->error_value) return -1;
+    if (n > 0) return tkh_fixed_read_into(tkh, n, false, target, max_length);
+    else return tkh_flex_read_into(tkh, false, target, max_length);
+}
+
+int tkh_query_into(Ticklish *tkh, const char *ask, int n, char *target, int max_length) {
+    if (n <= 0) return -1;
+    return tkh_private_query_into(tkh, ask, n, target, max_length);
+}
+
+int tkh_flex_query_into(Ticklish *tkh, const char *ask, char *target, int max_length) {
+    return tkh_private_query_into(tkh, ask, 0, target, max_length);
+}
+
+
+char* tkh_query(Ticklish *tkh, const char *ask, int n) {
+    if (n <= 0) return NULL;
+    char* reply = (char*)malloc(n+1);
+    if (tkh_query_into(tkh, ask, n, reply, n+1) < 0) {
+        free((void*)reply);
+        return NULL;
+    }
+    return reply;
 }
 
 
@@ -377,6 +626,7 @@ char* tkh_flex_query(Ticklish *tkh, const char *ask) {
     LOCKON;
     tkh->error_value = 0;
     UNLOCK;
+    if (tkh_private_is_pumped(tkh)) return tkh_await(tkh, tkh_flex_send(tkh, ask), TICKLISH_PATIENCE);
     tkh_write(tkh, ask);
     if (tkh->error_value) return NULL;
     return tkh_flex_read(tkh, false);
@@ -384,33 +634,20 @@ char* tkh_flex_query(Ticklish *tkh, const char *ask) {
 
 
 bool tkh_is_ticklish(Ticklish *tkh) {
-    char* reply = tkh_flex_query(tkh, "~?");
-    if (reply == NULL) return false;
-    bool ans = (tkh->error_value == 0) && tkh_string_is_ticklish(reply);
-    free((void*)reply);
-    return ans;
+    char reply[TICKLISH_LINE_N];
+    if (tkh_flex_query_into(tkh, "~?", reply, TICKLISH_LINE_N) < 0) return false;
+    return (tkh->error_value == 0) && tkh_string_is_ticklish(reply);
 }
 
 
-char* tkh_id(Ticklish *tkh) {
-    if (tkh->my_id != NULL) {
-        LOCKON;
-        char* ans = (tkh->my_id != NULL) ? strdup((char*)tkh->my_id) : NULL;
-        UNLOCK;
-        if (ans != NULL) return ans;
-    }
-    char* reply = tkh_flex_query(tkh, "~?");
-    if (reply == NULL) return NULL;
-    if (tkh->error_value != 0) {
-        free((void*) reply);
-        return NULL;
-    }
+// Keeps the name and version from a reply to `~?`, so they needn't be asked for again
+bool tkh_private_remember_id(Ticklish *tkh, const char *reply) {
     char name[64];
     char version[4];
-    tkh_decode_name_into(reply, name, 60, version);
-    char* my_name = strndup(name, 60);
-    free((void*) reply);
+    if (tkh_decode_name_into(reply, name, 60, version) < 0) return false;
+    char* my_name = strdup(name);
     LOCKON;
+    if (tkh->my_id != NULL) free((void*)tkh->my_id);
     tkh->my_id = my_name;
     // Manually unrolled assignment due to volatile modifier not playing nice with strncpy
     tkh->version[0] = version[0];
@@ -418,26 +655,75 @@ char* tkh_id(Ticklish *tkh) {
     tkh->version[2] = version[2];
     tkh->version[3] = version[3];
     UNLOCK;
-    char* ans = strdup(my_name);
-    return ans;
+    return true;
+}
+
+void tkh_private_cache_note(Ticklish *tkh);
+
+int tkh_id_into(Ticklish *tkh, char *target, int max_length) {
+    LOCKON;
+    bool known = tkh->my_id != NULL;
+    int n = known ? (int)strlen((char*)tkh->my_id) : -1;
+    if (known && n < max_length) memcpy(target, (char*)tkh->my_id, n + 1);
+    UNLOCK;
+    if (known) return (n < max_length) ? n : -1;
+    char reply[TICKLISH_LINE_N];
+    if (tkh_flex_query_into(tkh, "~?", reply, TICKLISH_LINE_N) < 0) return -1;
+    if (tkh->error_value != 0) return -1;
+    if (!tkh_private_remember_id(tkh, reply)) return -1;
+    tkh_private_cache_note(tkh);
+    LOCKON;
+    n = strlen((char*)tkh->my_id);
+    if (n < max_length) memcpy(target, (char*)tkh->my_id, n + 1);
+    UNLOCK;
+    return (n < max_length) ? n : -1;
+}
+
+char* tkh_id(Ticklish *tkh) {
+    char name[64];
+    if (tkh_id_into(tkh, name, 64) < 0) return NULL;
+    return strdup(name);
 }
 
 
 enum TkhState tkh_state(Ticklish *tkh) {
-    char* reply = tkh_query(tkh, "~@", 1);
-    if (reply == NULL) return TKH_UNKNOWN;
-    enum TkhState ans = (tkh->error_value == 0) ? tkh_decode_state(reply) : TKH_UNKNOWN;
-    free((void*) reply);
-    return ans;
+    char reply[2];
+    if (tkh_query_into(tkh, "~@", 1, reply, 2) < 0) return TKH_UNKNOWN;
+    return (tkh->error_value == 0) ? tkh_decode_state(reply) : TKH_UNKNOWN;
+}
+
+unsigned int tkh_private_read_le32(const unsigned char *b) {
+    return ((unsigned int)b[0]) | (((unsigned int)b[1]) << 8) | (((unsigned int)b[2]) << 16) | (((unsigned int)b[3]) << 24);
+}
+
+#define TKH_SNAPSHOT_PACKET 55
+#define TKH_SNAPSHOT_BITS 14
+
+bool tkh_snapshot(Ticklish *tkh, TkhSnapshot *snapshot) {
+    unsigned char reply[TKH_SNAPSHOT_PACKET];
+    if (tkh_query_into(tkh, "~=", TKH_SNAPSHOT_PACKET - 1, (char*)reply, TKH_SNAPSHOT_PACKET) < 0) return false;
+    bool ok = (tkh->error_value == 0) && reply[0] == '=';
+    if (ok) {
+        snapshot->state = tkh_char_to_state((char)reply[1]);
+        snapshot->ticks = (long long)(tkh_private_read_le32(reply + 2) | (((unsigned long long)tkh_private_read_le32(reply + 6)) << 32));
+        int bit = 10*8;
+        for (int i = 0; i < TKH_CHANNELS; i++) {
+            unsigned int x = 0;
+            for (int k = 0; k < TKH_SNAPSHOT_BITS; k++, bit++) {
+                if (reply[bit >> 3] & (1 << (bit & 7))) x |= 1u << k;
+            }
+            snapshot->runlevel[i] = x & 0x3;
+            snapshot->train[i] = x >> 2;
+        }
+    }
+    return ok;
 }
 
 
 bool tkh_ping(Ticklish *tkh) {
-    char* reply = tkh_flex_query(tkh, "~'");
-    if (reply == NULL) return false;
-    bool ans = (tkh->error_value == 0) && !(*reply);
-    free((void*) reply);
-    return ans;
+    char reply[TICKLISH_LINE_N];
+    if (tkh_flex_query_into(tkh, "~'", reply, TICKLISH_LINE_N) < 0) return false;
+    return (tkh->error_value == 0) && !(*reply);
 }
 
 
@@ -462,8 +748,21 @@ bool tkh_is_run(Ticklish *tkh) { return tkh_state(tkh) == TKH_RUNNING; }
 
 bool tkh_is_done(Ticklish *tkh) { return tkh_state(tkh) == TKH_ALLDONE; }
 
+bool tkh_is_armed(Ticklish *tkh) { return tkh_state(tkh) == TKH_ARMED; }
 
-TkhTimed tkh_timesync(Ticklish *tkh) {
+void tkh_state_all(Ticklish **tkhs, int n, enum TkhState *states) {
+    if (n <= 0) return;
+    TkhRequest *requests[n];
+    for (int i = 0; i < n; i++) requests[i] = tkh_send(tkhs[i], "~@", 1);
+    for (int i = 0; i < n; i++) {
+        char reply[2];
+        bool ok = tkh_await_into(tkhs[i], requests[i], TICKLISH_PATIENCE, reply, 2) >= 0;
+        states[i] = ok ? tkh_decode_state(reply) : TKH_UNKNOWN;
+    }
+}
+
+
+TkhTimed tkh_private_timesync(Ticklish *tkh, const char *ask) {
     struct timeval tv0, tv1;
     TkhTimed tkt;
     tkh_timed_init(&tkt);
@@ -475,27 +774,22 @@ TkhTimed tkh_timesync(Ticklish *tkh) {
         UNLOCK;
         return tkt;
     }
-    char* reply = tkh_flex_query(tkh, "~#");
-    if (reply == NULL) {
+    char reply[TICKLISH_LINE_N];
+    if (tkh_flex_query_into(tkh, ask, reply, TICKLISH_LINE_N) < 0) {
         LOCKON;
         tkh->error_value = -1;
         UNLOCK;
         return tkt;
     }
-    if (tkh->error_value != 0) {
-        free((void*) reply);
-        return tkt;
-    }
+    if (tkh->error_value != 0) return tkt;
     errorcode = gettimeofday(&tv1, NULL);
     if (errorcode || !tkh_string_is_time_report(reply)) {
         LOCKON;
         tkh->error_value = -1;
         UNLOCK;
-        free((void*) reply);
         return tkt;
     }
     struct timeval tvb = tkh_decode_time(reply);
-    free((void*) reply);
     struct timeval tvw = tv1;
     tkh_timeval_minus_eq(&tvw, &tv0);
     if (tkh_timeval_compare(&tv1, &tv0) == 0) { tvw.tv_usec = 5000; }  // Recklessly guess 5 ms difference
@@ -507,11 +801,18 @@ TkhTimed tkh_timesync(Ticklish *tkh) {
     return tkt;
 }
 
+TkhTimed tkh_timesync(Ticklish *tkh) {
+    return tkh_private_timesync(tkh, "~#");
+}
+
+TkhTimed tkh_board_timesync(Ticklish *tkh) {
+    return tkh_private_timesync(tkh, "~,");
+}
+
 double tkh_get_drift(Ticklish *tkh) {
-    char *reply = tkh_query(tkh, "~^+00000000?", 11);
-    double ans = tkh_decode_drift(reply);
-    free((void*) reply);
-    return ans;
+    char reply[12];
+    if (tkh_query_into(tkh, "~^+00000000?", 11, reply, 12) < 0) return NAN;
+    return tkh_decode_drift(reply+1);
 }
 
 double tkh_set_drift(Ticklish *tkh, double drift, bool writeEEPROM) {
@@ -522,12 +823,68 @@ double tkh_set_drift(Ticklish *tkh, double drift, bool writeEEPROM) {
     tkh_encode_drift_into(drift, buffer+2, 13);
     buffer[11] = (writeEEPROM) ? '!' : '.';
     buffer[12] = 0;
-    char *reply = tkh_query(tkh, buffer, 11);
-    double ans = tkh_decode_drift(reply);
-    free((void*) reply);
-    return ans;
+    char reply[12];
+    if (tkh_query_into(tkh, buffer, 11, reply, 12) < 0) return NAN;
+    return tkh_decode_drift(reply+1);
+}
+
+double tkh_get_fine_drift(Ticklish *tkh) {
+    char reply[12];
+    if (tkh_query_into(tkh, "~%+00000000?", 11, reply, 12) < 0) return NAN;
+    return tkh_decode_fine_drift(reply+1);
+}
+
+double tkh_set_fine_drift(Ticklish *tkh, double drift, bool writeEEPROM) {
+    char buffer[16];
+    if (fabs(drift) > TKH_MAX_FINE_DRIFT) return NAN;
+    if (tkh_is_error(tkh)) return NAN;
+    buffer[0] = '~';
+    buffer[1] = '%';
+    tkh_encode_fine_drift_into(drift, buffer+2, 13);
+    buffer[11] = (writeEEPROM) ? '!' : '.';
+    buffer[12] = 0;
+    char reply[12];
+    if (tkh_query_into(tkh, buffer, 11, reply, 12) < 0) return NAN;
+    return tkh_decode_fine_drift(reply+1);
+}
+
+bool tkh_discipline_start(Ticklish *tkh, char channel, bool rising, double period) {
+    if (channel < 'A' || channel > 'W') return false;
+    long us = lrint(period * 1e6);
+    if (us < 10000 || us > 20000000) return false;
+    char ask[TICKLISH_MAX_OUT];
+    snprintf(ask, TICKLISH_MAX_OUT, "~-%c%c%08ld", channel, rising ? '+' : '-', us);
+    tkh_write(tkh, ask);
+    return tkh->error_value == 0 && tkh_ping(tkh);
 }
 
+bool tkh_discipline_stop(Ticklish *tkh) {
+    tkh_write(tkh, "~-.+00000000");
+    return tkh->error_value == 0 && tkh_ping(tkh);
+}
+
+bool tkh_discipline(Ticklish *tkh, TkhDiscipline *discipline) {
+    char reply[29];
+    if (tkh_query_into(tkh, "~`", 28, reply, 29) < 0) return false;
+    bool ok = (tkh->error_value == 0) && reply[0] == '`';
+    ok = ok && (reply[2] == '+' || reply[2] == '-') && (reply[11] == '+' || reply[11] == '-');
+    for (int i = 3; ok && i < 28; i++) ok = (i == 11) || (reply[i] >= '0' && reply[i] <= '9');
+    if (ok) {
+        long phase = 0, fine = 0, edges = 0;
+        for (int i = 3; i < 11; i++) phase = 10*phase + (reply[i] - '0');
+        for (int i = 12; i < 20; i++) fine = 10*fine + (reply[i] - '0');
+        for (int i = 20; i < 28; i++) edges = 10*edges + (reply[i] - '0');
+        discipline->on = reply[1] != '.';
+        discipline->locked = reply[1] == '!';
+        discipline->phase = ((reply[2] == '-') ? -phase : phase) / (double)TKH_TICKS_PER_SECOND;
+        discipline->drift = ((reply[11] == '-') ? -fine : fine) * 1e-10;
+        discipline->edges = (unsigned int)edges;
+    }
+    return ok;
+}
+
+int tkh_private_apply_drift(Ticklish *tkh, double drift, double minDrift, bool writeEEPROM);
+
 int tkh_fix_drift(Ticklish *tkh, TkhTimed *first, TkhTimed *second, double minDrift, bool writeEEPROM) {
     struct timeval zero_tv = second->zero;
     tkh_timeval_minus_eq(&zero_tv, &(first->zero));
@@ -536,17 +893,261 @@ int tkh_fix_drift(Ticklish *tkh, TkhTimed *first, TkhTimed *second, double minDr
     tkh_timeval_minus_eq(&board_tv, &(first->board_at));
     double delta_board = tkh_timeval_to_double(&board_tv);
     double drift = (delta_board == 0) ? 0 : delta_zero/delta_board;
-    double already = tkh_get_drift(tkh);
+    return tkh_private_apply_drift(tkh, drift, minDrift, writeEEPROM);
+}
+
+// Adds `drift` (if it's big enough to bother with) to the correction the board already applies
+int tkh_private_apply_drift(Ticklish *tkh, double drift, double minDrift, bool writeEEPROM) {
+    double already = tkh_get_fine_drift(tkh);
     if (fabs(drift) < minDrift) return 0;
-    if (isnan(already) || isnan(tkh_set_drift(tkh, drift + already, writeEEPROM))) return -1;
+    if (isnan(already)) return -1;
+    if (fabs(drift + already) <= TKH_MAX_FINE_DRIFT) {
+        if (isnan(tkh_set_fine_drift(tkh, drift + already, writeEEPROM))) return -1;
+    }
+    else if (isnan(tkh_set_drift(tkh, drift + already, writeEEPROM))) return -1;
     if (tkh_is_error(tkh)) return -1;
     return 1;
 }
 
 int tkh_zero_drift(Ticklish *tkh) {
-    char *reply = tkh_query(tkh, "~^+00000000.", 11);
-    int ans = isnan(tkh_decode_drift(reply));
-    free((void*) reply);
+    char reply[12];
+    if (tkh_query_into(tkh, "~^+00000000.", 11, reply, 12) < 0) return 1;
+    return isnan(tkh_decode_drift(reply+1));
+}
+
+#define TKH_CLOCK_SAMPLES 64
+
+typedef struct TkhClockSample {
+    double board;                // Board clock reading...
+    double host;                 // ...at about this host time (halfway through the round trip)
+    double rtt;                  // How long the round trip took
+} TkhClockSample;
+
+typedef struct TkhClock {
+    TkhClockSample samples[TKH_CLOCK_SAMPLES];  // Oldest overwritten first
+    int count;
+    int next;
+    TkhClockFit fit;
+    pthread_t thread;
+    bool sampling;               // Background thread is running...
+    volatile bool stopping;      // ...but has been asked to stop
+    double interval;
+    int burst;
+} TkhClock;
+
+double tkh_host_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+// Reads the board clock once, noting when (by the host clock) and how long it took.  If `lined`,
+// the request waits in the reader's line and error_value is left to the caller's thread.
+bool tkh_private_clock_read(Ticklish *tkh, TkhClockSample *sample, bool lined) {
+    char reply[TICKLISH_LINE_N];
+    double t0 = tkh_host_now();
+    if (lined) {
+        TkhRequest req;
+        memset(&req, 0, sizeof(TkhRequest));
+        req.reply = reply;
+        req.room = TICKLISH_LINE_N;
+        req.borrowed = true;
+        if (!tkh_private_line_up(tkh, "~,", &req)) return false;
+        if (!tkh_private_wait_for_reply(tkh, &req, TICKLISH_PATIENCE) || req.failed) return false;
+    }
+    else if (tkh_flex_query_into(tkh, "~,", reply, TICKLISH_LINE_N) < 0 || tkh->error_value != 0) return false;
+    double t1 = tkh_host_now();
+    if (!tkh_string_is_time_report(reply)) return false;
+    struct timeval tv = tkh_decode_time(reply);
+    sample->board = tv.tv_sec + 1e-6*tv.tv_usec;
+    sample->host = 0.5*(t0 + t1);
+    sample->rtt = t1 - t0;
+    return true;
+}
+
+// Least squares fit of host time against board time over the chosen samples
+void tkh_private_clock_line(const TkhClockSample *samples, const int *chosen, int m, TkhClockFit *fit) {
+    double mb = 0, mh = 0;
+    for (int i = 0; i < m; i++) { mb += samples[chosen[i]].board; mh += samples[chosen[i]].host; }
+    mb /= m;
+    mh /= m;
+    double sxx = 0, sxy = 0;
+    for (int i = 0; i < m; i++) {
+        double db = samples[chosen[i]].board - mb;
+        sxx += db*db;
+        sxy += db*(samples[chosen[i]].host - mh);
+    }
+    fit->n = m;
+    fit->board_mean = mb;
+    fit->host_mean = mh;
+    fit->rate = (sxx > 0) ? sxy/sxx : 1;
+    fit->sxx = sxx;
+}
+
+int tkh_private_compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+void tkh_private_clock_refit(TkhClock *clk) {
+    int n = clk->count;
+    double sorted[TKH_CLOCK_SAMPLES];
+    int chosen[TKH_CLOCK_SAMPLES];
+    if (n < 3) { clk->fit.n = 0; return; }
+    // Slow round trips were held up somewhere along the way, so only the quicker half (but at least 3) are used
+    for (int i = 0; i < n; i++) sorted[i] = clk->samples[i].rtt;
+    qsort(sorted, n, sizeof(double), tkh_private_compare_doubles);
+    double cutoff = sorted[((n - 1)/2 < 2) ? 2 : (n - 1)/2];
+    int m = 0;
+    for (int i = 0; i < n; i++) if (clk->samples[i].rtt <= cutoff) chosen[m++] = i;
+    TkhClockFit fit;
+    tkh_private_clock_line(clk->samples, chosen, m, &fit);
+    // Then any still well off the line (by the median absolute deviation) are dropped too
+    for (int i = 0; i < m; i++) {
+        const TkhClockSample *x = clk->samples + chosen[i];
+        sorted[i] = fabs(x->host - fit.host_mean - fit.rate*(x->board - fit.board_mean));
+    }
+    qsort(sorted, m, sizeof(double), tkh_private_compare_doubles);
+    double limit = 3*1.4826*sorted[(m - 1)/2] + 1e-6;
+    int k = 0;
+    for (int i = 0; i < m; i++) {
+        const TkhClockSample *x = clk->samples + chosen[i];
+        if (fabs(x->host - fit.host_mean - fit.rate*(x->board - fit.board_mean)) <= limit) chosen[k++] = chosen[i];
+    }
+    if (k >= 3 && k < m) {
+        m = k;
+        tkh_private_clock_line(clk->samples, chosen, m, &fit);
+    }
+    double ss = 0, quickest = INFINITY;
+    for (int i = 0; i < m; i++) {
+        const TkhClockSample *x = clk->samples + chosen[i];
+        double r = x->host - fit.host_mean - fit.rate*(x->board - fit.board_mean);
+        ss += r*r;
+        if (x->rtt < quickest) quickest = x->rtt;
+    }
+    fit.spread = (m > 2) ? sqrt(ss/(m - 2)) : 0;
+    fit.latency = 0.5*quickest;
+    clk->fit = fit;
+}
+
+// The clock state, made if there isn't one yet; call with the lock held
+TkhClock* tkh_private_clock(Ticklish *tkh) {
+    if (tkh->clock == NULL) tkh->clock = (TkhClock*)calloc(1, sizeof(TkhClock));
+    return tkh->clock;
+}
+
+// Keeps the quickest of a burst of clock readings
+bool tkh_private_clock_sample(Ticklish *tkh, int burst, bool lined) {
+    TkhClockSample best, x;
+    bool any = false;
+    for (int i = 0; i < burst; i++) {
+        if (!tkh_private_clock_read(tkh, &x, lined)) continue;
+        if (!any || x.rtt < best.rtt) best = x;
+        any = true;
+    }
+    if (!any) return false;
+    LOCKON;
+    TkhClock *clk = tkh_private_clock(tkh);
+    int last = (clk->next + TKH_CLOCK_SAMPLES - 1) % TKH_CLOCK_SAMPLES;
+    if (clk->count > 0 && best.board < clk->samples[last].board) clk->count = clk->next = 0;
+    clk->samples[clk->next] = best;
+    clk->next = (clk->next + 1) % TKH_CLOCK_SAMPLES;
+    if (clk->count < TKH_CLOCK_SAMPLES) clk->count++;
+    tkh_private_clock_refit(clk);
+    UNLOCK;
+    return true;
+}
+
+bool tkh_clock_sample(Ticklish *tkh, int burst) {
+    return tkh_private_clock_sample(tkh, burst, tkh_private_is_pumped(tkh));
+}
+
+bool tkh_clock_fit(Ticklish *tkh, TkhClockFit *fit) {
+    LOCKON;
+    bool ok = tkh->clock != NULL && tkh->clock->fit.n >= 3;
+    if (ok) *fit = tkh->clock->fit;
+    UNLOCK;
+    return ok;
+}
+
+void tkh_clock_forget(Ticklish *tkh) {
+    LOCKON;
+    if (tkh->clock != NULL) {
+        tkh->clock->count = tkh->clock->next = 0;
+        tkh->clock->fit.n = 0;
+    }
+    UNLOCK;
+}
+
+double tkh_board_to_host(const TkhClockFit *fit, double board, double *error) {
+    double d = board - fit->board_mean;
+    if (error != NULL) {
+        double se = (fit->n > 0 && fit->sxx > 0) ? fit->spread*sqrt(1.0/fit->n + d*d/fit->sxx) : INFINITY;
+        *error = fit->latency + 3*se;
+    }
+    return fit->host_mean + fit->rate*d;
+}
+
+double tkh_host_to_board(const TkhClockFit *fit, double host, double *error) {
+    double board = fit->board_mean + (host - fit->host_mean)/fit->rate;
+    if (error != NULL) tkh_board_to_host(fit, board, error);
+    return board;
+}
+
+void* tkh_private_clock_sampler(void *arg) {
+    Ticklish *tkh = (Ticklish*)arg;
+    TkhClock *clk = tkh->clock;
+    while (!clk->stopping) {
+        // Always through the line, so as to leave error_value and the ring to the caller's thread
+        tkh_private_clock_sample(tkh, clk->burst, true);
+        struct timespec until;
+        tkh_private_deadline(&until, (int)lrint(1000*clk->interval));
+        LOCKON;
+        int ret = 0;
+        while (!clk->stopping && ret == 0) ret = pthread_cond_timedwait(&(tkh->arrived), &(tkh->my_mutex), &until);
+        UNLOCK;
+    }
+    return NULL;
+}
+
+bool tkh_clock_start(Ticklish *tkh, double interval, int burst) {
+    if (interval < 0.01 || burst < 1) return false;
+    if (!tkh_reader_start(tkh)) return false;
+    LOCKON;
+    TkhClock *clk = tkh_private_clock(tkh);
+    bool ok = !clk->sampling;
+    if (ok) {
+        clk->interval = interval;
+        clk->burst = burst;
+        clk->stopping = false;
+        clk->sampling = pthread_create(&(clk->thread), NULL, tkh_private_clock_sampler, (void*)tkh) == 0;
+        ok = clk->sampling;
+    }
+    UNLOCK;
+    return ok;
+}
+
+void tkh_clock_stop(Ticklish *tkh) {
+    LOCKON;
+    TkhClock *clk = tkh->clock;
+    bool mine = clk != NULL && clk->sampling && !clk->stopping;
+    if (mine) {
+        clk->stopping = true;
+        pthread_cond_broadcast(&(tkh->arrived));
+    }
+    UNLOCK;
+    if (!mine) return;
+    pthread_join(clk->thread, NULL);
+    LOCKON;
+    clk->sampling = false;
+    UNLOCK;
+}
+
+int tkh_clock_fix_drift(Ticklish *tkh, double minDrift, bool writeEEPROM) {
+    TkhClockFit fit;
+    if (!tkh_clock_fit(tkh, &fit)) return -1;
+    int ans = tkh_private_apply_drift(tkh, fit.rate - 1, minDrift, writeEEPROM);
+    if (ans > 0) tkh_clock_forget(tkh);
     return ans;
 }
 
@@ -579,17 +1180,12 @@ void tkh_set(Ticklish *tkh, TkhDigital *protocols, int n) {
             tkh_write(tkh, buffer);
             if (tkh->error_value != 0) return;
         }
-        char *cmd = tkh_digital_to_string(protocols + i, true);
-        if (cmd == NULL) {
+        if (tkh_digital_to_string_into(protocols + i, true, buffer + 2, 62) < 0) {
             LOCKON;
             tkh->error_value = -1;
             UNLOCK;
             return;
         }
-        int l = strnlen(cmd, 61);
-        memcpy(buffer + 2, cmd, l);
-        free((void*) cmd);
-        buffer[l+2] = 0;
         counts[channel - 'A']++;
         tkh_write(tkh, buffer);
         if (tkh->error_value != 0) return;
@@ -597,21 +1193,913 @@ void tkh_set(Ticklish *tkh, TkhDigital *protocols, int n) {
     }
 }
 
-TkhTimed tkh_run(Ticklish *tkh) {
-    TkhTimed tkt;
-    tkh_timed_init(&tkt);
-    enum TkhState state = tkh_state(tkh);
-    switch(state) {
-        case TKH_PROGRAM: break;
-        case TKH_ALLDONE:
-            tkh_write(tkh, "~\"");
-            if (!tkh_ping(tkh)) return tkt;
-            break;
-        default: return tkt;
+void tkh_private_pack_le32(unsigned char *target, long long x) {
+    for (int i = 0; i < 4; i++) target[i] = (unsigned char)((x >> (8*i)) & 0xFF);
+}
+
+bool tkh_private_pack_digital(TkhDigital *tdg, bool append, unsigned char *target) {
+    long long fields[6] = { tdg->duration, tdg->delay, tdg->block_high, tdg->block_low, tdg->pulse_high, tdg->pulse_low };
+    target[0] = tdg->channel;
+    target[1] = (append ? TKH_BIN_APPEND : 0) | (tdg->upright ? 0 : TKH_BIN_INVERT);
+    for (int i = 0; i < 6; i++) {
+        if (fields[i] < 0 || fields[i] > 0xFFFFFFFFLL) return false;
+        tkh_private_pack_le32(target + 2 + 4*i, fields[i]);
     }
-    tkh_write(tkh, "~*");
-    if (tkh->error_value != 0 || !tkh_ping(tkh)) return tkt;
-    else return tkh_timesync(tkh);
+    return true;
+}
+
+#define TKH_BIN_WINDOW 16
+
+// Waits for the `~]` that acknowledges a frame sent through the reader's line
+bool tkh_private_binary_acked(Ticklish *tkh, TkhRequest *req, int patience) {
+    return tkh_private_wait_for_reply(tkh, req, patience) && !req->failed && req->reply[0] == ']';
+}
+
+// Sends protocols as binary frames; all are appended if `stream`, else only repeat channels are.
+void tkh_private_send_binary(Ticklish *tkh, TkhDigital *protocols, int n, bool stream) {
+    int counts[24];
+    if (!tkh_private_check_channels(protocols, n)) {
+        LOCKON;
+        tkh->error_value = -1;
+        UNLOCK;
+        return;
+    }
+    int i, j;
+    for (j = 0; j < 24; j++) counts[j] = 0;
+    unsigned char buffer[TICKLISH_MAX_OUT];
+    // With the reader running, each frame waits in line for its `~]` like any query; up to
+    // TKH_BIN_WINDOW are in flight at once, each with a request (and reply) of its own here
+    bool pumped = tkh_private_is_pumped(tkh);
+    TkhRequest acks[TKH_BIN_WINDOW];
+    char replies[TKH_BIN_WINDOW][2];
+    int sent = 0, acked = 0;
+    bool ok = true;
+    for (i = 0; ok && i < n; i += TKH_BIN_MAX_RECORDS) {
+        int m = (n - i < TKH_BIN_MAX_RECORDS) ? n - i : TKH_BIN_MAX_RECORDS;
+        buffer[0] = '~';
+        buffer[1] = '[';
+        buffer[2] = (unsigned char)m;
+        for (j = 0; ok && j < m; j++) {
+            char channel = protocols[i+j].channel;
+            bool append = stream || counts[channel - 'A'] > 0;
+            ok = tkh_private_pack_digital(protocols + i + j, append, buffer + 3 + j*TKH_BIN_RECORD);
+            counts[channel - 'A']++;
+        }
+        if (!ok) break;
+        int l = 3 + m*TKH_BIN_RECORD;
+        unsigned short crc = tkh_crc16(buffer + 2, l - 2);
+        buffer[l] = (unsigned char)(crc & 0xFF);
+        buffer[l+1] = (unsigned char)(crc >> 8);
+        if (pumped) {
+            if (sent - acked == TKH_BIN_WINDOW) {
+                ok = tkh_private_binary_acked(tkh, acks + (acked % TKH_BIN_WINDOW), TICKLISH_PATIENCE);
+                acked++;
+                if (!ok) break;
+            }
+            TkhRequest *req = acks + (sent % TKH_BIN_WINDOW);
+            memset(req, 0, sizeof(TkhRequest));
+            req->n = 1;
+            req->reply = replies[sent % TKH_BIN_WINDOW];
+            req->room = 2;
+            req->borrowed = true;
+            ok = tkh_private_line_up_bytes(tkh, (const char*)buffer, l + 2, req);
+        }
+        else {
+            tkh_write_bytes(tkh, (const char*)buffer, l + 2);
+            ok = tkh->error_value == 0;
+        }
+        if (ok) sent++;
+    }
+    // Frames are acknowledged in order, so we only need to wait once they're all sent.  Requests
+    // still in line must be seen to (if only by giving up on them at once) before they go out of scope.
+    for (; acked < sent && (ok || pumped); acked++) {
+        if (pumped) {
+            bool ack = tkh_private_binary_acked(tkh, acks + (acked % TKH_BIN_WINDOW), ok ? TICKLISH_PATIENCE : 0);
+            ok = ok && ack;
+        }
+        else {
+            char reply[2];
+            ok = tkh_fixed_read_into(tkh, 1, false, reply, 2) == 1 && reply[0] == ']';
+        }
+    }
+    if (!ok) {
+        LOCKON;
+        tkh->error_value = -1;
+        UNLOCK;
+    }
+}
+
+void tkh_set_binary(Ticklish *tkh, TkhDigital *protocols, int n) {
+    tkh_private_send_binary(tkh, protocols, n, false);
+}
+
+// Sends `command` and reads the `~&1234` reply
+int tkh_private_credits(Ticklish *tkh, const char *command) {
+    char reply[6];
+    if (tkh_query_into(tkh, command, 5, reply, 6) < 0) return -1;
+    int credits = (reply[0] == '&') ? 0 : -1;
+    for (int i = 1; i < 5 && credits >= 0; i++)
+        credits = isdigit(reply[i]) ? 10*credits + (reply[i] - '0') : -1;
+    return credits;
+}
+
+int tkh_stream_credits(Ticklish *tkh) {
+    return tkh_private_credits(tkh, "~&");
+}
+
+int tkh_stream_enable(Ticklish *tkh) {
+    if (!tkh_is_prog(tkh)) return -1;
+    return tkh_private_credits(tkh, "~!");
+}
+
+int tkh_stream(Ticklish *tkh, TkhDigital *protocols, int n) {
+    if (n <= 0) return 0;
+    int credits = tkh_stream_credits(tkh);
+    if (credits < 0) return -1;
+    if (credits < n) n = credits;
+    if (n == 0) return 0;
+    tkh_private_send_binary(tkh, protocols, n, true);
+    return (tkh->error_value != 0) ? -1 : n;
+}
+
+TkhTimed tkh_run(Ticklish *tkh) {
+    TkhTimed tkt;
+    tkh_timed_init(&tkt);
+    enum TkhState state = tkh_state(tkh);
+    switch(state) {
+        case TKH_PROGRAM: break;
+        case TKH_ALLDONE:
+            tkh_write(tkh, "~\"");
+            if (!tkh_ping(tkh)) return tkt;
+            break;
+        default: return tkt;
+    }
+    tkh_write(tkh, "~*");
+    if (tkh->error_value != 0 || !tkh_ping(tkh)) return tkt;
+    else return tkh_timesync(tkh);
+}
+
+bool tkh_arm(Ticklish *tkh, char channel, bool rising, char mode) {
+    if (channel < 'A' || channel > 'W') return false;
+    if (mode != '*' && mode != '+' && mode != '>') return false;
+    char ask[TICKLISH_MAX_OUT] = { '~', '_', channel, rising ? '+' : '-', mode, 0 };
+    tkh_write(tkh, ask);
+    return tkh->error_value == 0 && tkh_state(tkh) == TKH_ARMED;
+}
+
+bool tkh_run_at(Ticklish *tkh, const struct timeval *board_time, char mode) {
+    if (mode != '*' && mode != '+' && mode != '>') return false;
+    if (!tkh_timeval_is_valid(board_time) || board_time->tv_sec < 0 || board_time->tv_sec > 99999999) return false;
+    char ask[TICKLISH_MAX_OUT];
+    snprintf(ask, TICKLISH_MAX_OUT, "~:%c%08ld.%06ld", mode, (long)board_time->tv_sec, (long)board_time->tv_usec);
+    tkh_write(tkh, ask);
+    return tkh->error_value == 0 && tkh_state(tkh) == TKH_ARMED;
+}
+
+#define TKH_SYNC_TRIES 8
+
+/* Reads the board clock a few times and keeps the reading that came back quickest */
+TkhTimed tkh_private_best_board_timesync(Ticklish *tkh) {
+    TkhTimed best;
+    tkh_timed_init(&best);
+    for (int i = 0; i < TKH_SYNC_TRIES; i++) {
+        TkhTimed tkt = tkh_board_timesync(tkh);
+        if (!tkh_timed_is_valid(&tkt)) { tkh_timed_init(&best); break; }
+        if (i == 0 || tkh_timeval_compare(&(tkt.window), &(best.window)) < 0) best = tkt;
+    }
+    return best;
+}
+
+bool tkh_run_all_at(Ticklish **tkhs, int n, double delay, char mode, struct timeval *start) {
+    if (n <= 0 || delay <= 0) return false;
+    TkhTimed *syncs = (TkhTimed*)malloc(sizeof(TkhTimed)*n);
+    bool ok = true;
+    for (int i = 0; ok && i < n; i++) {
+        enum TkhState state = tkh_state(tkhs[i]);
+        if (state == TKH_ALLDONE) {
+            tkh_write(tkhs[i], "~\"");
+            ok = tkh_ping(tkhs[i]);
+        }
+        else ok = (state == TKH_PROGRAM);
+        if (ok) {
+            syncs[i] = tkh_private_best_board_timesync(tkhs[i]);
+            ok = tkh_timed_is_valid(&(syncs[i]));
+        }
+    }
+    struct timeval when;
+    if (ok) ok = (gettimeofday(&when, NULL) == 0);
+    if (ok) {
+        struct timeval later = tkh_timeval_from_double(delay);
+        tkh_timeval_plus_eq(&when, &later);
+        if (start != NULL) *start = when;
+    }
+    int armed = 0;
+    for (; ok && armed < n; armed++) {
+        // Board clock read somewhere in the window, so take the middle of it
+        struct timeval board_time = when;
+        struct timeval half = tkh_timeval_from_double(tkh_timeval_to_double(&(syncs[armed].window)) / 2);
+        tkh_timeval_minus_eq(&board_time, &(syncs[armed].zero));
+        tkh_timeval_minus_eq(&board_time, &half);
+        ok = tkh_run_at(tkhs[armed], &board_time, mode);
+    }
+    if (!ok) {
+        for (int i = 0; i < armed; i++) tkh_disarm(tkhs[i]);
+    }
+    free(syncs);
+    return ok;
+}
+
+bool tkh_disarm(Ticklish *tkh) {
+    tkh_write(tkh, "~/");
+    return tkh->error_value == 0 && tkh_ping(tkh);
+}
+
+bool tkh_trigger(Ticklish *tkh, TkhTrigger *trigger) {
+    char reply[21];
+    if (tkh_query_into(tkh, "~;", 20, reply, 21) < 0) return false;
+    bool ok = (tkh->error_value == 0) && reply[0] == ';';
+    for (int i = 2; ok && i < 20; i++) ok = reply[i] >= '0' && reply[i] <= '9';
+    if (ok) {
+        unsigned long long cycles = 0;
+        unsigned long latency = 0;
+        for (int i = 2; i < 12; i++) cycles = 10*cycles + (reply[i] - '0');
+        for (int i = 12; i < 20; i++) latency = 10*latency + (reply[i] - '0');
+        trigger->armed = reply[1] == '_';
+        trigger->fired = reply[1] == '!';
+        trigger->cycles = (unsigned int)cycles;
+        trigger->latency = latency / (double)TKH_TICKS_PER_SECOND;
+    }
+    return ok;
+}
+
+
+bool tkh_lateness(Ticklish *tkh, char channel, bool ends, TkhLateness *result) {
+    if (channel < 'A' || channel > 'X') return false;
+    char ask[4] = { '~', channel, ends ? '>' : '<', 0 };
+    unsigned char reply[4 + 4*(TKH_LATENESS_BUCKETS+1)];
+    if (tkh_query_into(tkh, ask, 3 + 4*(TKH_LATENESS_BUCKETS+1), (char*)reply, sizeof(reply)) < 0) return false;
+    bool ok = reply[0] == '|' && reply[1] == ask[2] && reply[2] == channel;
+    if (ok) {
+        result->channel = channel;
+        result->ends = ends;
+        result->max = tkh_private_read_le32(reply + 3) / (double)TKH_TICKS_PER_SECOND;
+        for (int k = 0; k < TKH_LATENESS_BUCKETS; k++) result->counts[k] = tkh_private_read_le32(reply + 7 + 4*k);
+    }
+    return ok;
+}
+
+void tkh_trace_start(Ticklish *tkh) {
+    tkh_write(tkh, "~(");
+}
+
+void tkh_trace_stop(Ticklish *tkh) {
+    tkh_write(tkh, "~)");
+}
+
+#define TKH_TRACE_PACKET 56
+#define TKH_TRACE_PER_PACKET 3
+#define TKH_TRACE_WRAP (1ll << 48)
+
+// Trace packets as they come in, and the request waiting for the next one
+typedef struct {
+    TkhRequest req;
+    unsigned char reply[TKH_TRACE_PACKET];
+    unsigned char *packets;
+    int count;
+    int room;
+    bool ended;
+    bool failed;
+} TkhTraceDump;
+
+void tkh_private_trace_packet(Ticklish *tkh, const char *reply, void *data);
+
+// Lines up the dump's request for the next trace packet (sending `ask` first, if any)
+bool tkh_private_trace_line_up(Ticklish *tkh, const char *ask, TkhTraceDump *dump) {
+    TkhRequest *req = &(dump->req);
+    memset(req, 0, sizeof(TkhRequest));
+    req->n = TKH_TRACE_PACKET - 1;
+    req->reply = (char*)dump->reply;
+    req->room = TKH_TRACE_PACKET;
+    req->borrowed = true;
+    req->callback = tkh_private_trace_packet;
+    req->data = (void*)dump;
+    return tkh_private_line_up_bytes(tkh, ask, (ask != NULL) ? 2 : 0, req);
+}
+
+// Keeps a packet if it looks like one; false when no more follow (or it didn't)
+bool tkh_private_trace_keep(TkhTraceDump *dump, const unsigned char *reply, int got) {
+    if (got != TKH_TRACE_PACKET - 1 || reply[0] != '<' || reply[1] > TKH_TRACE_PER_PACKET) {
+        dump->failed = true;
+        return false;
+    }
+    if (dump->count == dump->room) {
+        dump->room = (dump->room == 0) ? 16 : 2*dump->room;
+        dump->packets = (unsigned char*)realloc((void*)dump->packets, dump->room * (TKH_TRACE_PACKET - 1));
+    }
+    memcpy(dump->packets + dump->count * (TKH_TRACE_PACKET - 1), reply, TKH_TRACE_PACKET - 1);
+    dump->count++;
+    return (reply[2] & 1) != 0;
+}
+
+// Called by the reader thread as each packet comes in.  The board sends them one straight after
+// another, so the request for the next has to be in line before the reader reads on.
+void tkh_private_trace_packet(Ticklish *tkh, const char *reply, void *data) {
+    TkhTraceDump *dump = (TkhTraceDump*)data;
+    bool more = reply != NULL && tkh_private_trace_keep(dump, (const unsigned char*)reply, dump->req.got);
+    if (reply == NULL) dump->failed = true;
+    if (more && !tkh_private_trace_line_up(tkh, NULL, dump)) {
+        dump->req.done = true;
+        dump->failed = true;
+        more = false;
+    }
+    dump->ended = !more;
+}
+
+int tkh_trace_read(Ticklish *tkh, TkhEdge **edges, const TkhEdge *previous, unsigned int *lost) {
+    *edges = NULL;
+    TkhTraceDump dump;
+    memset(&dump, 0, sizeof(TkhTraceDump));
+    bool ok;
+    if (tkh_private_is_pumped(tkh)) {
+        // The packets are picked up by the reader thread, with the line held so that no other
+        // reply can be expected in between; the board answers those only once the trace is out.
+        tkh_private_hold_line(tkh, true);
+        ok = tkh_private_trace_line_up(tkh, "~<", &dump);
+        if (ok) {
+            struct timespec until;
+            int seen = -1;
+            LOCKON;
+            while (!dump.ended) {
+                if (dump.count != seen) {
+                    seen = dump.count;
+                    tkh_private_deadline(&until, TICKLISH_PATIENCE);
+                }
+                int ret = pthread_cond_timedwait(&(tkh->arrived), &(tkh->my_mutex), &until);
+                if (ret != 0 && dump.count == seen) break;
+            }
+            ok = dump.ended && !dump.failed;
+            UNLOCK;
+            // Gave up waiting: what is still to come is soaked up in its place
+            if (!ok) tkh_private_wait_for_reply(tkh, &(dump.req), 0);
+        }
+        tkh_private_hold_line(tkh, false);
+    }
+    else {
+        tkh_write(tkh, "~<");
+        ok = tkh->error_value == 0;
+        // Reply is binary, but tkh_fixed_read_into copies exactly the bytes asked for
+        bool more = ok;
+        while (more) {
+            int got = tkh_fixed_read_into(tkh, TKH_TRACE_PACKET - 1, false, (char*)dump.reply, TKH_TRACE_PACKET);
+            more = tkh_private_trace_keep(&dump, dump.reply, got);
+        }
+        ok = ok && !dump.failed;
+    }
+    if (!ok) {
+        free((void*)dump.packets);
+        LOCKON;
+        tkh->error_value = -1;
+        UNLOCK;
+        return -1;
+    }
+    int n = 0, N = 0;
+    long long last = (previous != NULL) ? previous->scheduled : 0;
+    for (int k = 0; k < dump.count; k++) {
+        const unsigned char *reply = dump.packets + k * (TKH_TRACE_PACKET - 1);
+        int m = reply[1];
+        if (lost != NULL) *lost = tkh_private_read_le32(reply + 3);
+        if (n + m > N) {
+            N = (N == 0) ? 64 : 2*N;
+            *edges = (TkhEdge*)realloc((void*)*edges, N * sizeof(TkhEdge));
+        }
+        for (int i = 0; i < m; i++) {
+            const unsigned char *x = reply + 7 + 16*i;
+            TkhEdge *e = *edges + n;
+            e->cycles = tkh_private_read_le32(x);
+            e->late = (int)tkh_private_read_le32(x + 4);
+            long long when = ((long long)tkh_private_read_le32(x + 8)) | (((long long)x[12]) << 32) | (((long long)x[13]) << 40);
+            // Only 48 bits are sent; pick the wrap that keeps time from going far backwards
+            when += last - (last & (TKH_TRACE_WRAP - 1));
+            if (when < last - TKH_TRACE_WRAP/2) when += TKH_TRACE_WRAP;
+            e->scheduled = last = when;
+            e->channel = (x[14] < 24) ? 'A' + x[14] : '?';
+            e->high = x[15] != 0;
+            n++;
+        }
+    }
+    free((void*)dump.packets);
+    return n;
+}
+
+
+// Adds bytes meant for ordinary readers to the ring; if nobody has been reading, what won't fit is lost
+void tkh_private_buffer_append(Ticklish *tkh, const unsigned char *bytes, int n) {
+    if (n <= 0 || tkh->buffer == NULL) return;
+    char *p;
+    int m;
+    while (n > 0 && (m = tkh_private_ring_space(tkh, &p)) > 0) {
+        if (m > n) m = n;
+        memcpy(p, bytes, m);
+        tkh_private_ring_commit(tkh, m);
+        bytes += m;
+        n -= m;
+    }
+    tkh->arrivals++;
+}
+
+bool tkh_private_is_samples(TkhAcquisition *acq, const unsigned char *p) {
+    return p[0] == '~' && p[1] == '{' && p[3] <= 7 && p[5] == acq->size &&
+        p[2] <= (TKH_ACQUIRE_PACKET - TKH_ACQUIRE_HEADER) / acq->size &&
+        (p[2] == 0 || !(p[3] & 4));
+}
+
+void tkh_private_queue_samples(TkhAcquisition *acq, const unsigned char *p) {
+    if (acq->count >= TKH_ACQUIRE_QUEUE) { acq->dropped = true; return; }
+    TkhBlock *b = acq->queue + ((acq->head + acq->count) % TKH_ACQUIRE_QUEUE);
+    memset(b, 0, sizeof(TkhBlock));
+    b->n = p[2];
+    b->lost = (p[3] & 1) != 0 || acq->dropped;
+    b->running = (p[3] & 2) != 0;
+    b->last = (p[3] & 4) != 0;
+    b->epoch = p[4];
+    if (b->epoch != acq->epoch) { acq->epoch = b->epoch; acq->last = 0; }
+    for (int i = 0; i < b->n; i++) {
+        const unsigned char *x = p + TKH_ACQUIRE_HEADER + i*acq->size;
+        TkhSample *t = b->samples + i;
+        // Only the low 32 bits are sent; they never go backwards within an epoch
+        long long ticks = (acq->last & ~0xFFFFFFFFll) | tkh_private_read_le32(x);
+        if (ticks < acq->last) ticks += 0x100000000ll;
+        t->ticks = acq->last = ticks;
+        for (int k = 0; k < acq->nana; k++) t->analog[acq->analog[k]] = x[4 + 2*k] | (x[5 + 2*k] << 8);
+        if (acq->size > 4 + 2*acq->nana) t->digital = x[4 + 2*acq->nana] | (x[5 + 2*acq->nana] << 8);
+    }
+    acq->dropped = false;
+    acq->count++;
+    if (b->last) acq->ended = true;
+}
+
+// Passes bytes on to a request still waiting for its reply; returns how many it took
+int tkh_private_feed_request(TkhRequest *req, const unsigned char *bytes, int n) {
+    int i = 0;
+    while (i < n && !req->done) {
+        if (!req->started) {
+            const unsigned char *t = (const unsigned char*)memchr(bytes + i, (req->n > 0) ? '~' : '$', n - i);
+            req->started = t != NULL;
+            i = (t == NULL) ? n : (int)(t - bytes) + 1;
+        }
+        else if (req->n > 0) {
+            int m = req->n - req->got;
+            if (m > n - i) m = n - i;
+            memcpy(req->reply + req->got, bytes + i, m);
+            req->got += m;
+            i += m;
+            if (req->got == req->n) { req->reply[req->got] = 0; req->done = true; }
+        }
+        else {
+            const unsigned char *nl = (const unsigned char*)memchr(bytes + i, '\n', n - i);
+            int k = (nl == NULL) ? n - i : (int)(nl - bytes) - i;
+            const unsigned char *t = (const unsigned char*)memchr(bytes + i, '~', k);
+            if (t != NULL) k = (int)(t - bytes) - i;
+            if (req->got + k >= req->room && !req->borrowed) {
+                while (req->got + k >= req->room) req->room *= 2;
+                req->reply = (char*)realloc(req->reply, req->room);
+            }
+            if (req->got + k < req->room) {
+                memcpy(req->reply + req->got, bytes + i, k);
+                req->got += k;
+            }
+            else req->failed = true;   // Too long; read on to the end of it anyway
+            i += k;
+            if (t != NULL) {
+                // Left for the next reply, which this one ran into
+                req->failed = true;
+                req->done = true;
+            }
+            else if (nl != NULL) {
+                i++;
+                if (!req->failed) req->reply[req->got] = 0;
+                req->done = true;
+            }
+        }
+    }
+    return i;
+}
+
+// A request for a reply of n bytes (or a line, if 0), reusing a spare if there is one
+TkhRequest* tkh_private_new_request(Ticklish *tkh, int n) {
+    LOCKON;
+    TkhRequest *req = tkh->spares;
+    if (req != NULL) tkh->spares = req->next;
+    UNLOCK;
+    if (req == NULL) req = (TkhRequest*)calloc(1, sizeof(TkhRequest));
+    else {
+        char *reply = req->reply;
+        int room = req->room;
+        memset(req, 0, sizeof(TkhRequest));
+        req->reply = reply;
+        req->room = room;
+        req->pooled = true;
+    }
+    req->n = n;
+    int need = (n > 0) ? n + 1 : 64;
+    if (req->reply == NULL || req->room < need) {
+        req->reply = (char*)realloc(req->reply, need);
+        req->room = need;
+    }
+    return req;
+}
+
+// Done with a request: back to the spares if it came from there, otherwise freed
+void tkh_private_drop_request(Ticklish *tkh, TkhRequest *req) {
+    if (req->borrowed) return;
+    if (req->pooled) {
+        LOCKON;
+        req->next = tkh->spares;
+        tkh->spares = req;
+        UNLOCK;
+    }
+    else {
+        free((void*)req->reply);
+        free((void*)req);
+    }
+}
+
+// Takes the oldest request off the line once its reply is in, and hands the reply over
+void tkh_private_finish_request(Ticklish *tkh, TkhReader *rd) {
+    TkhRequest *req = rd->first;
+    rd->first = req->next;
+    if (rd->first == NULL) rd->last = NULL;
+    if (req->callback != NULL) req->callback(tkh, req->failed ? NULL : req->reply, req->data);
+    if (req->callback != NULL || req->abandoned) tkh_private_drop_request(tkh, req);
+    pthread_cond_broadcast(&(tkh->arrived));
+}
+
+// Gives replies to requests in the order they were sent; anything else goes to ordinary readers
+void tkh_private_deliver(Ticklish *tkh, TkhReader *rd, const unsigned char *bytes, int n) {
+    while (n > 0 && rd->first != NULL) {
+        int used = tkh_private_feed_request(rd->first, bytes, n);
+        bytes += used;
+        n -= used;
+        if (rd->first->done) tkh_private_finish_request(tkh, rd);
+    }
+    tkh_private_buffer_append(tkh, bytes, n);
+}
+
+// Pulls blocks of samples out of what was read; everything else is delivered
+void tkh_private_sort_arrivals(Ticklish *tkh, TkhReader *rd) {
+    TkhAcquisition *acq = tkh->acquisition;
+    if (acq == NULL || acq->ended) {
+        tkh_private_deliver(tkh, rd, rd->stage, rd->staged);
+        rd->staged = 0;
+        return;
+    }
+    int i = 0;
+    while (i < rd->staged) {
+        // A binary reply that has begun is taken whole, whatever bytes it holds
+        TkhRequest *head = rd->first;
+        if (head != NULL && head->started && head->n > 0 && !head->done) {
+            i += tkh_private_feed_request(head, rd->stage + i, rd->staged - i);
+            if (head->done) tkh_private_finish_request(tkh, rd);
+            continue;
+        }
+        unsigned char *t = (unsigned char*)memchr(rd->stage + i, '~', rd->staged - i);
+        int j = (t == NULL) ? rd->staged : (int)(t - rd->stage);
+        tkh_private_deliver(tkh, rd, rd->stage + i, j - i);
+        i = j;
+        if (j + 1 >= rd->staged) break;   // Can't tell what a final ~ is yet
+        if (rd->stage[j+1] != '{') { tkh_private_deliver(tkh, rd, rd->stage + j, 1); i = j + 1; continue; }
+        if (rd->staged - j < TKH_ACQUIRE_PACKET) break;
+        if (tkh_private_is_samples(acq, rd->stage + j)) {
+            tkh_private_queue_samples(acq, rd->stage + j);
+            i = j + TKH_ACQUIRE_PACKET;
+        }
+        else {
+            tkh_private_deliver(tkh, rd, rd->stage + j, 1);
+            i = j + 1;
+        }
+    }
+    memmove(rd->stage, rd->stage + i, rd->staged - i);
+    rd->staged -= i;
+}
+
+void* tkh_private_reader(void *arg) {
+    Ticklish *tkh = (Ticklish*)arg;
+    TkhReader *rd = tkh->reader;
+    int idle = 0;
+    bool failed = false;
+    while (!rd->stopping && !failed) {
+        int room = (int)sizeof(rd->stage) - rd->staged;
+        // Leave bytes with the port while someone is still emptying the ring, so long replies
+        // aren't cut short; stop waiting (and drop what won't fit) once nobody is
+        int still = 0;
+        while (
+            tkh_private_ring_free(tkh) < room && !rd->stopping && still < TKH_READER_STALL &&
+            !(rd->stalled && rd->stalled_at == tkh->buffer_start)
+        ) {
+            unsigned int start = tkh->buffer_start;
+            usleep(1000);
+            still = (start == tkh->buffer_start) ? still + 1 : 0;
+        }
+        if (still >= TKH_READER_STALL) {
+            rd->stalled = true;
+            rd->stalled_at = tkh->buffer_start;
+        }
+        int ret = sp_blocking_read_next(tkh->my_port, rd->stage + rd->staged, room, TICKLISH_PATIENCE);
+        LOCKON;
+        TkhAcquisition *acq = tkh->acquisition;
+        if (ret > 0) {
+            idle = 0;
+            rd->staged += ret;
+            tkh_private_sort_arrivals(tkh, rd);
+        }
+        else if (ret < 0) failed = true;
+        else if (acq != NULL && acq->stopping && !acq->ended && ++idle >= TKH_ACQUIRE_GIVE_UP) acq->ended = true;
+        pthread_cond_broadcast(&(tkh->arrived));
+        UNLOCK;
+    }
+    LOCKON;
+    // Hand on anything half-read, and let readers go back to reading for themselves
+    tkh_private_deliver(tkh, rd, rd->stage, rd->staged);
+    rd->staged = 0;
+    while (rd->first != NULL) {
+        rd->first->failed = true;
+        rd->first->done = true;
+        tkh_private_finish_request(tkh, rd);
+    }
+    if (tkh->acquisition != NULL) tkh->acquisition->ended = true;
+    rd->running = false;
+    pthread_cond_broadcast(&(tkh->arrived));
+    UNLOCK;
+    return NULL;
+}
+
+bool tkh_reader_start(Ticklish *tkh) {
+    tkh_connect(tkh);
+    if (!tkh->vouched) tkh_private_vouch(tkh);   // Before anything else can be waiting for a reply
+    LOCKON;
+    TkhReader *rd = tkh->reader;
+    bool ok = rd != NULL && rd->running;
+    UNLOCK;
+    if (ok) return true;
+    if (rd != NULL) tkh_reader_stop(tkh);   // It lost the port; clear it away first
+    LOCKON;
+    if (tkh->reader == NULL && tkh_is_connected(tkh)) {
+        rd = (TkhReader*)calloc(1, sizeof(TkhReader));
+        rd->running = true;
+        tkh->reader = rd;
+        ok = pthread_create(&(rd->thread), NULL, tkh_private_reader, (void*)tkh) == 0;
+        if (!ok) {
+            tkh->reader = NULL;
+            free((void*)rd);
+        }
+    }
+    else ok = tkh->reader != NULL && tkh->reader->running;
+    UNLOCK;
+    return ok;
+}
+
+void tkh_reader_stop(Ticklish *tkh) {
+    LOCKON;
+    TkhReader *rd = tkh->reader;
+    bool mine = rd != NULL && !rd->stopping;
+    if (mine) rd->stopping = true;
+    UNLOCK;
+    if (!mine) return;
+    pthread_join(rd->thread, NULL);
+    LOCKON;
+    tkh->reader = NULL;
+    UNLOCK;
+    free((void*)rd);
+}
+
+int tkh_reserve_requests(Ticklish *tkh, int n) {
+    LOCKON;
+    int have = 0;
+    for (TkhRequest *req = tkh->spares; req != NULL; req = req->next) have++;
+    for (; have < n; have++) {
+        TkhRequest *req = (TkhRequest*)calloc(1, sizeof(TkhRequest));
+        req->room = TKH_SPARE_ROOM;
+        req->reply = (char*)malloc(req->room);
+        req->pooled = true;
+        req->next = tkh->spares;
+        tkh->spares = req;
+    }
+    UNLOCK;
+    return have;
+}
+
+void tkh_private_free_spares(Ticklish *tkh) {
+    while (tkh->spares != NULL) {
+        TkhRequest *req = tkh->spares;
+        tkh->spares = req->next;
+        free((void*)req->reply);
+        free((void*)req);
+    }
+}
+
+// Sends a query and puts its request in line for the reply; false if it couldn't be sent
+bool tkh_private_line_up(Ticklish *tkh, const char *ask, TkhRequest *req) {
+    return tkh_private_line_up_bytes(tkh, ask, strnlen(ask, TICKLISH_MAX_OUT), req);
+}
+
+// As tkh_private_line_up, but `ask` is n bytes (of anything); if it is NULL, nothing is sent
+// and the request waits for a reply that is already on its way.  Leaves error_value alone, as
+// the clock sampler queues requests from a thread of its own.
+bool tkh_private_line_up_bytes(Ticklish *tkh, const char *ask, int n, TkhRequest *req) {
+    if (!tkh_reader_start(tkh)) return false;
+    // Hold the lock so that nothing can be delivered between sending and joining the line
+    LOCKON;
+    TkhReader *rd;
+    while (
+        (rd = tkh->reader) != NULL && rd->running && rd->held &&
+        !pthread_equal(rd->holder, pthread_self()) && !pthread_equal(rd->thread, pthread_self())
+    ) pthread_cond_wait(&(tkh->arrived), &(tkh->my_mutex));
+    bool ok = rd != NULL && rd->running;
+    // The port is open and vouched for while the reader runs
+    if (ok && ask != NULL) ok = tkh_private_put_bytes(tkh, ask, n);
+    if (ok) {
+        if (rd->last != NULL) rd->last->next = req;
+        else rd->first = req;
+        rd->last = req;
+    }
+    UNLOCK;
+    return ok;
+}
+
+// Puts `stand_in` in the line where `req` was (call with the lock held)
+void tkh_private_swap_in_line(TkhReader *rd, TkhRequest *req, TkhRequest *stand_in) {
+    TkhRequest *prev = NULL;
+    for (TkhRequest *r = rd->first; r != req; r = r->next) prev = r;
+    stand_in->next = req->next;
+    if (prev == NULL) rd->first = stand_in;
+    else prev->next = stand_in;
+    if (rd->last == req) rd->last = stand_in;
+}
+
+// Waits for a reply.  If it doesn't come, the request is abandoned, to be thrown out when its
+// reply does come.  A borrowed one is first swapped for a copy on the heap, since the caller
+// is about to reuse it but its reply must still be soaked up in its place.
+bool tkh_private_wait_for_reply(Ticklish *tkh, TkhRequest *req, int patience) {
+    struct timespec until;
+    tkh_private_deadline(&until, patience);
+    LOCKON;
+    int ret = 0;
+    while (!req->done && ret == 0) ret = pthread_cond_timedwait(&(tkh->arrived), &(tkh->my_mutex), &until);
+    bool done = req->done;
+    if (!done && req->borrowed) {
+        // Not done means the reader is still running and the request still in its line
+        TkhRequest *stand_in = (TkhRequest*)calloc(1, sizeof(TkhRequest));
+        stand_in->n = req->n;
+        stand_in->started = req->started;
+        stand_in->failed = req->failed;
+        stand_in->got = req->got;
+        stand_in->room = (req->n > 0) ? req->n + 1 : req->got + 64;
+        stand_in->reply = (char*)malloc(stand_in->room);
+        memcpy(stand_in->reply, req->reply, req->got);
+        stand_in->abandoned = true;
+        tkh_private_swap_in_line(tkh->reader, req, stand_in);
+    }
+    else if (!done) req->abandoned = true;
+    UNLOCK;
+    return done;
+}
+
+// While held, other threads wait to join the line (and so to send queries), for replies
+// that come in several pieces with the board free to answer other things in between
+void tkh_private_hold_line(Ticklish *tkh, bool hold) {
+    LOCKON;
+    TkhReader *rd = tkh->reader;
+    if (rd != NULL) {
+        rd->held = hold;
+        rd->holder = pthread_self();
+    }
+    pthread_cond_broadcast(&(tkh->arrived));
+    UNLOCK;
+}
+
+TkhRequest* tkh_private_send(Ticklish *tkh, const char *ask, int n, TkhReplied callback, void *data) {
+    if (n < 0) return NULL;
+    TkhRequest *req = tkh_private_new_request(tkh, n);
+    req->callback = callback;
+    req->data = data;
+    if (!tkh_private_line_up(tkh, ask, req)) {
+        tkh_private_drop_request(tkh, req);
+        LOCKON;
+        tkh->error_value = -1;
+        UNLOCK;
+        return NULL;
+    }
+    return req;
+}
+
+TkhRequest* tkh_send(Ticklish *tkh, const char *ask, int n) {
+    if (n <= 0) return NULL;
+    return tkh_private_send(tkh, ask, n, NULL, NULL);
+}
+
+TkhRequest* tkh_flex_send(Ticklish *tkh, const char *ask) {
+    return tkh_private_send(tkh, ask, 0, NULL, NULL);
+}
+
+bool tkh_send_then(Ticklish *tkh, const char *ask, int n, TkhReplied callback, void *data) {
+    if (n < 0 || callback == NULL) return false;
+    return tkh_private_send(tkh, ask, n, callback, data) != NULL;
+}
+
+bool tkh_is_ready(Ticklish *tkh, TkhRequest *request) {
+    if (request == NULL) return true;
+    LOCKON;
+    bool ans = request->done;
+    UNLOCK;
+    return ans;
+}
+
+int tkh_await_into(Ticklish *tkh, TkhRequest *request, int patience, char *target, int max_length) {
+    if (request == NULL) return -1;
+    if (!tkh_private_wait_for_reply(tkh, request, patience)) return -1;
+    int ans = -1;
+    if (!request->failed && request->got < max_length) {
+        memcpy(target, request->reply, request->got + 1);
+        ans = request->got;
+    }
+    tkh_private_drop_request(tkh, request);
+    return ans;
+}
+
+char* tkh_await(Ticklish *tkh, TkhRequest *request, int patience) {
+    if (request == NULL) return NULL;
+    if (!tkh_private_wait_for_reply(tkh, request, patience)) return NULL;
+    char *ans = NULL;
+    if (!request->failed) {
+        // Handed over, so a spare will need new room next time
+        ans = request->reply;
+        request->reply = NULL;
+        request->room = 0;
+    }
+    tkh_private_drop_request(tkh, request);
+    return ans;
+}
+
+bool tkh_acquire_start(Ticklish *tkh, const char *inputs, double period) {
+    unsigned int mask = 0;
+    for (const char *c = inputs; *c; c++) {
+        if (*c < 'A' || *c > 'W') return false;
+        mask |= 1u << (*c - 'A');
+    }
+    long us = lround(period * 1e6);
+    TkhAcquisition *acq = (TkhAcquisition*)calloc(1, sizeof(TkhAcquisition));
+    for (int k = 0; k < TKH_ANALOG_INPUTS; k++) if (mask & (1u << k)) acq->analog[acq->nana++] = k;
+    acq->size = 4 + 2*acq->nana + ((mask >> TKH_ANALOG_INPUTS) ? 2 : 0);
+    acq->epoch = -1;
+    if (mask == 0 || us < 50*(1 + acq->nana) || us > 999999) { free((void*)acq); return false; }
+    if (!tkh_reader_start(tkh)) { free((void*)acq); return false; }
+    LOCKON;
+    bool busy = tkh->acquisition != NULL && !tkh->acquisition->stopping;
+    if (!busy) {
+        if (tkh->acquisition != NULL) free((void*)tkh->acquisition);
+        tkh->acquisition = acq;
+    }
+    UNLOCK;
+    if (busy) { free((void*)acq); return false; }
+    char ask[TICKLISH_MAX_OUT];
+    snprintf(ask, sizeof(ask), "~{%06X%06d", mask, (int)us);
+    tkh_write(tkh, ask);
+    return tkh->error_value == 0;
+}
+
+int tkh_acquire_next(Ticklish *tkh, TkhBlock *block, int patience) {
+    struct timespec until;
+    tkh_private_deadline(&until, patience);
+    int ans = 0;
+    LOCKON;
+    TkhAcquisition *acq = tkh->acquisition;
+    int ret = 0;
+    while (acq != NULL && acq->count == 0 && !acq->ended && ret == 0) {
+        ret = pthread_cond_timedwait(&(tkh->arrived), &(tkh->my_mutex), &until);
+    }
+    if (acq == NULL) ans = -1;
+    else if (acq->count > 0) {
+        *block = acq->queue[acq->head];
+        acq->head = (acq->head + 1) % TKH_ACQUIRE_QUEUE;
+        acq->count--;
+        ans = 1;
+    }
+    else if (acq->ended) ans = -1;
+    UNLOCK;
+    return ans;
+}
+
+void tkh_acquire_stop(Ticklish *tkh) {
+    LOCKON;
+    TkhAcquisition *acq = tkh->acquisition;
+    bool running = acq != NULL && !acq->stopping;
+    if (running) acq->stopping = true;
+    UNLOCK;
+    if (!running) return;
+    tkh_write(tkh, "~}");
+    LOCKON;
+    while (!acq->ended) pthread_cond_wait(&(tkh->arrived), &(tkh->my_mutex));
+    UNLOCK;
 }
 
 
@@ -675,6 +2163,153 @@ Ticklish* tkh_private_find_next_ticklish(struct sp_port **portptrs, int nports,
 }
 
 
+#define TKH_PROBE_SLICE 5
+#define TKH_PROBE_GRACE 0.05
+#define TKH_PROBE_RTT_FACTOR 4
+
+typedef struct TkhProbe {
+    pthread_mutex_t mutex;
+    pthread_cond_t finished;     // Signalled as each port has been answered or given up on
+    double deadline;             // When to give up on the ports that haven't answered
+    double full;                 // ...as it was before any board answered
+    double slowest;              // Longest round trip of any board that has answered
+    int want;                    // Stop looking once this many have answered
+    int answered;
+    int done;
+} TkhProbe;
+
+typedef struct TkhProbeSlot {
+    TkhProbe *probe;
+    pthread_t thread;
+    struct sp_port *port;
+    Ticklish *tkh;               // Set once the board has answered
+    bool reported;
+    bool silent;                 // Opened but didn't answer, though it had as long as could be asked
+    int index;                   // Where the port is in the list probed
+} TkhProbeSlot;
+
+// Waits for the rest of a reply to `~?` until the probe's deadline, which may move up meanwhile
+bool tkh_private_probe_read(Ticklish *tkh, TkhProbe *probe, char *line) {
+    int i = 0;
+    bool dollared = false;
+    for (;;) {
+        pthread_mutex_lock(&(probe->mutex));
+        bool late = tkh_host_now() > probe->deadline;
+        pthread_mutex_unlock(&(probe->mutex));
+        if (late) return false;
+        char chunk[TICKLISH_LINE_N];
+        int ret = sp_blocking_read_next(tkh->my_port, chunk, TICKLISH_LINE_N, TKH_PROBE_SLICE);
+        if (ret < 0) return false;
+        for (int j = 0; j < ret; j++) {
+            if (!dollared) dollared = chunk[j] == '$';
+            else if (chunk[j] == '\n') {
+                line[i] = 0;
+                return true;
+            }
+            else if (i < TICKLISH_LINE_N - 1) line[i++] = chunk[j];
+        }
+    }
+}
+
+// Opens one port and asks whether it's a Ticklish; runs on a thread of its own
+void* tkh_private_probe_port(void *arg) {
+    TkhProbeSlot *slot = (TkhProbeSlot*)arg;
+    TkhProbe *probe = slot->probe;
+    Ticklish *tkh = tkh_construct(slot->port);
+    tkh_connect(tkh);
+    char line[TICKLISH_LINE_N];
+    double sent = tkh_host_now();
+    tkh_write(tkh, "~?");
+    bool failed = tkh->error_value != 0;
+    bool heard = !failed && tkh_private_probe_read(tkh, probe, line);
+    bool ok = heard && tkh_string_is_ticklish(line) && tkh_private_remember_id(tkh, line);
+    pthread_mutex_lock(&(probe->mutex));
+    // Given up on early only because others answered quickly, it may yet be a board, and
+    // one that couldn't be opened may only be busy
+    slot->silent = !ok && !failed && (heard || probe->deadline >= probe->full);
+    if (ok) {
+        // Boards on the same bus answer in much the same time, so stop waiting for stragglers
+        double now = tkh_host_now();
+        if (now - sent > probe->slowest) probe->slowest = now - sent;
+        double grace = TKH_PROBE_RTT_FACTOR * probe->slowest;
+        if (grace < TKH_PROBE_GRACE) grace = TKH_PROBE_GRACE;
+        if (now + grace < probe->deadline) probe->deadline = now + grace;
+        probe->answered += 1;
+        if (probe->answered >= probe->want) probe->deadline = now;
+        slot->tkh = tkh;
+    }
+    probe->done += 1;
+    pthread_cond_broadcast(&(probe->finished));
+    pthread_mutex_unlock(&(probe->mutex));
+    if (!ok) tkh_destruct(tkh);
+    return NULL;
+}
+
+// Probes every Teensy at once, handing over up to `want` boards (to `found` too, if given) as they
+// answer.  If `silent` is given, it is set for each port that was given its full time but didn't.
+int tkh_private_probe_ports(
+    struct sp_port **portptrs, int nports, int want, Ticklish **tkhs,
+    void (*found)(Ticklish *tkh, void *data), void *data, bool *silent
+) {
+    TkhProbe probe;
+    pthread_mutex_init(&(probe.mutex), NULL);
+    pthread_cond_init(&(probe.finished), NULL);
+    probe.deadline = tkh_host_now() + TICKLISH_PATIENCE * 1e-3;
+    probe.full = probe.deadline;
+    probe.slowest = 0;
+    probe.want = want;
+    probe.answered = 0;
+    probe.done = 0;
+    TkhProbeSlot slots[nports];
+    int n = 0;
+    for (int i = 0; i < nports; i++) {
+        const char* manf = sp_get_port_usb_manufacturer(portptrs[i]);
+        if (manf == NULL || strcmp(manf, "Teensyduino") != 0) continue;
+        TkhProbeSlot *slot = slots + n;
+        if (sp_copy_port(portptrs[i], &(slot->port)) != SP_OK) continue;
+        slot->probe = &probe;
+        slot->tkh = NULL;
+        slot->reported = false;
+        slot->silent = false;
+        slot->index = i;
+        n++;
+        if (pthread_create(&(slot->thread), NULL, tkh_private_probe_port, slot) != 0) {
+            tkh_private_probe_port(slot);
+            slot->thread = pthread_self();
+        }
+    }
+    int k = 0;
+    pthread_mutex_lock(&(probe.mutex));
+    for (;;) {
+        for (int i = 0; i < n; i++) {
+            if (slots[i].tkh != NULL && !slots[i].reported && k < want) {
+                slots[i].reported = true;
+                tkhs[k++] = slots[i].tkh;
+                if (found != NULL) {
+                    pthread_mutex_unlock(&(probe.mutex));
+                    found(slots[i].tkh, data);
+                    pthread_mutex_lock(&(probe.mutex));
+                }
+            }
+        }
+        if (probe.done == n) break;
+        pthread_cond_wait(&(probe.finished), &(probe.mutex));
+    }
+    pthread_mutex_unlock(&(probe.mutex));
+    if (silent != NULL) {
+        for (int i = 0; i < nports; i++) silent[i] = false;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!pthread_equal(slots[i].thread, pthread_self())) pthread_join(slots[i].thread, NULL);
+        if (slots[i].tkh != NULL && !slots[i].reported) tkh_destruct(slots[i].tkh);
+        if (silent != NULL) silent[slots[i].index] = slots[i].silent;
+    }
+    pthread_cond_destroy(&(probe.finished));
+    pthread_mutex_destroy(&(probe.mutex));
+    return k;
+}
+
+
 Ticklish* tkh_find_first_ticklish() {
     struct sp_port **portptrs;
     enum sp_return ret = sp_list_ports(&portptrs);
@@ -684,14 +2319,15 @@ Ticklish* tkh_find_first_ticklish() {
         if (portptrs != NULL) sp_free_port_list(portptrs);
         return NULL;
     }
-    int i = 0;
-    Ticklish *ans = tkh_private_find_next_ticklish(portptrs, nports, &i);
+    Ticklish *ans = NULL;
+    tkh_private_probe_ports(portptrs, nports, 1, &ans, NULL, NULL, NULL);
     sp_free_port_list(portptrs);
     return ans;
 }
 
 
-int tkh_find_all_ticklish(Ticklish ***tkhsp) {
+// Finds boards either all at once or one port at a time
+int tkh_private_find_all(Ticklish ***tkhsp, bool in_turn, void (*found)(Ticklish *tkh, void *data), void *data) {
     struct sp_port **portptrs;
     enum sp_return ret = sp_list_ports(&portptrs);
     if (ret != SP_OK) {
@@ -704,16 +2340,20 @@ int tkh_find_all_ticklish(Ticklish ***tkhsp) {
         *tkhsp = NULL;
         return 0;
     }
-    int i = 0;
     int k = 0;
     Ticklish **tkhs = (Ticklish**)malloc(sizeof(Ticklish*)*nports);
-    while (i < nports) {
-        tkhs[k] = tkh_private_find_next_ticklish(portptrs, nports, &i);
-        if (tkhs[k] != NULL) k++;
+    if (in_turn) {
+        int i = 0;
+        while (i < nports) {
+            tkhs[k] = tkh_private_find_next_ticklish(portptrs, nports, &i);
+            if (tkhs[k] != NULL) k++;
+        }
     }
+    else k = tkh_private_probe_ports(portptrs, nports, nports, tkhs, found, data, NULL);
     sp_free_port_list(portptrs);
     if (k == 0) {
         *tkhsp = NULL;
+        free(tkhs);
     }
     else if (k == nports) {
         *tkhsp = tkhs;
@@ -725,3 +2365,243 @@ int tkh_find_all_ticklish(Ticklish ***tkhsp) {
     }
     return k;
 }
+
+int tkh_find_all_ticklish(Ticklish ***tkhsp) {
+    return tkh_private_find_all(tkhsp, false, NULL, NULL);
+}
+
+int tkh_find_all_ticklish_then(Ticklish ***tkhsp, void (*found)(Ticklish *tkh, void *data), void *data) {
+    return tkh_private_find_all(tkhsp, false, found, data);
+}
+
+int tkh_find_all_ticklish_in_turn(Ticklish ***tkhsp) {
+    return tkh_private_find_all(tkhsp, true, NULL, NULL);
+}
+
+
+/******************/
+/* Identity cache */
+/******************/
+
+#define TKH_CACHE_N 64
+#define TKH_CACHE_LINE 512
+
+typedef struct TkhCacheEntry {
+    char serial[64];             // USB serial number of the port...
+    char port[256];              // ...and its name: both have to match
+    char version[4];
+    char id[64];
+} TkhCacheEntry;
+
+// Reads the remembered boards (none, if there's no file yet); returns how many
+int tkh_private_cache_load(const char *path, TkhCacheEntry *entries) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    int n = 0;
+    char line[TKH_CACHE_LINE];
+    while (n < TKH_CACHE_N && fgets(line, TKH_CACHE_LINE, f) != NULL) {
+        if (line[0] == '#') continue;
+        line[strcspn(line, "\r\n")] = 0;
+        // serial, port, version, then the identity (which may hold anything but a newline)
+        char *field[4];
+        field[0] = line;
+        int k = 1;
+        for (char *c = line; *c && k < 4; c++) if (*c == '\t') { *c = 0; field[k++] = c+1; }
+        if (k < 4 || strlen(field[0]) >= 64 || strlen(field[1]) >= 256 || strlen(field[2]) != 3 || strlen(field[3]) >= 64) continue;
+        strcpy(entries[n].serial, field[0]);
+        strcpy(entries[n].port, field[1]);
+        strcpy(entries[n].version, field[2]);
+        strcpy(entries[n].id, field[3]);
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+// Writes out the remembered boards, replacing the file all at once
+bool tkh_private_cache_save(const char *path, const TkhCacheEntry *entries, int n) {
+    char temp[TKH_CACHE_LINE];
+    if (snprintf(temp, TKH_CACHE_LINE, "%s.%ld", path, (long)getpid()) >= TKH_CACHE_LINE) return false;
+    FILE *f = fopen(temp, "w");
+    if (f == NULL) return false;
+    fprintf(f, "# Ticklish boards: USB serial, port, version, identity (tab-separated)\n");
+    for (int i = 0; i < n; i++) fprintf(f, "%s\t%s\t%s\t%s\n", entries[i].serial, entries[i].port, entries[i].version, entries[i].id);
+    bool ok = fclose(f) == 0;
+    if (ok) ok = rename(temp, path) == 0;
+    if (!ok) remove(temp);
+    return ok;
+}
+
+// The key a port is remembered under
+void tkh_private_cache_key(struct sp_port *port, char *serial, char *name) {
+    const char *s = sp_get_port_usb_serial(port);
+    const char *p = sp_get_port_name(port);
+    snprintf(serial, 64, "%s", (s != NULL) ? s : "");
+    snprintf(name, 256, "%s", (p != NULL) ? p : "");
+}
+
+int tkh_private_cache_find(const TkhCacheEntry *entries, int n, const char *serial, const char *name) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(entries[i].serial, serial) == 0 && strcmp(entries[i].port, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Sets what's remembered for a port: `id` is "" if it isn't a Ticklish, or NULL to forget it
+bool tkh_private_cache_set(TkhCacheEntry *entries, int *n, const char *serial, const char *name, const char *version, const char *id) {
+    int i = tkh_private_cache_find(entries, *n, serial, name);
+    if (id == NULL || i >= 0) {
+        if (i < 0) return false;
+        if (id != NULL && strcmp(entries[i].id, id) == 0 && strcmp(entries[i].version, version) == 0) return false;
+        *n -= 1;
+        if (i < *n) memmove(entries + i, entries + i + 1, sizeof(TkhCacheEntry) * (*n - i));
+        if (id == NULL) return true;
+    }
+    if (*n >= TKH_CACHE_N) {
+        // Full, so forget whatever has gone longest without changing
+        *n -= 1;
+        memmove(entries, entries + 1, sizeof(TkhCacheEntry) * (*n));
+    }
+    TkhCacheEntry *e = entries + (*n)++;
+    snprintf(e->serial, 64, "%s", serial);
+    snprintf(e->port, 256, "%s", name);
+    snprintf(e->version, 4, "%s", version);
+    snprintf(e->id, 64, "%s", id);
+    return true;
+}
+
+// Remembers what the board says it is (or, if it couldn't say, forgets it); true if anything changed
+bool tkh_private_cache_put(Ticklish *tkh, TkhCacheEntry *entries, int *n) {
+    char serial[64];
+    char name[256];
+    char version[4];
+    char id[64];
+    tkh_private_cache_key(tkh->my_port, serial, name);
+    LOCKON;
+    bool known = tkh->my_id != NULL && strlen((char*)tkh->my_id) < 64;
+    if (known) {
+        strcpy(id, (char*)tkh->my_id);
+        for (int j = 0; j < 3; j++) version[j] = tkh->version[j];
+        version[3] = 0;
+    }
+    UNLOCK;
+    return tkh_private_cache_set(entries, n, serial, name, version, known ? id : NULL);
+}
+
+// Brings the board's entry in its identity cache, if it has one, up to date
+void tkh_private_cache_note(Ticklish *tkh) {
+    if (tkh->cache_path == NULL) return;
+    TkhCacheEntry entries[TKH_CACHE_N];
+    int n = tkh_private_cache_load(tkh->cache_path, entries);
+    if (tkh_private_cache_put(tkh, entries, &n)) tkh_private_cache_save(tkh->cache_path, entries, n);
+}
+
+// Checks, just once, that a board handed out from the cache is what the cache said it was
+bool tkh_private_vouch(Ticklish *tkh) {
+    LOCKON;
+    bool ok = true;
+    if (!tkh->vouched) {
+        tkh->vouched = true;
+        char reply[TICKLISH_LINE_N];
+        char name[64];
+        char version[4];
+        ok = tkh_flex_query_into(tkh, "~?", reply, TICKLISH_LINE_N) >= 0 && tkh->error_value == 0;
+        ok = ok && tkh_string_is_ticklish(reply) && tkh_decode_name_into(reply, name, 60, version) >= 0;
+        if (!ok) {
+            if (tkh->my_id != NULL) { free((void*)tkh->my_id); tkh->my_id = NULL; }
+            tkh_private_cache_note(tkh);
+            tkh->error_value = -1;
+        }
+        else if (tkh->my_id == NULL || strcmp(name, (char*)tkh->my_id) != 0 || strncmp(version, (char*)tkh->version, 3) != 0) {
+            tkh_private_remember_id(tkh, reply);
+            tkh_private_cache_note(tkh);
+        }
+    }
+    UNLOCK;
+    return ok;
+}
+
+int tkh_find_all_ticklish_cached(Ticklish ***tkhsp, const char *path) {
+    struct sp_port **portptrs;
+    *tkhsp = NULL;
+    if (sp_list_ports(&portptrs) != SP_OK) return 0;
+    int nports = tkh_private_count_port_pointers(portptrs);
+    if (nports == 0) {
+        if (portptrs != NULL) sp_free_port_list(portptrs);
+        return 0;
+    }
+    TkhCacheEntry entries[TKH_CACHE_N];
+    int nentries = tkh_private_cache_load(path, entries);
+    Ticklish **tkhs = (Ticklish**)malloc(sizeof(Ticklish*)*nports);
+    struct sp_port *unknown[nports];   // Never seen, followed by...
+    struct sp_port *silent[nports];    // ...those that didn't answer last time
+    int k = 0;
+    int nunknown = 0;
+    int nsilent = 0;
+    bool changed = false;
+    for (int i = 0; i < nports; i++) {
+        const char* manf = sp_get_port_usb_manufacturer(portptrs[i]);
+        if (manf == NULL || strcmp(manf, "Teensyduino") != 0) continue;
+        char serial[64];
+        char name[256];
+        tkh_private_cache_key(portptrs[i], serial, name);
+        int j = tkh_private_cache_find(entries, nentries, serial, name);
+        struct sp_port *port;
+        if (j >= 0 && !entries[j].id[0]) {
+            // Counts down the searches left before it's asked regardless (`---` is from an older file)
+            int left = (entries[j].version[0] == '-' && isdigit(entries[j].version[1])) ? atoi(entries[j].version + 1) : 0;
+            if (left <= 0) unknown[nunknown++] = portptrs[i];
+            else {
+                snprintf(entries[j].version, 4, "-%02d", left - 1);
+                changed = true;
+                silent[nsilent++] = portptrs[i];
+            }
+        }
+        else if (j < 0 || sp_copy_port(portptrs[i], &port) != SP_OK) unknown[nunknown++] = portptrs[i];
+        else {
+            Ticklish *tkh = tkh_construct(port);
+            tkh_connect(tkh);
+            if (!tkh_is_connected(tkh)) {
+                tkh_destruct(tkh);   // Busy, perhaps, but not necessarily gone, so it isn't forgotten
+                continue;
+            }
+            tkh->my_id = strdup(entries[j].id);
+            for (int m = 0; m < 4; m++) tkh->version[m] = entries[j].version[m];
+            tkh->cache_path = strdup(path);
+            tkh->vouched = false;
+            tkhs[k++] = tkh;
+        }
+    }
+    // Ports that didn't answer before are only asked again when there's asking to be done anyway
+    if (nunknown > 0) {
+        for (int i = 0; i < nsilent; i++) unknown[nunknown++] = silent[i];
+        bool silence[nunknown];
+        int found = tkh_private_probe_ports(unknown, nunknown, nunknown, tkhs + k, NULL, NULL, silence);
+        char recheck[4];
+        snprintf(recheck, 4, "-%02d", TKH_CACHE_RECHECK - 1);
+        for (int i = 0; i < nunknown; i++) {
+            char serial[64];
+            char name[256];
+            tkh_private_cache_key(unknown[i], serial, name);
+            bool answered = false;
+            for (int j = k; j < k + found && !answered; j++) answered = strcmp(tkhs[j]->portname, name) == 0;
+            // One cut short is forgotten, so as to be asked again next time like any unknown port
+            if (answered) continue;
+            if (silence[i]) changed = tkh_private_cache_set(entries, &nentries, serial, name, recheck, "") || changed;
+            else {
+                int j = tkh_private_cache_find(entries, nentries, serial, name);
+                if (j >= 0 && !entries[j].id[0]) changed = tkh_private_cache_set(entries, &nentries, serial, name, "", NULL) || changed;
+            }
+        }
+        for (int i = k; i < k + found; i++) {
+            tkhs[i]->cache_path = strdup(path);
+            if (tkh_private_cache_put(tkhs[i], entries, &nentries)) changed = true;
+        }
+        k += found;
+    }
+    if (changed) tkh_private_cache_save(path, entries, nentries);
+    sp_free_port_list(portptrs);
+    if (k == 0) free(tkhs);
+    else *tkhsp = tkhs;
+    return k;
+}
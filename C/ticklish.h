@@ -30,6 +30,9 @@ bool tkh_timed_is_valid(TkhTimed *tkt);
 
 char* tkh_timed_to_string(TkhTimed *tkt);
 
+/** As tkh_timed_to_string, into `target`.  Returns the length, or -1 if it didn't fit. */
+int tkh_timed_to_string_into(TkhTimed *tkt, char *target, int max_length);
+
 
 
 typedef struct TkhDigital {
@@ -53,11 +56,122 @@ TkhDigital tkh_pulsed_digital(char channel, double delay, double interval, unsig
 
 char* tkh_digital_to_string(TkhDigital *tdg, bool command);
 
+/** As tkh_digital_to_string, into `target`.  Returns the length, or -1 if it didn't fit. */
+int tkh_digital_to_string_into(TkhDigital *tdg, bool command, char *target, int max_length);
+
+
+
+/** One pin change recorded by the board's edge trace.  Times are in board
+  * clock ticks (TKH_TICKS_PER_SECOND) since the start of the run.
+  */
+#define TKH_TICKS_PER_SECOND 72000000
+typedef struct TkhEdge {
+    char channel;          // 'A' to 'X'
+    bool high;             // Went high (true) or low (false)
+    long long scheduled;   // When it should have happened
+    int late;              // How long after that it actually happened
+    unsigned int cycles;   // Raw CPU cycle counter when it happened
+} TkhEdge;
+
+typedef struct TkhJitter {
+    int n;          // Number of edges
+    double mean;    // Mean lateness, in seconds
+    double sd;      // Standard deviation of lateness, in seconds
+    double min;     // Smallest lateness, in seconds
+    double max;     // Largest lateness, in seconds
+} TkhJitter;
+
+/** Lateness statistics for one channel, or all of them if channel is 0 */
+TkhJitter tkh_trace_jitter(const TkhEdge *edges, int n, char channel);
+
+/** Histogram of how late a channel's pulses started (or ended), kept by the board.
+  * Bucket 0 counts edges under 16 ticks late; bucket k counts 2^(k+3) up to 2^(k+4)
+  * ticks; the last counts everything later than that.
+  */
+#define TKH_LATENESS_BUCKETS 13
+typedef struct TkhLateness {
+    char channel;
+    bool ends;                                // Pulse ends (true) or starts (false)
+    double max;                               // Largest lateness, in seconds
+    unsigned int counts[TKH_LATENESS_BUCKETS];
+} TkhLateness;
+
+/** Upper limit of a lateness bucket, in seconds (infinite for the last one) */
+double tkh_lateness_bucket_limit(int k);
+
+/** Lateness not exceeded by fraction q of the edges (e.g. 0.99), in seconds.
+  * This is the upper limit of the bucket it falls in (or the maximum, if smaller).
+  */
+double tkh_lateness_quantile(const TkhLateness *lateness, double q);
+
+/** State of the board and every channel at a single instant.  Channels are 'A' to 'X', then 'Z'. */
+#define TKH_CHANNELS 25
+typedef struct TkhSnapshot {
+    enum TkhState state;
+    long long ticks;                       // Time since start in board ticks (0 unless running)
+    unsigned char runlevel[TKH_CHANNELS];  // 0 = not running, 1 = stimulus off, 2 = stimulus on, 3 = in a pulse
+    unsigned short train[TKH_CHANNELS];    // Which train each channel is on, counting from 0 (modulo 4096)
+} TkhSnapshot;
+
+/** What the hardware trigger has done.  The edge is timed by the board's free-running
+  * cycle counter (wraps every minute or so); the run's clock counts from the edge.
+  */
+typedef struct TkhTrigger {
+    bool armed;               // Waiting for the edge
+    bool fired;               // Started a run since the last reset
+    unsigned int cycles;      // Cycle counter at the edge
+    double latency;           // Time from the edge until the run was going, in seconds
+} TkhTrigger;
+
+/** How well the board's clock is following its reference pulse. */
+typedef struct TkhDiscipline {
+    bool on;                  // Steering the drift correction from the reference
+    bool locked;              // Phase has stayed within 10 us for the last 8 edges
+    double phase;             // How far the board clock is ahead of the reference, in seconds
+    double drift;             // Drift correction now applied (as for tkh_get_fine_drift)
+    unsigned int edges;       // Reference edges used since starting (modulo 10^8)
+} TkhDiscipline;
+
+/** Fit of the board clock (seconds since power on, from `~,`) against the host's
+  * CLOCK_MONOTONIC_RAW (in seconds, as from tkh_host_now), made by tkh_clock_sample.
+  * Use it with tkh_board_to_host and tkh_host_to_board.
+  */
+typedef struct TkhClockFit {
+    int n;                    // Samples the fit rests on
+    double board_mean;        // Board time the fit is centred on...
+    double host_mean;         // ...and the host time it maps to
+    double rate;              // Host seconds per board second; less 1, it's the drift (as for tkh_fix_drift)
+    double spread;            // Scatter of the samples about the fit, in seconds
+    double sxx;               // Sum of squared board-time deviations (for how fast errors grow away from the mean)
+    double latency;           // Half the quickest round trip: how far off every sample could be
+} TkhClockFit;
+
+/** A block of input samples streamed back by the board.  Ticks are on the same clock
+  * as the stimulus, so they start again from 0 when a run starts (and epoch goes up).
+  */
+#define TKH_ANALOG_INPUTS 10    // 'A' to 'J'; 'K' to 'W' are digital
+#define TKH_BLOCK_SAMPLES 9
+typedef struct TkhSample {
+    long long ticks;                           // Board clock when the sample was taken
+    unsigned short analog[TKH_ANALOG_INPUTS];  // Raw readings (0 to 4095) of 'A' to 'J', 0 if not sampled
+    unsigned short digital;                    // Bit k set if input 'K'+k was high
+} TkhSample;
+
+typedef struct TkhBlock {
+    int n;                  // Number of samples
+    int epoch;              // Runs started since the board booted (mod 256)
+    bool running;           // Taken during a run (ticks count from its start)
+    bool lost;              // Samples were dropped just before these
+    bool last;              // Acquisition is over; this block is empty
+    TkhSample samples[TKH_BLOCK_SAMPLES];
+} TkhBlock;
+
 
 
 #define TICKLISH_PATIENCE 500
-#define TICKLISH_BUFFER_N 256
+#define TICKLISH_BUFFER_N 1024   // Must be a power of two
 #define TICKLISH_MAX_OUT 64
+#define TICKLISH_LINE_N 80   // Room for any line the board sends back (except error messages)
 
 typedef struct Ticklish {
     // This stuff should be immutable (set once at creation)
@@ -70,13 +184,37 @@ typedef struct Ticklish {
     volatile char* my_id;
     volatile char version[4];
 
+    // Identity cache this came from (see tkh_find_all_ticklish_cached), if any, and
+    // whether the board has since confirmed the identity that was remembered for it
+    char* cache_path;
+    volatile bool vouched;
+
+    // Receive ring, not guarded by the mutex: only whoever reads the port adds to it (moving
+    // buffer_end), and only one reader at a time takes from it (moving buffer_start).  Both
+    // count up forever; the bytes waiting are those from buffer_start up to buffer_end.
     volatile char* buffer;
-    volatile int buffer_start;
-    volatile int buffer_end;
+    volatile unsigned int buffer_start;
+    volatile unsigned int buffer_end;
 
     volatile int error_value;
+
+    // While the reader thread runs, it does all the reading and signals when more arrives
+    struct TkhReader *reader;
+    struct TkhRequest *spares;
+    struct TkhClock *clock;
+    struct TkhAcquisition *acquisition;
+    pthread_cond_t arrived;
+    volatile unsigned long arrivals;
 } Ticklish;
 
+/** A query sent with tkh_send or tkh_flex_send whose reply may not have come yet */
+typedef struct TkhRequest TkhRequest;
+
+/** Called from the reader thread with each reply (NULL if it was garbled or never came).
+  * The reply is freed afterwards.  Don't wait on the same board from in here.
+  */
+typedef void (*TkhReplied)(Ticklish *tkh, const char *reply, void *data);
+
 Ticklish* tkh_construct(struct sp_port* port);
 
 void tkh_destruct(Ticklish *tkh);
@@ -89,22 +227,87 @@ void tkh_disconnect(Ticklish *tkh);
 
 int tkh_wait_for_next_buffer(Ticklish *tkh);
 
+/** Reads the `n` bytes after the next `~` (or straight away if `twiddled`).  Only one thread
+  * should read from a board at a time; to share one, use tkh_send and the like.
+  */
 char* tkh_fixed_read(Ticklish *tkh, int n, bool twiddled);
 
+/** The functions ending in _into put what they read into `target`, which has room for
+  * `max_length` bytes, instead of allocating.  They return the length read (not counting
+  * the terminating 0 that follows it) or -1 if there was an error or it didn't fit.
+  */
+int tkh_fixed_read_into(Ticklish *tkh, int n, bool twiddled, char *target, int max_length);
+
 char* tkh_flex_read(Ticklish *tkh, bool dollared);
 
+int tkh_flex_read_into(Ticklish *tkh, bool dollared, char *target, int max_length);
+
 void tkh_write(Ticklish *tkh, const char *s);
 
+/** Writes exactly n bytes, which may include zeros (for binary frames) */
+void tkh_write_bytes(Ticklish *tkh, const char *s, int n);
+
 char* tkh_query(Ticklish *tkh, const char* ask, int n);
 
+int tkh_query_into(Ticklish *tkh, const char *ask, int n, char *target, int max_length);
+
 char* tkh_flex_query(Ticklish *tkh, const char* ask);
 
+int tkh_flex_query_into(Ticklish *tkh, const char *ask, char *target, int max_length);
+
+/** Starts a thread that does all the reading from the board, so that queries can be
+  * pipelined: several sent before the first reply comes back.  Replies are matched to
+  * queries in the order they were sent.  tkh_query and the like keep working and take
+  * their turn in line.  Started as needed by tkh_send and tkh_acquire_start; stopped by
+  * tkh_reader_stop or tkh_destruct.  Returns false on error.
+  */
+bool tkh_reader_start(Ticklish *tkh);
+
+/** Stops the reader thread (after up to TICKLISH_PATIENCE ms); queries still waiting get no reply. */
+void tkh_reader_stop(Ticklish *tkh);
+
+/** Sends `ask` without waiting for the `n` bytes that follow `~` in its reply.  Collect
+  * the reply with tkh_await.  Returns NULL on error.
+  */
+TkhRequest* tkh_send(Ticklish *tkh, const char *ask, int n);
+
+/** As tkh_send, for a query answered by `$` and a line of text. */
+TkhRequest* tkh_flex_send(Ticklish *tkh, const char *ask);
+
+/** As tkh_send, but `callback` gets the reply instead of tkh_await.  Returns false on error. */
+bool tkh_send_then(Ticklish *tkh, const char *ask, int n, TkhReplied callback, void *data);
+
+/** True once the reply to `request` is in (so tkh_await won't wait). */
+bool tkh_is_ready(Ticklish *tkh, TkhRequest *request);
+
+/** Waits up to `patience` milliseconds for the reply to `request` and returns it (free it
+  * with `free`), or NULL if it was garbled or didn't come in time.  Either way `request`
+  * is used up.  A reply that is still on its way is thrown out when it comes.
+  */
+char* tkh_await(Ticklish *tkh, TkhRequest *request, int patience);
+
+/** As tkh_await, into `target` (see tkh_fixed_read_into). */
+int tkh_await_into(Ticklish *tkh, TkhRequest *request, int patience, char *target, int max_length);
+
+/** Keeps at least `n` spare requests on hand for tkh_send and the like, so that pipelining
+  * with tkh_await_into or tkh_send_then doesn't allocate once they're made.  (Queries such
+  * as tkh_state never allocate, pipelined or not.)  Returns how many spares there are.
+  */
+int tkh_reserve_requests(Ticklish *tkh, int n);
+
 bool tkh_is_ticklish(Ticklish *tkh);
 
 char* tkh_id(Ticklish *tkh);
 
+int tkh_id_into(Ticklish *tkh, char *target, int max_length);
+
 enum TkhState tkh_state(Ticklish *tkh);
 
+/** Fills in the state of the board and all its channels, read out in a single packet.
+  * Works in any state.  Returns false on error.
+  */
+bool tkh_snapshot(Ticklish *tkh, TkhSnapshot *snapshot);
+
 bool tkh_ping(Ticklish *tkh);
 
 void tkh_clear(Ticklish *tkh);
@@ -113,18 +316,173 @@ bool tkh_is_error(Ticklish *tkh);
 bool tkh_is_prog(Ticklish *tkh);
 bool tkh_is_run(Ticklish *tkh);
 bool tkh_is_done(Ticklish *tkh);
+bool tkh_is_armed(Ticklish *tkh);
+
+/** Fills in the state of each of `n` boards, asking them all before waiting on any. */
+void tkh_state_all(Ticklish **tkhs, int n, enum TkhState *states);
 
 TkhTimed tkh_timesync(Ticklish *tkh);
 
+/** As tkh_timesync, but against the board clock, which runs from power on and is never reset.
+  * `zero` is then when the board clock was zero.
+  */
+TkhTimed tkh_board_timesync(Ticklish *tkh);
+
 double tkh_get_drift(Ticklish *tkh);
 double tkh_set_drift(Ticklish *tkh, double drift, bool writeEEPROM);
+double tkh_get_fine_drift(Ticklish *tkh);
+double tkh_set_fine_drift(Ticklish *tkh, double drift, bool writeEEPROM);
 int tkh_fix_drift(Ticklish *tkh, TkhTimed *first, TkhTimed *second, double minError, bool writeEEPROM);
 int tkh_zero_drift(Ticklish *tkh);
 
+/** The host clock the clock fits use: CLOCK_MONOTONIC_RAW, in seconds. */
+double tkh_host_now();
+
+/** Reads the board clock `burst` times in quick succession, keeps the reading with the
+  * quickest round trip, and refits the board clock against the host clock.  The last 64
+  * such samples are kept; slower round trips and outliers are left out of the fit.  If the
+  * board clock went backwards (the board restarted), the older samples are dropped.
+  * Returns false on error.
+  */
+bool tkh_clock_sample(Ticklish *tkh, int burst);
+
+/** Copies the latest fit into `fit`.  Returns false if there isn't one yet (3 samples are needed). */
+bool tkh_clock_fit(Ticklish *tkh, TkhClockFit *fit);
+
+/** Forgets every sample, e.g. after changing the drift correction by hand. */
+void tkh_clock_forget(Ticklish *tkh);
+
+/** Host time at which the board clock read `board` seconds.  If `error` is not NULL, it is
+  * set to a bound on how far off that could be, which grows away from the samples.
+  */
+double tkh_board_to_host(const TkhClockFit *fit, double board, double *error);
+
+/** Board clock reading at host time `host`, with the same sort of error bound. */
+double tkh_host_to_board(const TkhClockFit *fit, double host, double *error);
+
+/** Keeps sampling in a background thread, a burst every `interval` seconds.  Starts the
+  * reader thread too, so other queries from other threads take turns with the samples.
+  * The sampler's own failures don't show in error_value, which is still one per board and
+  * not per thread: if other threads also use the board meanwhile, go by what each call
+  * returns rather than by error_value.  Returns false on error.
+  */
+bool tkh_clock_start(Ticklish *tkh, double interval, int burst);
+
+/** Stops sampling in the background; the fit stays. */
+void tkh_clock_stop(Ticklish *tkh);
+
+/** As tkh_fix_drift, using the drift from the clock fit, then forgets the samples (they
+  * were taken at the old rate).  Returns 1 if corrected, 0 if not needed, -1 on error.
+  */
+int tkh_clock_fix_drift(Ticklish *tkh, double minDrift, bool writeEEPROM);
+
+/** Keeps the board's clock in step with a reference pulse (e.g. 1 PPS) arriving every `period`
+  * seconds (0.01 to 20) on input `channel` ('A' to 'W', not used as an output), on rising
+  * (or else falling) edges.  The drift correction is then steered continuously, and cannot
+  * be set by hand until tkh_discipline_stop.  Returns false on error.
+  */
+bool tkh_discipline_start(Ticklish *tkh, char channel, bool rising, double period);
+
+/** Stops following the reference; the last drift correction stays in place.  Returns false on error. */
+bool tkh_discipline_stop(Ticklish *tkh);
+
+/** Reads back how well the clock is following the reference.  Returns false on error. */
+bool tkh_discipline(Ticklish *tkh, TkhDiscipline *discipline);
+
 void tkh_set(Ticklish *tkh, TkhDigital *protocols, int n);
 
+/** Like tkh_set, but uploads the protocols as CRC-checked binary frames (`~[`).
+  * Frames are sent back to back and the acknowledgements collected at the end,
+  * so this is much faster than tkh_set for long lists of protocols.
+  */
+#define TKH_BIN_RECORD 26
+#define TKH_BIN_MAX_RECORDS 2
+#define TKH_BIN_APPEND 1
+#define TKH_BIN_INVERT 2
+void tkh_set_binary(Ticklish *tkh, TkhDigital *protocols, int n);
+
+/** Turns on streaming for the next run (must be in the programming state).
+  * While a streamed run is going, finished trains are recycled and more can be
+  * appended with tkh_stream; the run cannot be refreshed afterwards.
+  * Returns the number of trains that can be stored now, or -1 on error.
+  */
+int tkh_stream_enable(Ticklish *tkh);
+
+/** Number of trains that can be stored now, or -1 on error */
+int tkh_stream_credits(Ticklish *tkh);
+
+/** Appends as many of the n protocols to their (running) channels as there
+  * is room for.  Returns how many were sent (call again with the rest once
+  * some trains have finished), or -1 on error.  A channel that runs out of
+  * trains before more arrive stops, and appending to it is then an error.
+  */
+int tkh_stream(Ticklish *tkh, TkhDigital *protocols, int n);
+
 TkhTimed tkh_run(Ticklish *tkh);
 
+/** Arms the board to start running on an edge (rising, or else falling) of input `channel`
+  * ('A' to 'W', not used as an output).  `mode` is how to run: '*' (as tkh_run), '+'
+  * (precompiled) or '>' (from the edge timer).  The run's clock starts at the edge itself.
+  * Must be in the programming state (refresh a finished run first).  Returns false on error.
+  */
+bool tkh_arm(Ticklish *tkh, char channel, bool rising, char mode);
+
+/** Arms the board to start running when its board clock (see tkh_board_timesync) reaches
+  * `board_time`; `mode` is as for tkh_arm.  Returns false on error (including if that time
+  * has already passed).
+  */
+bool tkh_run_at(Ticklish *tkh, const struct timeval *board_time, char mode);
+
+/** Starts n boards together, `delay` seconds from now (allow a few ms per board to set up).
+  * Each board's clock is synchronized to this machine's, and each is armed to start at the
+  * same moment on it.  Boards must be programmed (finished runs are refreshed).  If `start`
+  * is not NULL, it is set to the time (on this machine) when the runs start.  Returns false
+  * on error, in which case any boards already armed are disarmed.
+  */
+bool tkh_run_all_at(Ticklish **tkhs, int n, double delay, char mode, struct timeval *start);
+
+/** Goes back to programming if the trigger has not fired yet.  Returns false on error. */
+bool tkh_disarm(Ticklish *tkh);
+
+/** Reads back what the trigger has done.  Returns false on error. */
+bool tkh_trigger(Ticklish *tkh, TkhTrigger *trigger);
+
+/** Fetches the histogram of pulse start (or end) lateness on a digital channel, while
+  * running or after.  Returns false on error.
+  */
+bool tkh_lateness(Ticklish *tkh, char channel, bool ends, TkhLateness *result);
+
+/** Starts recording every edge (clearing anything already recorded).  Not while running. */
+void tkh_trace_start(Ticklish *tkh);
+
+/** Stops recording edges; what was recorded can still be read. */
+void tkh_trace_stop(Ticklish *tkh);
+
+/** Reads every edge recorded since the last read into a new array (free it with `free`).
+  * Returns the number of edges, or -1 on error.  Pass the last edge from the previous
+  * read as `previous` (or NULL for the first) so that times keep counting up past the
+  * 45 days the board's 48-bit timestamps can hold.  If `lost` is not NULL, it is set to
+  * the number of edges dropped since tracing started because reads didn't keep up.
+  */
+int tkh_trace_read(Ticklish *tkh, TkhEdge **edges, const TkhEdge *previous, unsigned int *lost);
+
+/** Starts the board sampling the inputs named in `inputs` (e.g. "ABK": analog 'A' to 'J',
+  * digital 'K' to 'W', none used as outputs) every `period` seconds, which must be at least
+  * 50 us plus 50 us per analog input.  The reader thread (started if need be) collects
+  * the samples for tkh_acquire_next.  Other commands still work meanwhile.
+  * Returns false on error, or if the last acquisition hasn't been stopped with tkh_acquire_stop.
+  */
+bool tkh_acquire_start(Ticklish *tkh, const char *inputs, double period);
+
+/** Waits up to `patience` milliseconds for the next block of samples.  Returns 1 if one
+  * was copied into `block`, 0 if none came in time, or -1 once acquisition has stopped
+  * and every block has been handed out.
+  */
+int tkh_acquire_next(Ticklish *tkh, TkhBlock *block, int patience);
+
+/** Stops sampling and waits for the board's last block.  Blocks already collected can still be read. */
+void tkh_acquire_stop(Ticklish *tkh);
+
 
 
 /** Pass a reference to a pointer for an array of descriptions.
@@ -133,7 +491,7 @@ TkhTimed tkh_run(Ticklish *tkh);
   */
 int tkh_get_all_port_descriptions(char ***descsp);
 
-/** Gets a Ticklish if available.  Destroy with tkh_destruct.
+/** Gets a Ticklish if available (whichever answers first).  Destroy with tkh_destruct.
   * Port is OPEN when the routine returns!
   */
 Ticklish* tkh_find_first_ticklish();
@@ -142,9 +500,39 @@ Ticklish* tkh_find_first_ticklish();
   * Function returns the number of things actually passed back.
   * Call tkh_destruct on each item in the array, then `free` the array.
   * Every port is OPEN when the routine returns!
+  * All ports are asked at once, so this takes about as long as the slowest board
+  * (or TICKLISH_PATIENCE, if something that looks like a Teensy never answers).
+  * Once boards have answered, ports that haven't get only a few times as long again.
   */
 int tkh_find_all_ticklish(Ticklish ***tkhsp);
 
+/** Like tkh_find_all_ticklish, but calls `found` with each board as soon as it answers
+  * (on the calling thread, before this returns), so setup can start while the others are asked.
+  */
+int tkh_find_all_ticklish_then(Ticklish ***tkhsp, void (*found)(Ticklish *tkh, void *data), void *data);
+
+/** Like tkh_find_all_ticklish, but remembers boards in the file at `path` between runs.
+  * A port whose USB serial number and name match a remembered board is opened and
+  * handed back at once, with tkh_id answered from the file; only the other ports are
+  * asked.  Each remembered board is asked `~?` once, just before anything else is sent
+  * to it.  If another identity answers, the handle and the file take it.  If nothing
+  * answers, the board is forgotten and whatever was being sent fails.
+  * Teensy ports that opened but didn't answer in the full time allowed are remembered
+  * too, and only asked again along with ports that aren't in the file yet, or on every
+  * TKH_CACHE_RECHECK-th search if that comes first (so a board newly loaded with Ticklish
+  * on the same port turns up).  One given up on sooner, as the others had all answered,
+  * or that couldn't be opened (another program may have it), is asked again next time.
+  * The file is created if it doesn't exist; delete it to start over.
+  */
+#define TKH_CACHE_RECHECK 10
+
+int tkh_find_all_ticklish_cached(Ticklish ***tkhsp, const char *path);
+
+/** Like tkh_find_all_ticklish, but asks one port at a time, waiting out each in turn.
+  * Slower; use it if the serial drivers object to ports being opened at once.
+  */
+int tkh_find_all_ticklish_in_turn(Ticklish ***tkhsp);
+
 
 #ifdef __cplusplus
 }
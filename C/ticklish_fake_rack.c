@@ -0,0 +1,119 @@
+/* Copyright (c) 2016 by Rex Kerr and Calico Life Sciences */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libserialport.h>
+
+#include "ticklish.h"
+#include "ticklish_fake_rack.h"
+
+int fake_boards = 12;
+int fake_silent = 2;
+int fake_other = 2;
+int fake_slow = -1;
+int fake_renamed = -1;
+int fake_busy = -1;
+
+/* Each port remembers the last query it was sent and when the answer is due. */
+struct sp_port {
+    int index;
+    int asked;      // 0 nothing, 1 `~?`, 2 `~'`
+    bool answered;
+    double due;     // Host time the answer is ready
+};
+
+static struct sp_port fake_ports[FAKE_RACK_MAX];
+static struct sp_port *fake_list[FAKE_RACK_MAX + 1];
+static char fake_names[FAKE_RACK_MAX][16];
+static char fake_serials[FAKE_RACK_MAX][16];
+
+enum sp_return sp_list_ports(struct sp_port ***list_ptr) {
+    int n = fake_boards + fake_silent + fake_other;
+    if (n > FAKE_RACK_MAX) n = FAKE_RACK_MAX;
+    for (int i = 0; i < n; i++) {
+        fake_ports[i].index = i;
+        snprintf(fake_names[i], sizeof(fake_names[i]), "ttyACM%d", i);
+        snprintf(fake_serials[i], sizeof(fake_serials[i]), "%d", 1000 + i);
+        fake_list[i] = fake_ports + i;
+    }
+    fake_list[n] = NULL;
+    *list_ptr = fake_list;
+    return SP_OK;
+}
+
+void sp_free_port_list(struct sp_port **ports) {}
+
+enum sp_return sp_copy_port(const struct sp_port *port, struct sp_port **copy_ptr) {
+    *copy_ptr = (struct sp_port*)malloc(sizeof(struct sp_port));
+    if (*copy_ptr == NULL) return SP_ERR_MEM;
+    **copy_ptr = *port;
+    return SP_OK;
+}
+
+void sp_free_port(struct sp_port *port) { free(port); }
+
+char *sp_get_port_name(const struct sp_port *port) { return fake_names[port->index]; }
+
+char *sp_get_port_usb_manufacturer(const struct sp_port *port) {
+    return (port->index < fake_boards + fake_silent) ? "Teensyduino" : "Other";
+}
+
+char *sp_get_port_usb_serial(const struct sp_port *port) { return fake_serials[port->index]; }
+
+enum sp_return sp_open(struct sp_port *port, enum sp_mode flags) {
+    usleep(1000);
+    if (port->index == fake_busy) return SP_ERR_FAIL;
+    port->asked = 0;
+    port->answered = false;
+    return SP_OK;
+}
+
+enum sp_return sp_close(struct sp_port *port) { return SP_OK; }
+enum sp_return sp_set_baudrate(struct sp_port *port, int baudrate) { return SP_OK; }
+enum sp_return sp_set_bits(struct sp_port *port, int bits) { return SP_OK; }
+enum sp_return sp_set_parity(struct sp_port *port, enum sp_parity parity) { return SP_OK; }
+enum sp_return sp_set_stopbits(struct sp_port *port, int stopbits) { return SP_OK; }
+
+enum sp_return sp_blocking_write(struct sp_port *port, const void *buf, size_t count, unsigned int timeout_ms) {
+    if (count < 2) return (enum sp_return)count;
+    if (memcmp(buf, "~?", 2) == 0) {
+        port->asked = 1;
+        port->answered = false;
+        port->due = tkh_host_now() + 0.002 + 0.0002*port->index + ((port->index == fake_slow) ? 0.3 : 0);
+    }
+    else if (memcmp(buf, "~'", 2) == 0) {
+        port->asked = 2;
+        port->answered = false;
+        port->due = tkh_host_now() + 0.001;
+    }
+    return (enum sp_return)count;
+}
+
+/* Copies out the answer to the last query if it is ready; returns the number of bytes. */
+static int fake_answer(struct sp_port *port, char *buf, size_t count) {
+    if (port->asked == 0 || port->answered || port->index >= fake_boards) return 0;
+    if (tkh_host_now() < port->due) return 0;
+    char line[32];
+    if (port->asked == 1) {
+        const char *name = (port->index == fake_renamed) ? "moved" : "board";
+        snprintf(line, sizeof(line), "$Ticklish1.1 %s%02d\n", name, port->index);
+    }
+    else snprintf(line, sizeof(line), "$\n");
+    int n = strlen(line);
+    if (n > (int)count) n = (int)count;
+    memcpy(buf, line, n);
+    port->answered = true;
+    return n;
+}
+
+enum sp_return sp_blocking_read_next(struct sp_port *port, void *buf, size_t count, unsigned int timeout_ms) {
+    double give_up = tkh_host_now() + ((timeout_ms > 0) ? timeout_ms : 100000)*1e-3;
+    for (;;) {
+        int n = fake_answer(port, (char*)buf, count);
+        if (n > 0) return (enum sp_return)n;
+        if (tkh_host_now() > give_up) return (enum sp_return)0;
+        usleep(100);
+    }
+}
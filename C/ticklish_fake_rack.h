@@ -0,0 +1,24 @@
+/* Copyright (c) 2016 by Rex Kerr and Calico Life Sciences */
+
+#ifndef TICKLISH_FAKE_RACK_H
+#define TICKLISH_FAKE_RACK_H
+
+/* A stand-in for libserialport: a rack of boards that answer `~?` and `~'` and nothing else.
+ *
+ * Link ticklish_fake_rack.o in place of -lserialport to try out finding boards without
+ * any hardware.  Ports are listed in order: first the boards, then Teensy ports that
+ * never answer, then ports from some other maker.  Board k answers `~?` as `boardKK`
+ * after 2 ms plus 0.2 ms per port before it.  The settings below may be changed between
+ * searches, but not while one is running.
+ */
+
+#define FAKE_RACK_MAX 16
+
+extern int fake_boards;   // Ports that answer (default 12)
+extern int fake_silent;   // Teensy ports after them that never answer (default 2)
+extern int fake_other;    // Ports from another maker after those (default 2)
+extern int fake_slow;     // This board takes 300 ms longer to answer `~?` (default -1, none)
+extern int fake_renamed;  // This board answers `~?` as `movedKK` instead (default -1, none)
+extern int fake_busy;     // This port can't be opened, as if another program had it (default -1, none)
+
+#endif
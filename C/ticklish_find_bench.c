@@ -0,0 +1,46 @@
+/* Copyright (c) 2016 by Rex Kerr and Calico Life Sciences */
+
+/* Times finding every attached Ticklish, asking all ports at once and one at a time.
+ *
+ * Each way is tried a few times (all the boards found are closed again in between),
+ * and the best and worst times are reported along with how many boards were found.
+ * A port that looks like a Teensy but never answers costs the one-at-a-time search
+ * TICKLISH_PATIENCE twice over, and the all-at-once search no more than that in total.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ticklish_util.h"
+#include "ticklish.h"
+
+#define BENCH_TRIES 5
+
+void bench_find(const char *how, int (*find)(Ticklish ***tkhsp)) {
+    double best = 1e9, worst = 0;
+    int least = -1, most = 0;
+    for (int i = 0; i < BENCH_TRIES; i++) {
+        Ticklish **tkhs;
+        double t0 = tkh_host_now();
+        int n = find(&tkhs);
+        double dt = tkh_host_now() - t0;
+        if (dt < best) best = dt;
+        if (dt > worst) worst = dt;
+        if (least < 0 || n < least) least = n;
+        if (n > most) most = n;
+        for (int j = 0; j < n; j++) tkh_destruct(tkhs[j]);
+        if (tkhs != NULL) free(tkhs);
+    }
+    printf("%-12s %4d %4d %9.1f %9.1f\n", how, least, most, best*1e3, worst*1e3);
+}
+
+int main(int argn, char** args) {
+    if (argn > 1) {
+        printf("This benchmark does not take any arguments.\n");
+        return 1;
+    }
+    printf("%-12s %4s %4s %9s %9s\n", "search", "min", "max", "best ms", "worst ms");
+    bench_find("in turn", tkh_find_all_ticklish_in_turn);
+    bench_find("at once", tkh_find_all_ticklish);
+    return 0;
+}
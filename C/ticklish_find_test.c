@@ -0,0 +1,236 @@
+/* Copyright (c) 2016 by Rex Kerr and Calico Life Sciences */
+
+/* Checks finding boards against the fake rack in ticklish_fake_rack.c, so no hardware is needed.
+ *
+ * Each check prints its name and `ok` or `FAILED`, with what went wrong on stderr;
+ * the exit status is the number of checks that failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ticklish_util.h"
+#include "ticklish.h"
+#include "ticklish_fake_rack.h"
+
+int test_failed = 0;    // In the check being run
+
+void test_expect(bool ok, const char *what, int line) {
+    if (ok) return;
+    fprintf(stderr, "  line %d: %s\n", line, what);
+    test_failed += 1;
+}
+
+#define EXPECT(x) test_expect((x), #x, __LINE__)
+
+void test_close_all(Ticklish **tkhs, int n) {
+    for (int i = 0; i < n; i++) tkh_destruct(tkhs[i]);
+    if (tkhs != NULL) free(tkhs);
+}
+
+/* Runs one search; returns how many boards it found and sets the time it took (in seconds). */
+int test_find(int (*find)(Ticklish ***tkhsp), double *took) {
+    Ticklish **tkhs = NULL;
+    double t0 = tkh_host_now();
+    int n = find(&tkhs);
+    *took = tkh_host_now() - t0;
+    test_close_all(tkhs, n);
+    return n;
+}
+
+
+/* All at once and in turn find the same boards, whatever else is plugged in, and a
+ * rack of boards takes all at once little longer than one does.
+ */
+void test_at_once() {
+    int cases[][2] = { {1, 0}, {4, 0}, {12, 0}, {12, 2}, {0, 2} };
+    double one = 0;
+    for (int c = 0; c < 5; c++) {
+        fake_boards = cases[c][0];
+        fake_silent = cases[c][1];
+        double in_turn, at_once;
+        EXPECT(test_find(tkh_find_all_ticklish_in_turn, &in_turn) == fake_boards);
+        EXPECT(test_find(tkh_find_all_ticklish, &at_once) == fake_boards);
+        if (c == 0) one = at_once;
+        if (c == 2) {
+            EXPECT(at_once < in_turn);
+            EXPECT(at_once < one + 0.05);
+        }
+        if (fake_silent > 0) EXPECT(at_once < 1.5e-3*TICKLISH_PATIENCE);
+    }
+    fake_boards = 12;
+    fake_silent = 2;
+}
+
+
+/* Each board found is handed to the callback once, and the first found is a board. */
+bool test_found_ids[FAKE_RACK_MAX];
+
+void test_found(Ticklish *tkh, void *data) {
+    char id[TICKLISH_LINE_N];
+    int k = -1;
+    if (tkh_id_into(tkh, id, TICKLISH_LINE_N) > 0 && sscanf(id, "board%d", &k) == 1 && k >= 0 && k < FAKE_RACK_MAX) {
+        if (test_found_ids[k]) test_failed += 1;
+        test_found_ids[k] = true;
+    }
+    else test_failed += 1;
+    *(int*)data += 1;
+}
+
+void test_then() {
+    fake_boards = 3;
+    fake_silent = 1;
+    memset(test_found_ids, 0, sizeof(test_found_ids));
+    Ticklish **tkhs = NULL;
+    int calls = 0;
+    int n = tkh_find_all_ticklish_then(&tkhs, test_found, &calls);
+    EXPECT(n == 3);
+    EXPECT(calls == 3);
+    EXPECT(test_found_ids[0] && test_found_ids[1] && test_found_ids[2]);
+    test_close_all(tkhs, n);
+    Ticklish *first = tkh_find_first_ticklish();
+    EXPECT(first != NULL);
+    if (first != NULL) {
+        char id[TICKLISH_LINE_N];
+        EXPECT(tkh_id_into(first, id, TICKLISH_LINE_N) > 0 && strncmp(id, "board", 5) == 0);
+        tkh_destruct(first);
+    }
+    fake_boards = 12;
+    fake_silent = 2;
+}
+
+
+/* The cache: boards come back from the file without waiting, a board that changed its
+ * name is noticed the first time it's used, and ports that never answered (once given
+ * the full time) are asked again when something new is plugged in.
+ */
+#define TEST_CACHE "ticklish_find_test.cache"
+
+/* Runs a cached search; returns how many boards it found, sets the time it took, and puts the id of board 3 in `id3`. */
+int test_find_cached(double *took, char *id3, bool ping3) {
+    Ticklish **tkhs = NULL;
+    double t0 = tkh_host_now();
+    int n = tkh_find_all_ticklish_cached(&tkhs, TEST_CACHE);
+    *took = tkh_host_now() - t0;
+    id3[0] = 0;
+    if (n > 3) {
+        if (ping3) EXPECT(tkh_ping(tkhs[3]));
+        tkh_id_into(tkhs[3], id3, TICKLISH_LINE_N);
+    }
+    test_close_all(tkhs, n);
+    return n;
+}
+
+void test_cached() {
+    remove(TEST_CACHE);
+    char id[TICKLISH_LINE_N];
+    double cold, warm;
+    EXPECT(test_find_cached(&cold, id, false) == 12);
+    EXPECT(strcmp(id, "board03") == 0);
+    // The silent ports were given up on early, so they get their full wait once
+    EXPECT(test_find_cached(&warm, id, false) == 12);
+    EXPECT(warm > 0.9e-3*TICKLISH_PATIENCE);
+    EXPECT(test_find_cached(&warm, id, false) == 12);
+    EXPECT(strcmp(id, "board03") == 0);
+    EXPECT(warm < cold/2);
+    // Still says the old name until it's asked
+    fake_renamed = 3;
+    EXPECT(test_find_cached(&warm, id, false) == 12);
+    EXPECT(strcmp(id, "board03") == 0);
+    EXPECT(test_find_cached(&warm, id, true) == 12);
+    EXPECT(strcmp(id, "moved03") == 0);
+    EXPECT(test_find_cached(&warm, id, false) == 12);
+    EXPECT(strcmp(id, "moved03") == 0);
+    fake_renamed = -1;
+    EXPECT(test_find_cached(&warm, id, true) == 12);
+    EXPECT(strcmp(id, "board03") == 0);
+    // A silent port that starts answering isn't asked until a new port turns up
+    fake_boards = 13;
+    fake_silent = 1;
+    EXPECT(test_find_cached(&warm, id, false) == 12);
+    fake_silent = 2;
+    EXPECT(test_find_cached(&warm, id, false) == 13);
+    EXPECT(test_find_cached(&warm, id, false) == 13);
+    EXPECT(test_find_cached(&warm, id, false) == 13);
+    EXPECT(warm < cold/2);
+    fake_boards = 12;
+    remove(TEST_CACHE);
+}
+
+/* A board much slower than the rest is given up on, but not remembered as silent. */
+void test_cached_slow() {
+    remove(TEST_CACHE);
+    char id[TICKLISH_LINE_N];
+    double took;
+    fake_slow = 5;
+    int cold = test_find_cached(&took, id, false);
+    EXPECT(cold == 11 || cold == 12);
+    fake_slow = -1;
+    EXPECT(test_find_cached(&took, id, false) == 12);
+    EXPECT(test_find_cached(&took, id, false) == 12);
+    remove(TEST_CACHE);
+}
+
+/* A board whose port another program has open is missed, but found once the port is free. */
+void test_cached_busy() {
+    remove(TEST_CACHE);
+    char id[TICKLISH_LINE_N];
+    double took;
+    fake_busy = 3;
+    EXPECT(test_find_cached(&took, id, false) == 11);
+    EXPECT(test_find_cached(&took, id, false) == 11);
+    fake_busy = -1;
+    EXPECT(test_find_cached(&took, id, false) == 12);
+    EXPECT(test_find_cached(&took, id, false) == 12);
+    remove(TEST_CACHE);
+}
+
+/* A port remembered as silent is asked again every TKH_CACHE_RECHECK-th search even
+ * if nothing new turns up, so a board loaded with Ticklish there is found.
+ */
+void test_cached_recheck() {
+    remove(TEST_CACHE);
+    char id[TICKLISH_LINE_N];
+    double took;
+    EXPECT(test_find_cached(&took, id, false) == 12);
+    EXPECT(test_find_cached(&took, id, false) == 12);   // Silent ports get their full wait
+    fake_boards = 13;
+    fake_silent = 1;
+    for (int i = 1; i <= TKH_CACHE_RECHECK; i++) {
+        int n = test_find_cached(&took, id, false);
+        EXPECT(n == ((i < TKH_CACHE_RECHECK) ? 12 : 13));
+    }
+    fake_boards = 12;
+    fake_silent = 2;
+    remove(TEST_CACHE);
+}
+
+
+typedef struct TestCase {
+    const char *name;
+    void (*check)();
+} TestCase;
+
+TestCase test_cases[] = {
+    { "all at once", test_at_once },
+    { "found callback", test_then },
+    { "cached", test_cached },
+    { "cached, slow board", test_cached_slow },
+    { "cached, busy port", test_cached_busy },
+    { "cached, recheck silent", test_cached_recheck }
+};
+
+int main(int argn, char** args) {
+    int failures = 0;
+    int nc = sizeof(test_cases) / sizeof(test_cases[0]);
+    for (int i = 0; i < nc; i++) {
+        printf("%-24s ", test_cases[i].name);
+        fflush(stdout);
+        test_failed = 0;
+        test_cases[i].check();
+        printf("%s\n", test_failed ? "FAILED" : "ok");
+        if (test_failed) failures += 1;
+    }
+    return failures;
+}
@@ -65,6 +65,7 @@ enum TkhState tkh_char_to_state(char c) {
         case '/': return TKH_ALLDONE; break;
         case '.': return TKH_PROGRAM; break;
         case '!': return TKH_ERRORED; break;
+        case '_': return TKH_ARMED; break;
         default:  return TKH_UNKNOWN;
     }
 }
@@ -98,10 +99,10 @@ int tkh_encode_time_into(const struct timeval *tv, char* target, int max_length)
 struct timeval tkh_decode_time(const char *s) {
     struct timeval tv = {0, -1};   // Error by default
     if (!tkh_string_is_time_report(s)) return tv;
-    errno = 0;
-    double t = strtod(s, NULL);
-    tv.tv_sec = (int)floor(t);
-    tv.tv_usec = (int)rint((t - floor(t))*10000000);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    for (int i = 0; i < 8; i++) tv.tv_sec = 10*tv.tv_sec + (s[i] - '0');
+    for (int i = 9; i < 15; i++) tv.tv_usec = 10*tv.tv_usec + (s[i] - '0');
     return tv;
 }
 
@@ -148,6 +149,40 @@ double tkh_decode_drift(const char *s) {
     else return 1.0/x;
 }
 
+int tkh_encode_fine_drift_into(double drift, char* target, int max_length) {
+    if (max_length < 9) return -1;
+    if (drift < 0) *target = '-';
+    else *target = '+';
+    drift = fabs(drift);
+    int value = (drift <= TKH_MAX_FINE_DRIFT) ? lrint(drift*1e10) : 0;
+    snprintf(target+1, 9, "%08d", value);
+    target[9] = 0;
+    return 9;
+}
+
+double tkh_decode_fine_drift(const char *s) {
+    int sign;
+    if (*s == '+') sign = 1;
+    else if (*s == '-') sign = -1;
+    else return NAN;
+    int number = 0;
+    int i;
+    for (i = 1; i < 9; i++) {
+        char c = s[i];
+        if (c < '0' || c > '9') return NAN;
+        number = number*10 + (c - '0');
+    }
+    return sign * number * 1e-10;
+}
+
+unsigned short tkh_crc16(const unsigned char *data, int n) {
+    unsigned short crc = 0xFFFF;
+    for (int i = 0; i < n; i++) {
+        crc ^= ((unsigned short)data[i]) << 8;
+        for (int j = 0; j < 8; j++) crc = (crc & 0x8000) ? (unsigned short)((crc << 1) ^ 0x1021) : (unsigned short)(crc << 1);
+    }
+    return crc;
+}
 
 float tkh_decode_voltage(const char *s) {
     int ndp = 0;
@@ -202,7 +237,7 @@ bool tkh_string_is_ticklish(const char *s) {
 }
 
 bool tkh_string_is_time_report(const char *s) {
-    if (!s[8] == '.') return 0;
+    if (s[8] != '.') return 0;
     for (int i = 0; i<15; i++) {
         if (i != 8) {
             if (!isdigit(s[i])) return 0;
@@ -11,7 +11,7 @@ extern "C" {
 #include <sys/time.h>
 
 
-enum TkhState { TKH_UNKNOWN, TKH_ERRORED, TKH_ALLDONE, TKH_PROGRAM, TKH_RUNNING };
+enum TkhState { TKH_UNKNOWN, TKH_ERRORED, TKH_ALLDONE, TKH_PROGRAM, TKH_RUNNING, TKH_ARMED };
 
 enum TkhState tkh_char_to_state(char c);
 
@@ -35,6 +35,14 @@ long long tkh_micros_from_timeval(const struct timeval *tv);
 double tkh_decode_drift(const char *s);
 int tkh_encode_drift_into(double d, char *target, int max_length);
 
+/** Fine drift is sent in parts per 10^10, so it must be less than 0.01 in magnitude */
+#define TKH_MAX_FINE_DRIFT 0.0099999999
+double tkh_decode_fine_drift(const char *s);
+int tkh_encode_fine_drift_into(double d, char *target, int max_length);
+
+/** CRC-16 (CCITT polynomial 0x1021, initial value 0xFFFF) as used by binary uploads */
+unsigned short tkh_crc16(const unsigned char *data, int n);
+
 float tkh_decode_voltage(const char *s);
 
 enum TkhState tkh_decode_state(const char *s);
@@ -0,0 +1,93 @@
+/* Just enough of the Teensy core for ticklish.ino to compile and run on a desktop.
+ *
+ * Time comes from host_cycles, which stands in for the ARM cycle counter: every
+ * read advances it by host_step, and a driver may also move it along directly.
+ * Pin writes are counted rather than performed, and values written to the
+ * analog output are logged.  The serial port is a pair of byte buffers.
+ * Everything else does nothing.
+ */
+
+#ifndef TICKLISH_HOST_ARDUINO_H
+#define TICKLISH_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define A14 40
+
+#define HOST_PINS 64
+#define HOST_DAC_N 65536
+
+extern uint32_t host_cycles;              // The fake cycle counter
+extern uint32_t host_step;                // How much it moves on every read
+extern byte host_level[HOST_PINS];        // Last value written to each pin
+extern uint64_t host_edges[HOST_PINS];    // Number of writes to each pin that changed its level
+extern uint16_t host_dac[HOST_DAC_N];     // Values written to the analog output, oldest first...
+extern int host_dac_n;                    // ...and how many (any past HOST_DAC_N are dropped)
+
+#define ARM_DWT_CYCCNT (host_cycles += host_step)
+#define ARM_DEMCR_TRCENA 1
+#define ARM_DWT_CTRL_CYCCNTENA 1
+extern uint32_t ARM_DEMCR;
+extern uint32_t ARM_DWT_CTRL;
+
+inline void pinMode(int pin, int mode) {}
+inline void digitalWrite(int pin, int value) {
+  if (pin < 0 || pin >= HOST_PINS) return;
+  byte v = (value) ? HIGH : LOW;
+  if (host_level[pin] != v) { host_level[pin] = v; host_edges[pin] += 1; }
+}
+inline int digitalRead(int pin) { return (pin >= 0 && pin < HOST_PINS) ? host_level[pin] : LOW; }
+inline int analogRead(int pin) { return 0; }
+inline void analogWrite(int pin, int value) {
+  if (pin == A14 && host_dac_n < HOST_DAC_N) host_dac[host_dac_n++] = (uint16_t)value;
+}
+inline void analogReadResolution(int bits) {}
+inline void analogWriteResolution(int bits) {}
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+#define HOST_SERIAL_N 8192
+
+struct HostSerial {
+  byte in[HOST_SERIAL_N];   // Waiting to be read by the sketch
+  int in_i, in_n;
+  byte out[HOST_SERIAL_N];  // Written by the sketch (oldest dropped if full)
+  int out_n;
+
+  void begin(long baud) { in_i = in_n = out_n = 0; }
+  int available() { return in_n - in_i; }
+  int availableForWrite() { return 64; }
+  int read() { return (in_i < in_n) ? in[in_i++] : -1; }
+  void send_now() {}
+
+  size_t write(const void *p, size_t n) {
+    if (n > HOST_SERIAL_N) n = HOST_SERIAL_N;
+    if (out_n + (int)n > HOST_SERIAL_N) out_n = 0;
+    memcpy(out + out_n, p, n);
+    out_n += (int)n;
+    return n;
+  }
+  size_t write(const char *s) { return write(s, strlen(s)); }
+
+  // Queues bytes as if they had arrived from the host.
+  void feed(const char *s, int n) {
+    if (in_i == in_n) in_i = in_n = 0;
+    if (in_n + n > HOST_SERIAL_N) n = HOST_SERIAL_N - in_n;
+    memcpy(in + in_n, s, n);
+    in_n += n;
+  }
+};
+
+extern HostSerial Serial;
+
+#endif
@@ -0,0 +1,19 @@
+/* Teensy 3.x EEPROM, kept in memory (starts out blank on every run). */
+
+#ifndef TICKLISH_HOST_EEPROM_H
+#define TICKLISH_HOST_EEPROM_H
+
+#include "Arduino.h"
+
+#define HOST_EEPROM_N 2048
+
+struct HostEEPROM {
+  byte m[HOST_EEPROM_N];
+
+  byte read(int i) { return (i >= 0 && i < HOST_EEPROM_N) ? m[i] : 0xFF; }
+  void write(int i, byte v) { if (i >= 0 && i < HOST_EEPROM_N) m[i] = v; }
+};
+
+extern HostEEPROM EEPROM;
+
+#endif
@@ -0,0 +1,159 @@
+/* Runs the stimulus scheduler from ticklish.ino on the desktop and reports what it costs.
+ *
+ * Each case is programmed over the (fake) serial port just as a host would, then
+ * played from start to finish with the clock jumping straight to each deadline, so
+ * all the time measured is time spent working out the next edges and writing them.
+ * Costs are in nanoseconds of host time, per call of run_iteration (the work that
+ * has to happen on time) and per edge.  Compiling ahead, in precompiled mode, is
+ * done while idle, so it is reported separately.  In interrupt mode each deadline
+ * goes to edge_interrupt instead, which also sets the (simulated) edge timer again.
+ *
+ * Absolute numbers say little about the board, but comparing two builds on the
+ * same machine shows whether a change to the scheduler made it faster or slower.
+ */
+
+#include <time.h>
+
+#include "Arduino.h"
+#include "EEPROM.h"
+
+uint32_t host_cycles = 0;
+uint32_t host_step = 0;
+byte host_level[HOST_PINS];
+uint64_t host_edges[HOST_PINS];
+uint16_t host_dac[HOST_DAC_N];
+int host_dac_n = 0;
+uint32_t ARM_DEMCR = 0;
+uint32_t ARM_DWT_CTRL = 0;
+HostSerial Serial;
+HostEEPROM EEPROM;
+
+#include "../ticklish/ticklish.ino"
+
+// Ticks the clock moves on every read while commands are being processed
+#define BENCH_STEP 13
+
+int64_t bench_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec)*1000000000 + ts.tv_nsec;
+}
+
+// Feeds a command to the board and runs the main loop until it has been handled.
+void bench_send(const char *command) {
+  Serial.feed(command, (int)strlen(command));
+  for (int i = 0; i < 1000000 && (Serial.available() > 0 || bufi > 0); i++) loop();
+  Serial.out_n = 0;
+  if (runlevel == RUN_ERROR || runlevel == RUN_TO_ERROR) {
+    fprintf(stderr, "Board error after %s: %.*s", command, erri, (char*)msg);
+    exit(1);
+  }
+}
+
+// Sets the current train on a channel; all times in seconds (under 10).
+void bench_train(char ch, double t, double d, double s, double z, double p, double q) {
+  char command[64];
+  snprintf(command, sizeof(command), "~%c=%.6f;%.6f;%.6f;%.6f;%.6f;%.6fu", ch, t, d, s, z, p, q);
+  bench_send(command);
+}
+
+// Every digital channel pulsing at 1 kHz for 5 seconds
+void bench_all_1khz() {
+  for (int i = 0; i < DIG; i++) bench_train('A' + i, 5.0, 0.0, 5.0, 0.0, 0.0005, 0.0005);
+}
+
+// One channel pulsing at 20 kHz for 5 seconds
+void bench_one_20khz() {
+  bench_train('A', 5.0, 0.0, 5.0, 0.0, 0.000025, 0.000025);
+}
+
+// Four channels, each a chain of 120 short trains of bursts
+void bench_chains() {
+  for (int i = 0; i < 4; i++) {
+    char ch = 'A' + i;
+    char more[4] = { '~', ch, '&', 0 };
+    for (int k = 0; k < 120; k++) {
+      if (k > 0) bench_send(more);
+      bench_train(ch, 0.02, 0.001*i, 0.004, 0.001, 0.0002 + 0.0001*i, 0.0003);
+    }
+  }
+}
+
+struct BenchCase {
+  const char *name;
+  void (*program)();
+};
+
+BenchCase bench_cases[] = {
+  { "24 channels at 1 kHz", bench_all_1khz },
+  { "1 channel at 20 kHz", bench_one_20khz },
+  { "4 chains of 120 trains", bench_chains }
+};
+
+// Level changes on the pins of channels with a train, so the status LED counts only if its channel is in use
+uint64_t bench_edges() {
+  uint64_t n = 0;
+  for (int i = 0; i < DIG; i++) if (channels[i].zero != NO_PROT) n += host_edges[digi[i]];
+  return n;
+}
+
+// Plays one case from start to finish; `mode` is `*` (direct), `(` (direct with trace),
+// `+` (precompiled), or `>` (from the edge timer interrupt).
+void bench_run(const BenchCase &bc, char mode) {
+  host_step = BENCH_STEP;
+  bench_send("~.");
+  bc.program();
+  if (mode == '(') bench_send("~(");
+  host_step = 0;
+  uint64_t edges = bench_edges();
+  int64_t busy = 0, idle = 0, worst = 0;
+  long n = 0;
+  go_go_go(mode == '+', mode == '>');
+  while (runlevel == RUN_GO) {
+    // Jump straight to the deadline, as if the board had busy-waited for it
+    while (global_clock < next_event) {
+      int64_t gap = next_event.k - global_clock.k;
+      host_cycles += (uint32_t)((gap > (1 << 30)) ? (1 << 30) : gap);
+      time_passes();
+    }
+    int64_t t0 = bench_ns();
+    if (mode == '>') edge_interrupt();
+    else if (!run_iteration()) stop_running();
+    int64_t dt = bench_ns() - t0;
+    busy += dt;
+    if (dt > worst) worst = dt;
+    n += 1;
+    if (runlevel == RUN_GO && timeline.on) {
+      t0 = bench_ns();
+      timeline.fill(channels, schedule, protocols, TL_CHUNK);
+      idle += bench_ns() - t0;
+    }
+    if (trace.on) trace.read = trace.written;   // Pretend it was read out, so nothing is dropped
+  }
+  edges = bench_edges() - edges;
+  const char *how = (mode == '+') ? "precompiled" : ((mode == '(') ? "traced" : ((mode == '>') ? "interrupts" : "direct"));
+  printf(
+    "%-24s %-12s %9llu %9ld %9.1f %9lld %9.1f %9.1f\n",
+    bc.name, how, (unsigned long long)edges, n,
+    busy/(double)(n ? n : 1), (long long)worst,
+    busy/(double)(edges ? edges : 1), idle/(double)(edges ? edges : 1)
+  );
+}
+
+int main(int argc, char **argv) {
+  memset(EEPROM.m, 0xFF, HOST_EEPROM_N);
+  host_step = BENCH_STEP;
+  setup();
+  printf(
+    "%-24s %-12s %9s %9s %9s %9s %9s %9s\n",
+    "case", "mode", "edges", "iters", "ns/iter", "worst ns", "ns/edge", "idle/edge"
+  );
+  int nc = sizeof(bench_cases) / sizeof(bench_cases[0]);
+  for (int i = 0; i < nc; i++) {
+    bench_run(bench_cases[i], '*');
+    bench_run(bench_cases[i], '(');
+    bench_run(bench_cases[i], '+');
+    bench_run(bench_cases[i], '>');
+  }
+  return 0;
+}
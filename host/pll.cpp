@@ -0,0 +1,83 @@
+/* Simulates locking the board clock to a reference pulse, to see how the loop settles.
+ *
+ * A reference clock off by some parts per million sends a pulse every second, each
+ * one jittered at random by up to some microseconds, into channel K (`~-K+01000000`).
+ * The main loop runs with the fake cycle counter moving on as it is read, so the
+ * pulse edges are seen when the loop polls for them, as on the board.  Every few
+ * seconds the `~`` reply is printed together with how far the board clock has
+ * moved from the reference since the first pulse.
+ *
+ * Usage: ticklish_pll [ppm [jitter-us [seconds]]]   (defaults 20, 1, 60)
+ */
+
+#include "Arduino.h"
+#include "EEPROM.h"
+
+uint32_t host_cycles = 0;
+uint32_t host_step = 0;
+byte host_level[HOST_PINS];
+uint64_t host_edges[HOST_PINS];
+uint16_t host_dac[HOST_DAC_N];
+int host_dac_n = 0;
+uint32_t ARM_DEMCR = 0;
+uint32_t ARM_DWT_CTRL = 0;
+HostSerial Serial;
+HostEEPROM EEPROM;
+
+#include "../ticklish/ticklish.ino"
+
+// Ticks the clock moves on every read
+#define PLL_STEP 13
+
+// Feeds a command to the board and runs the main loop until it has been handled.
+void pll_send(const char *command) {
+  Serial.out_n = 0;
+  Serial.feed(command, (int)strlen(command));
+  for (int i = 0; i < 1000000 && (Serial.available() > 0 || bufi > 0); i++) loop();
+}
+
+// Reads the signed number in `n` characters of a reply.
+double pll_field(const char *reply, int n) {
+  char field[16];
+  memcpy(field, reply, n);
+  field[n] = 0;
+  return atof(field);
+}
+
+int main(int argc, char **argv) {
+  double ppm = (argc > 1) ? atof(argv[1]) : 20;
+  double jitter = (argc > 2) ? atof(argv[2]) : 1;
+  int secs = (argc > 3) ? atoi(argv[3]) : 60;
+  memset(EEPROM.m, 0xFF, HOST_EEPROM_N);
+  host_step = PLL_STEP;
+  setup();
+  int pin = digi['K' - 'A'];
+  pll_send("~-K+01000000");
+  printf("%6s %-5s %12s %12s %12s\n", "second", "state", "phase us", "drift ppm", "error us");
+  double per = HTZ*(1 + ppm*1e-6);
+  uint64_t cyc = 0;    // Cycles since the start, without wrapping
+  uint32_t last = host_cycles;
+  double offset = 0;   // Board clock less reference time at the first pulse, in us
+  srand(1);
+  for (int s = 1; s <= secs; s++) {
+    double edge = s*per + ((rand() / (double)RAND_MAX) - 0.5)*2*jitter*MHZ;
+    for (;;) {
+      loop();
+      cyc += (uint32_t)(host_cycles - last);
+      last = host_cycles;
+      if (cyc >= edge + per/2) { host_level[pin] = LOW; break; }
+      if (cyc >= edge) host_level[pin] = HIGH;
+    }
+    double error = (board_clock.k - cyc/(1 + ppm*1e-6)) / MHZ;
+    if (s == 1) offset = error;
+    if (s < 12 || s % 5 == 0) {
+      pll_send("~`");
+      if (Serial.out_n < 29) { printf("%6d no reply\n", s); continue; }
+      char *r = (char*)Serial.out;
+      double phase = pll_field(r + 3, 9) / MHZ;
+      double drift = pll_field(r + 12, 9) / (double)DRIFT_FINE_UNITS * 1e6;
+      printf("%6d %-5c %12.3f %12.4f %12.3f\n", s, r[2], phase, drift, error - offset);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,534 @@
+/* Checks parts of ticklish.ino on the desktop that can't be seen from the serial port alone.
+ *
+ * The board is driven as in bench.cpp: commands go in over the (fake) serial port and
+ * the main loop runs with the fake cycle counter moving on as it is read, so timers,
+ * triggers and reference pulses are simulated by the loop polling for them.  Each
+ * check prints its name and `ok` or `FAILED`, with what went wrong on stderr; the
+ * exit status is the number of checks that failed.
+ */
+
+#include "Arduino.h"
+#include "EEPROM.h"
+
+uint32_t host_cycles = 0;
+uint32_t host_step = 0;
+byte host_level[HOST_PINS];
+uint64_t host_edges[HOST_PINS];
+uint16_t host_dac[HOST_DAC_N];
+int host_dac_n = 0;
+uint32_t ARM_DEMCR = 0;
+uint32_t ARM_DWT_CTRL = 0;
+HostSerial Serial;
+HostEEPROM EEPROM;
+
+#include "../ticklish/ticklish.ino"
+
+// Ticks the clock moves on every read
+#define TEST_STEP 13
+
+int test_failed = 0;    // In the check being run
+
+void test_expect(bool ok, const char *what, int line) {
+  if (ok) return;
+  fprintf(stderr, "  line %d: %s\n", line, what);
+  test_failed += 1;
+}
+
+#define EXPECT(x) test_expect((x), #x, __LINE__)
+
+// Feeds a command to the board and runs the main loop until it has been handled; replies are left in Serial.out.
+void test_send(const char *command, int n) {
+  Serial.out_n = 0;
+  Serial.feed(command, n);
+  for (int i = 0; i < 1000000 && (Serial.available() > 0 || bufi > 0); i++) loop();
+  if (runlevel == RUN_ERROR || runlevel == RUN_TO_ERROR) {
+    fprintf(stderr, "  board error after %.2s: %.*s", command, erri, (char*)msg);
+    test_failed += 1;
+  }
+}
+
+void test_send(const char *command) { test_send(command, (int)strlen(command)); }
+
+// Does the reply start with `s`?
+bool test_replied(const char *s) {
+  int n = (int)strlen(s);
+  return Serial.out_n >= n && memcmp(Serial.out, s, n) == 0;
+}
+
+// Back to a freshly reset board, with every pin low.
+void test_fresh() {
+  host_step = TEST_STEP;
+  test_send("~.");
+  memset(host_level, 0, sizeof(host_level));
+  host_dac_n = 0;
+  Serial.out_n = 0;
+}
+
+// Sets the current train on a channel; all times in seconds (under 10).
+void test_train(char ch, double t, double d, double s, double z, double p, double q) {
+  char command[64];
+  snprintf(command, sizeof(command), "~%c=%.6f;%.6f;%.6f;%.6f;%.6f;%.6fu", ch, t, d, s, z, p, q);
+  test_send(command);
+}
+
+// Sets one duration of a channel's train (as `~Zw0.001000`).
+void test_labeled(char ch, char what, double x) {
+  char command[16];
+  snprintf(command, sizeof(command), "~%c%c%8.6f", ch, what, x);
+  test_send(command);
+}
+
+// Runs the main loop until a run has come to an end; false if it never did.
+bool test_run_out() {
+  for (long i = 0; i < 100000000; i++) {
+    loop();
+    if (runlevel != RUN_GO && runlevel != RUN_ARMED && !analog.running) return true;
+  }
+  return false;
+}
+
+
+/* Port batching: writes gather into per-port set and clear masks, the last write to
+ * a pin wins, and one flush puts them all out.  Two channels with the same train
+ * (on pins of different ports) then always change in the same pass.
+ */
+void test_batching() {
+  Outputs o;
+  o.init();
+  o.high(2);   // Port D bit 0...
+  o.high(5);   // ...port D bit 7...
+  o.low(0);    // ...and port B bit 16
+  EXPECT(o.hi[3] == ((1u << 0) | (1u << 7)));
+  EXPECT(o.lo[1] == (1u << 16));
+  EXPECT(o.dirty == ((1 << 1) | (1 << 3)));
+  o.low(2);
+  EXPECT(o.hi[3] == (1u << 7) && o.lo[3] == (1u << 0));
+  host_level[0] = HIGH;
+  host_level[2] = HIGH;
+  o.flush();
+  EXPECT(host_level[0] == LOW && host_level[2] == LOW && host_level[5] == HIGH);
+  EXPECT(o.dirty == 0 && o.hi[3] == 0 && o.lo[3] == 0 && o.lo[1] == 0);
+
+  test_fresh();
+  test_train('A', 0.02, 0.001, 0.02, 0.0, 0.0005, 0.0005);
+  test_train('B', 0.02, 0.001, 0.02, 0.0, 0.0005, 0.0005);
+  int a = digi[0], b = digi[1];
+  EXPECT(pin_ports[a].port != pin_ports[b].port);
+  go_go_go(false, false);
+  long apart = 0;
+  uint64_t edges = host_edges[a] + host_edges[b];
+  while (runlevel == RUN_GO) {
+    while (global_clock < next_event) {
+      host_cycles += (uint32_t)(next_event.k - global_clock.k);
+      time_passes();
+    }
+    if (!run_iteration()) stop_running();
+    if (host_level[a] != host_level[b]) apart += 1;
+  }
+  EXPECT(host_edges[a] + host_edges[b] - edges >= 40);
+  EXPECT(apart == 0);
+}
+
+
+/* Durations on the wire: the 64-bit tick count must write and parse exactly as
+ * the seconds-and-ticks pair it replaced did.
+ */
+struct SplitDura {
+  int s;  // Seconds
+  int k;  // Clock ticks
+
+  void write_8(byte* target) {
+    int es = 10000000;
+    int x = 0;
+    int eu = MHZ*100000;
+    int i = 0;
+    for (; es > 0 && (x = (s/es)%10) == 0; es /= 10) {}
+    for (; es > 0; es /= 10, i++) { x = (s/es)%10; target[i] = (byte)(x + '0'); }
+    if (i == 0) { target[0] = '0'; target[1] = '.'; i = 2; }
+    else if (i < 8) { target[i++] = '.'; }
+    for (; i < 8 && eu >= MHZ; eu /= 10, i++) { x = (k/eu)%10; target[i] = (byte)(x + '0'); }
+  }
+
+  void write_15(byte* target) {
+    int i = 0;
+    for (int es =   10000000; es >    0; es /= 10, i++) target[i] = (byte)('0' + ((s/es)%10));
+    target[i++] = '.';
+    for (int eu = MHZ*100000; eu >= MHZ; eu /= 10, i++) target[i] = (byte)('0' + ((k/eu)%10));
+  }
+
+  void parse(byte* input, int n) {
+    int s = 0;
+    int u = 0;
+    int nu = 0;
+    int i = 0;
+    for (; i<n && input[i] != '.'; i++) {
+      byte b = input[i] - '0';
+      if (b < 10) s = s*10 + b;
+      else {
+        this->s = this->k = -1;
+        return;
+      }
+    }
+    if (i+1 < n) {
+      i++;
+      for (; i<n && nu < 6; i++, nu++) {
+        byte b = input[i] - '0';
+        if (b < 10) u = u*10 + b;
+        else {
+          this->s = this->k = -1;
+          return;
+        }
+      }
+      for (; nu < 6; nu++) u = u*10;
+    }
+    this->s = s;
+    this->k = u*MHZ;
+  }
+};
+
+void test_wire_format() {
+  int64_t fixed[] = {
+    0, 1, MHZ - 1, MHZ, HTZ - 1, HTZ, HTZ + MHZ, 9*((int64_t)HTZ) + 999999*MHZ,
+    12345678*((int64_t)HTZ) + 7, 99999999*((int64_t)HTZ) + HTZ - 1
+  };
+  int nfixed = sizeof(fixed)/sizeof(fixed[0]);
+  uint64_t x = 88172645463325252ull;
+  int wrong_8 = 0, wrong_15 = 0, wrong_parse = 0;
+  for (int i = 0; i < nfixed + 100000; i++) {
+    int64_t k;
+    if (i < nfixed) k = fixed[i];
+    else {
+      x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+      // Spread over every length of seconds, not just the longest
+      k = (int64_t)((x >> 11) % (uint64_t)(100000000ll * HTZ >> (i % 27)));
+    }
+    Dura d;
+    d.k = k;
+    SplitDura o;
+    o.s = (int)(k / HTZ);
+    o.k = (int)(k % HTZ);
+    byte a[16], b[16];
+    memset(a, '#', 16);
+    memset(b, '#', 16);
+    d.write_8(a);
+    o.write_8(b);
+    if (memcmp(a, b, 16) != 0) wrong_8 += 1;
+    memset(a, '#', 16);
+    memset(b, '#', 16);
+    d.write_15(a);
+    o.write_15(b);
+    if (memcmp(a, b, 16) != 0) wrong_15 += 1;
+    // Read back, both whole and cut short (as a host might send fewer digits)
+    for (int n = 15; n >= 9; n -= 3) {
+      Dura e;
+      e.parse(a, n);
+      o.parse(a, n);
+      if (e.k != ((int64_t)o.s)*HTZ + o.k) wrong_parse += 1;
+    }
+  }
+  const char *odd[] = { "1.5", "12", "0.000001", "7.", ".25", "3.1x", "x", "" };
+  for (int i = 0; i < (int)(sizeof(odd)/sizeof(odd[0])); i++) {
+    Dura e;
+    SplitDura o;
+    e.parse((byte*)odd[i], (int)strlen(odd[i]));
+    o.parse((byte*)odd[i], (int)strlen(odd[i]));
+    bool bad = o.s < 0;
+    if (bad != !e.is_valid() || (!bad && e.k != ((int64_t)o.s)*HTZ + o.k)) wrong_parse += 1;
+  }
+  EXPECT(wrong_8 == 0);
+  EXPECT(wrong_15 == 0);
+  EXPECT(wrong_parse == 0);
+}
+
+
+// Edges taken out of the trace as a run goes
+#define TEST_EDGES 4096
+TraceEdge test_edges[TEST_EDGES];
+int test_nedges;
+
+void test_collect() {
+  while (trace.read != trace.written && test_nedges < TEST_EDGES) {
+    test_edges[test_nedges++] = trace.edges[trace.read & (TRACEN - 1)];
+    trace.read += 1;
+  }
+}
+
+
+/* Edge timer: runs from `~+` (precompiled timeline) and `~>` (edges from the
+ * simulated timer interrupt) make the same edges, at the same scheduled times, as
+ * one from `~*`, and the timer keeps close to them even though the loop only polls it.
+ */
+void test_edge_timer() {
+  TraceEdge polled[TEST_EDGES];
+  int npolled = 0;
+  const char *starts[3] = { "~*", "~+", "~>" };
+  int32_t worst[3] = { 0, 0, 0 };
+  int differ = 0;
+  for (int run = 0; run < 3; run++) {
+    test_fresh();
+    test_train('A', 0.02, 0.0, 0.02, 0.0, 0.0005, 0.0005);
+    test_train('B', 0.02, 0.003, 0.004, 0.001, 0.0002, 0.0003);
+    test_train('C', 0.02, 0.0, 0.01, 0.01, 0.00025, 0.00125);
+    test_nedges = 0;
+    test_send("~(");
+    test_send(starts[run]);
+    EXPECT(edge_timer.on == (run == 2));
+    for (long i = 0; i < 10000000 && runlevel == RUN_GO; i++) {
+      loop();
+      test_collect();
+    }
+    test_collect();
+    EXPECT(runlevel == RUN_COMPLETED);
+    for (int i = 0; i < test_nedges; i++) if (test_edges[i].late > worst[run]) worst[run] = test_edges[i].late;
+    if (run == 0) {
+      npolled = test_nedges;
+      memcpy(polled, test_edges, sizeof(TraceEdge)*test_nedges);
+      continue;
+    }
+    EXPECT(test_nedges == npolled);
+    for (int i = 0; i < test_nedges && i < npolled; i++) {
+      const TraceEdge &p = polled[i], &e = test_edges[i];
+      if (p.chan != e.chan || p.level != e.level || p.when_lo != e.when_lo || p.when_hi != e.when_hi) differ += 1;
+    }
+  }
+  EXPECT(npolled > 100);
+  EXPECT(differ == 0);
+  EXPECT(worst[2] < 5*MHZ);
+  EXPECT(!edge_timer.on);
+}
+
+
+/* Analog output: a 1 kHz sine played for 10 ms is 40 samples a cycle of the
+ * expected shape, whole half-waves only, and ends back at zero.
+ */
+void test_analog() {
+  test_fresh();
+  test_labeled('Z', 't', 0.010);
+  test_labeled('Z', 'd', 0.0);
+  test_labeled('Z', 's', 0.010);
+  test_labeled('Z', 'z', 0.0);
+  test_labeled('Z', 'w', 0.001);
+  test_send("~Za2047");
+  test_send("~Zl");
+  host_dac_n = 0;
+  test_send("~*");
+  EXPECT(analog.running);
+  EXPECT(test_run_out());
+  EXPECT(!analog.running);
+  // Every sample but the last is on the wave; the run ends on the 400th
+  EXPECT(host_dac_n == 400);
+  int off = 0, lo = ANALOG_ZERO, hi = ANALOG_ZERO;
+  for (int n = 1; n < host_dac_n; n++) {
+    int v = host_dac[n - 1];
+    double want = ANALOG_ZERO + ANALOG_AMPL*sin(2*M_PI*n/40.0);
+    if (fabs(v - want) > 5) off += 1;
+    if (v < lo) lo = v;
+    if (v > hi) hi = v;
+  }
+  EXPECT(off == 0);
+  EXPECT(lo <= 5 && hi >= 2*ANALOG_ZERO - 5);
+  EXPECT(host_dac_n > 0 && host_dac[host_dac_n - 1] == ANALOG_ZERO);
+
+  // Inverted triangle: same period, so it must peak where the sine troughs
+  test_fresh();
+  test_labeled('Z', 't', 0.002);
+  test_labeled('Z', 's', 0.002);
+  test_labeled('Z', 'w', 0.001);
+  test_send("~Za1000");
+  test_send("~Zr");
+  test_send("~Zi");
+  host_dac_n = 0;
+  test_send("~*");
+  EXPECT(test_run_out());
+  EXPECT(host_dac_n == 80);
+  if (host_dac_n == 80) {
+    EXPECT(host_dac[9] < ANALOG_ZERO - 990 && host_dac[29] > ANALOG_ZERO + 990);
+    EXPECT(host_dac[19] > ANALOG_ZERO - 60 && host_dac[19] < ANALOG_ZERO + 60);
+  }
+}
+
+
+/* Binary upload: a `~[` frame sets the same train as the text command does, and
+ * one with a bad CRC is refused.
+ */
+uint16_t test_crc(const byte *data, int n) {
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < n; i++) {
+    crc ^= ((uint16_t)data[i]) << 8;
+    for (int j = 0; j < 8; j++) crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+void test_binary() {
+  test_fresh();
+  test_train('B', 0.02, 0.001, 0.004, 0.001, 0.0002, 0.0003);
+  uint32_t us[6] = { 20000, 1000, 4000, 1000, 200, 300 };
+  byte frame[3 + BIN_RECORD + 2];
+  frame[0] = '~';
+  frame[1] = '[';
+  frame[2] = 1;
+  frame[3] = 'A';
+  frame[4] = 0;
+  for (int i = 0; i < 6; i++) write_le32(frame + 5 + 4*i, us[i]);
+  uint16_t crc = test_crc(frame + 2, 1 + BIN_RECORD);
+  frame[3 + BIN_RECORD] = (byte)crc;
+  frame[4 + BIN_RECORD] = (byte)(crc >> 8);
+  test_send((const char*)frame, sizeof(frame));
+  EXPECT(test_replied("~]"));
+  EXPECT(channels[0].zero != NO_PROT && channels[1].zero != NO_PROT);
+  if (channels[0].zero != NO_PROT && channels[1].zero != NO_PROT) {
+    Protocol *a = protocols + channels[0].zero;
+    Protocol *b = protocols + channels[1].zero;
+    EXPECT(a->total().k == b->total().k && a->delay().k == b->delay().k);
+    EXPECT(a->stim_on().k == b->stim_on().k && a->stim_off().k == b->stim_off().k);
+    EXPECT(a->pulse_on().k == b->pulse_on().k && a->pulse_off().k == b->pulse_off().k);
+  }
+  frame[4 + BIN_RECORD] ^= 1;
+  Serial.out_n = 0;
+  Serial.feed((const char*)frame, sizeof(frame));
+  for (int i = 0; i < 1000 && (Serial.available() > 0 || bufi > 0); i++) loop();
+  EXPECT(test_replied("~!"));
+  EXPECT(runlevel == RUN_TO_ERROR || runlevel == RUN_ERROR);
+  test_send("~.");
+}
+
+
+/* Hardware trigger: `~_` gets the run ready but leaves the outputs alone until the
+ * edge; the run then starts on the loop pass that sees it, counting from the edge.
+ * `~/` disarms.
+ */
+void test_trigger() {
+  test_fresh();
+  test_train('A', 0.01, 0.0, 0.01, 0.0, 0.001, 0.001);
+  int pin = digi['K' - 'A'];
+  int out = digi[0];
+  test_send("~_K+*");
+  EXPECT(runlevel == RUN_ARMED);
+  test_send("~;");
+  EXPECT(test_replied("~;_"));
+  for (int i = 0; i < 10000; i++) loop();
+  EXPECT(runlevel == RUN_ARMED && host_level[out] == LOW);
+  host_level[pin] = HIGH;
+  uint32_t edge_at = host_cycles;
+  loop();
+  EXPECT(runlevel == RUN_GO && trigger.fired);
+  EXPECT(trigger.cyc - edge_at < 100*TEST_STEP);
+  EXPECT(trigger.latency < 5*MHZ);
+  for (int i = 0; i < 100 && host_level[out] == LOW; i++) loop();
+  EXPECT(host_level[out] == HIGH);
+  test_send("~;");
+  char want[22];
+  snprintf(want, sizeof(want), "~;!%010u%08u", (unsigned)trigger.cyc, (unsigned)trigger.latency);
+  EXPECT(test_replied(want));
+  EXPECT(test_run_out());
+
+  // Falling edge, disarmed before it comes
+  test_fresh();
+  test_train('A', 0.01, 0.0, 0.01, 0.0, 0.001, 0.001);
+  host_level[pin] = HIGH;
+  test_send("~_K-+");
+  EXPECT(runlevel == RUN_ARMED);
+  test_send("~/");
+  EXPECT(runlevel == RUN_PROGRAM);
+  host_level[pin] = LOW;
+  for (int i = 0; i < 1000; i++) loop();
+  EXPECT(runlevel == RUN_PROGRAM && !trigger.fired);
+}
+
+
+/* Scheduled start: `~:` starts the run from the edge timer once the board clock
+ * reaches the time given.
+ */
+void test_scheduled() {
+  test_fresh();
+  test_train('A', 0.01, 0.0, 0.01, 0.0, 0.001, 0.001);
+  time_passes();
+  Dura when = board_clock;
+  when.k += HTZ/200;
+  when.k -= when.k % MHZ;
+  char command[19];
+  command[0] = '~';
+  command[1] = ':';
+  command[2] = '>';
+  when.write_15((byte*)command + 3);
+  command[18] = 0;
+  test_send(command);
+  EXPECT(runlevel == RUN_ARMED);
+  for (long i = 0; i < 10000000 && runlevel == RUN_ARMED; i++) loop();
+  EXPECT(runlevel == RUN_GO && trigger.fired && edge_timer.on);
+  int64_t late = board_clock.k - when.k;
+  EXPECT(late >= 0 && late < 10*MHZ);
+  EXPECT(test_run_out());
+}
+
+
+/* Reference clock: pulses every second from a clock 20 ppm fast, with a microsecond
+ * of jitter, pull the drift correction to -20 ppm and the phase to within the
+ * lock limit, and `~`` says so.
+ */
+void test_discipline() {
+  test_fresh();
+  test_send("~-K+01000000");
+  EXPECT(discipline.on);
+  int pin = digi['K' - 'A'];
+  double ppm = 20, jitter = 1;
+  double per = HTZ*(1 + ppm*1e-6);
+  uint64_t cyc = 0;
+  uint32_t last = host_cycles;
+  srand(1);
+  for (int s = 1; s <= 30; s++) {
+    double edge = s*per + ((rand() / (double)RAND_MAX) - 0.5)*2*jitter*MHZ;
+    for (;;) {
+      loop();
+      cyc += (uint32_t)(host_cycles - last);
+      last = host_cycles;
+      if (cyc >= edge + per/2) { host_level[pin] = LOW; break; }
+      if (cyc >= edge) host_level[pin] = HIGH;
+    }
+  }
+  test_send("~`");
+  EXPECT(test_replied("~`!"));
+  EXPECT(discipline.locked());
+  EXPECT(discipline.phase < DISC_LOCK_TICKS && -discipline.phase < DISC_LOCK_TICKS);
+  EXPECT(drift_fine > -205000 && drift_fine < -195000);
+  EXPECT(discipline.edges == 29);
+  test_send("~-.+00000000");
+  EXPECT(!discipline.on);
+  drift_frac = 0;
+  drift_fine = drift_fine_from_frac(drift_frac);
+}
+
+
+struct TestCase {
+  const char *name;
+  void (*check)();
+};
+
+TestCase test_cases[] = {
+  { "batched port writes", test_batching },
+  { "durations on the wire", test_wire_format },
+  { "edge timer", test_edge_timer },
+  { "analog output", test_analog },
+  { "binary upload", test_binary },
+  { "hardware trigger", test_trigger },
+  { "scheduled start", test_scheduled },
+  { "reference clock", test_discipline }
+};
+
+int main(int argc, char **argv) {
+  memset(EEPROM.m, 0xFF, HOST_EEPROM_N);
+  host_step = TEST_STEP;
+  setup();
+  int failures = 0;
+  int nc = sizeof(test_cases) / sizeof(test_cases[0]);
+  for (int i = 0; i < nc; i++) {
+    printf("%-24s ", test_cases[i].name);
+    fflush(stdout);
+    test_failed = 0;
+    test_cases[i].check();
+    printf("%s\n", test_failed ? "FAILED" : "ok");
+    if (test_failed) failures += 1;
+  }
+  return failures;
+}
@@ -5,7 +5,7 @@
 /*
 Ticklish is essentially a set of simple state machines.
 
-The _main loop_ has four persistent states and two transient states; these
+The _main loop_ has five persistent states and two transient states; these
 are present in the variable `runlevel`.
 Persistent states:
   RUN_ERROR - Indicates an error state.
@@ -20,6 +20,9 @@ Persistent states:
   RUN_GO - Protocol is running.
     State entered from RUN_PROGRAM with a run command `~*` `~A*` `~A:100.0000;...`
     State exited when stimulus is complete (goes to RUN_COMPLETED state)
+  RUN_ARMED - Waiting for an edge on an input pin (or a time on the board clock) to start running.
+    State entered from RUN_PROGRAM with `~_` or `~:`.
+    State exited to RUN_GO when triggered, or to RUN_PROGRAM with `~/`.
 Transient states:
   RUN_TO_ERROR - Was running, cooling down stimuli, will turn to error within a second or so.
   RUN_LOCKED - Setting up for something (probably a run).  Transient, very brief (~1 ms).
@@ -37,14 +40,25 @@ There are four runlevels:
   C_HI - Stimulus is on!  If pq exahausted, turn off and go to C_LO.  If yn exhuasted, turn off and go to C_WAIT.
   If t is ever exhausted, turn off stimulus and go to C_ZZZ.
 
-There is supposed to be a similar state machine for analog channels, but there isn't yet.  Also, it will use
-interrupts to maintain a nice waveform.
+The analog channel has a similar state machine (off and on blocks only) that runs inside a timer
+interrupt, so that it can keep up a nice waveform.  See the Analog struct.
 */
 
 
 #include <EEPROM.h>
 #include <math.h>
 
+// The Arduino tools declare every function up front.  These are the ones used before
+// they are defined, so the sketch also compiles as plain C++ (see host/).
+void edge_interrupt();
+void stop_running();
+int eeprom_get_int(int eepi);
+void write_le32(byte *b, uint32_t x);
+void trigger_interrupt();
+void trigger_start(uint32_t cyc);
+void discipline_interrupt();
+int time_passes();
+
 // Note: the Teensy 3.1 and 3.2 can be "overclocked" to 96 MHz, but 72 MHz is their operating speed.
 // 72 MHz is plenty for our purposes.
 // Needs to be altered for 3.5 or 3.6 if they run at full speed (120 or 180 MHz respectively).
@@ -63,7 +77,7 @@ bool assume_in[DIG] = {
   false
 };
 
-// The analog channels supported; support is a fiction currently.
+// The analog channels supported (one, on the DAC pin).
 #define ANA 1
 #define ANALOG_DIVS 4096
 int16_t wave[ANALOG_DIVS];
@@ -73,9 +87,10 @@ int16_t wave[ANALOG_DIVS];
  * Primary timekeeping struct *
  ******************************
  * 
- * Time is stored as seconds plus ticks, so it's dependent on the clock rate.
+ * Time is stored as a single 64-bit count of clock ticks, so it's dependent on the clock rate.
  * It's really intended that times will be used going forward, and that you mostly
- * want to check when one duration has passed another.
+ * want to check when one duration has passed another.  Seconds only show up when
+ * durations are read from or written to text.
  *
  * All comparison operators could be defined, but I've only bothered with < right now.
  *
@@ -83,46 +98,27 @@ int16_t wave[ANALOG_DIVS];
 **/
 
 struct Dura {
-  int s;  // Seconds
-  int k;  // Clock ticks
-
-  bool is_empty() { return s == 0 && k == 0; }
+  int64_t k;  // Clock ticks
 
-  bool is_valid() { return s >= 0 && k >= 0 && k < HTZ; }
+  bool is_empty() { return k == 0; }
 
-  int compare(Dura d) { return (s < d.s) ? -1 : ((s > d.s) ? 1 : ((k < d.k) ? -1 : (k > d.k) ? 1 : 0)); }
+  bool is_valid() { return k >= 0; }
 
-  bool operator< (Dura d) { return s < d.s || ((s == d.s) && k < d.k); }
+  int compare(Dura d) { return (k < d.k) ? -1 : ((k > d.k) ? 1 : 0); }
 
-  void normalize() {
-    if (k >= HTZ) {
-      int xs = k / (HTZ);
-      s += xs;
-      k -= xs*HTZ;
-    }
-    else if (k < 0) {
-      int xs = ((HTZ - 1) - k)/HTZ;
-      s -= xs;
-      k += HTZ*xs;
-    }      
-  }
+  bool operator< (Dura d) { return k < d.k; }
 
-  void operator+= (Dura d) {
-    s += d.s;
-    k += d.k;
-    while (k >= HTZ) { k -= HTZ; s += 1; }
-  }
+  void operator+= (Dura d) { k += d.k; }
 
-  void operator+= (int ticks) {
-    k += ticks;
-    while (k >= HTZ) { k -= HTZ; s += 1; }
-  }
+  void operator+= (int ticks) { k += ticks; }
 
-  Dura or_smaller(Dura d) { return (s < d.s) ? *this : ((s > d.s) ? d : ((k > d.k) ? d : *this)); }
+  Dura or_smaller(Dura d) { return (d.k < k) ? d : *this; }
 
-  int64_t as_us() { return (((int64_t)s)*HTZ + k)/MHZ; }
+  int64_t as_us() { return k/MHZ; }
 
   void write_8(byte* target) {
+    int s = (int)(k / HTZ);
+    int r = (int)(k - ((int64_t)s)*HTZ);
     int es = 10000000;
     int x = 0;
     int eu = MHZ*100000;
@@ -131,14 +127,16 @@ struct Dura {
     for (; es > 0; es /= 10, i++) { x = (s/es)%10; target[i] = (byte)(x + '0'); }
     if (i == 0) { target[0] = '0'; target[1] = '.'; i = 2; }
     else if (i < 8) { target[i++] = '.'; }
-    for (; i < 8 && eu >= MHZ; eu /= 10, i++) { x = (k/eu)%10; target[i] = (byte)(x + '0'); }
+    for (; i < 8 && eu >= MHZ; eu /= 10, i++) { x = (r/eu)%10; target[i] = (byte)(x + '0'); }
   }
 
   void write_15(byte* target) {
+    int s = (int)(k / HTZ);
+    int r = (int)(k - ((int64_t)s)*HTZ);
     int i = 0;
     for (int es =   10000000; es >    0; es /= 10, i++) target[i] = (byte)('0' + ((s/es)%10));
     target[i++] = '.';
-    for (int eu = MHZ*100000; eu >= MHZ; eu /= 10, i++) target[i] = (byte)('0' + ((k/eu)%10));
+    for (int eu = MHZ*100000; eu >= MHZ; eu /= 10, i++) target[i] = (byte)('0' + ((r/eu)%10));
   }
 
   void parse(byte* input, int n) {
@@ -151,7 +149,7 @@ struct Dura {
       byte b = input[i] - '0';
       if (b < 10) s = s*10 + b;
       else {
-        this->s = this->k = -1;
+        this->k = -1;
         return;
       }
     }
@@ -162,14 +160,13 @@ struct Dura {
         byte b = input[i] - '0';
         if (b < 10) u = u*10 + b;
         else {
-          this->s = this->k = -1;
+          this->k = -1;
           return;
         }
       }
       for (; nu < 6; nu++) u = u*10;   // Pad out to microseconds
     }
-    this->s = s;
-    this->k = u*MHZ;
+    this->k = ((int64_t)s)*HTZ + ((int64_t)u)*MHZ;
   }
 };
 
@@ -204,6 +201,156 @@ struct Debug {
 };
 #endif
 
+/*****************************
+ * Batched digital port I/O *
+ *****************************
+ *
+ * Digital edges are not written immediately; they are collected into set and
+ * clear masks for each GPIO port and written all at once by `flush()`.  On the
+ * board this is one PSOR and one PCOR write per port, so edges that come due
+ * together switch within a few cycles of each other regardless of which pins
+ * they are on.  Off the board, the batch is replayed with digitalWrite.
+**/
+
+#define NPORT 5
+
+struct PortBit {
+  byte port;  // 0 = GPIOA, ..., 4 = GPIOE
+  byte bit;   // Bit within port
+};
+
+// Port and bit for Teensy 3.x pins 0-23 (see CORE_PINn_BIT in core_pins.h)
+const PortBit pin_ports[24] = {
+  {1, 16}, {1, 17}, {3,  0}, {0, 12}, {0, 13}, {3,  7}, {3,  4}, {3,  2}, {3,  3}, {2,  3}, {2,  4}, {2,  6},
+  {2,  7}, {2,  5}, {3,  1}, {2,  0}, {1,  0}, {1,  1}, {1,  3}, {1,  2}, {3,  5}, {3,  6}, {2,  1}, {2,  2}
+};
+
+#if defined(KINETISK)
+volatile uint32_t* const port_set[NPORT]   = { &GPIOA_PSOR, &GPIOB_PSOR, &GPIOC_PSOR, &GPIOD_PSOR, &GPIOE_PSOR };
+volatile uint32_t* const port_clear[NPORT] = { &GPIOA_PCOR, &GPIOB_PCOR, &GPIOC_PCOR, &GPIOD_PCOR, &GPIOE_PCOR };
+#endif
+
+struct Outputs {
+  uint32_t hi[NPORT];  // Bits to set on each port
+  uint32_t lo[NPORT];  // Bits to clear on each port
+  byte dirty;          // One bit per port with anything pending
+
+  void init() {
+    for (int k = 0; k < NPORT; k++) hi[k] = lo[k] = 0;
+    dirty = 0;
+  }
+
+  void high(byte pin) {
+    if (pin >= 24) return;
+    PortBit pb = pin_ports[pin];
+    uint32_t m = ((uint32_t)1) << pb.bit;
+    hi[pb.port] |= m;
+    lo[pb.port] &= ~m;
+    dirty |= (byte)(1 << pb.port);
+  }
+
+  void low(byte pin) {
+    if (pin >= 24) return;
+    PortBit pb = pin_ports[pin];
+    uint32_t m = ((uint32_t)1) << pb.bit;
+    lo[pb.port] |= m;
+    hi[pb.port] &= ~m;
+    dirty |= (byte)(1 << pb.port);
+  }
+
+  void write(byte pin, bool level) { if (level) high(pin); else low(pin); }
+
+  static void apply(int k, uint32_t h, uint32_t l) {
+#if defined(KINETISK)
+    if (h) *port_set[k] = h;
+    if (l) *port_clear[k] = l;
+#else
+    for (int p = 0; p < 24; p++) if (pin_ports[p].port == k) {
+      uint32_t m = ((uint32_t)1) << pin_ports[p].bit;
+      if (h & m) digitalWrite(p, HIGH);
+      else if (l & m) digitalWrite(p, LOW);
+    }
+#endif
+  }
+
+  void flush() {
+    if (!dirty) return;
+    for (int k = 0; k < NPORT; k++) if (dirty & (1 << k)) {
+      apply(k, hi[k], lo[k]);
+      hi[k] = lo[k] = 0;
+    }
+    dirty = 0;
+  }
+};
+
+Outputs outputs;
+
+
+/**************
+ * Edge trace *
+ **************
+ *
+ * When on, every batch of pin changes is logged just before it is written:
+ * which channel, which way, when it was scheduled, and the cycle counter.
+ * The log is a ring that the main loop drains to the host (`~<`) when idle.
+ * If the host falls behind, new edges are dropped and counted, never
+ * overwritten, so that a dump is always a clean prefix of what happened.
+**/
+
+#define TRACEN 256   // Power of two (4 KB)
+
+struct TraceEdge {
+  uint32_t cyc;      // ARM_DWT_CYCCNT just before the write
+  int32_t late;      // Global clock ticks after the scheduled time
+  uint32_t when_lo;  // Scheduled time in global clock ticks, low 32 bits...
+  uint16_t when_hi;  // ...and the next 16
+  byte chan;         // Channel index, 0 = A
+  byte level;        // 1 = went high, 0 = went low
+};
+
+struct Trace {
+  TraceEdge edges[TRACEN];
+  volatile uint32_t written;  // Edges ever logged (index mod TRACEN)
+  volatile uint32_t read;     // Edges ever sent to the host
+  volatile uint32_t lost;     // Edges dropped because the ring was full
+  int64_t base;               // Global clock at...
+  uint32_t base_cyc;          // ...this cycle count
+  byte chan_at[NPORT][32];    // Channel on each port bit, 255 = none
+  bool on;
+  bool dumping;               // Sending the log to the host?
+
+  void init() {
+    written = read = lost = 0;
+    base = 0;
+    base_cyc = 0;
+    on = dumping = false;
+    for (int k = 0; k < NPORT; k++) for (int b = 0; b < 32; b++) chan_at[k][b] = 255;
+    for (int i = 0; i < DIG; i++) if (digi[i] < 24) chan_at[pin_ports[digi[i]].port][pin_ports[digi[i]].bit] = i;
+  }
+
+  // Where the global clock was last read, to estimate when a write really happens.
+  void sync(int64_t clock, uint32_t cyc) { base = clock; base_cyc = cyc; }
+
+  void note(const Outputs &o, int64_t when) {
+    if (!o.dirty) return;
+    uint32_t cyc = ARM_DWT_CYCCNT;
+    int32_t late = (int32_t)(base + (int32_t)(cyc - base_cyc) - when);
+    for (int k = 0; k < NPORT; k++) {
+      uint32_t m = o.hi[k] | o.lo[k];
+      while (m) {
+        int b = __builtin_ctz(m);
+        m &= m - 1;
+        if (written - read >= TRACEN) { lost++; continue; }
+        edges[written & (TRACEN - 1)] = (TraceEdge){ cyc, late, (uint32_t)when, (uint16_t)(when >> 32), chan_at[k][b], (byte)((o.hi[k] >> b) & 1) };
+        written++;
+      }
+    }
+  }
+};
+
+Trace trace;
+
+
 /************************
  * Protocol information *
  ************************
@@ -211,50 +358,89 @@ struct Debug {
  * Struct that defines a stimulus protocol.  Fields describe how they are used.
 **/
 
-#define PROT 254
+/* A Teensy 3.2 has 64 KB of RAM, and the core and the stack want roughly 16 KB
+ * of it.  The big tables here are the protocols (19 KB), the analog waveform
+ * (8 KB), the timeline (7 KB), the channels (4.5 KB) and the trace (4 KB).
+ */
+#define PROT 600        // Room for this many protocols (19.2 KB)
+#define NO_PROT 65535   // Protocol index meaning "none"
 
+/* Durations are kept as 32-bit counts of 2^scale microseconds, with one scale
+ * shared by the whole protocol.  Anything under 71 minutes fits at scale 0, so
+ * the scale only grows for very long trains, and then only if every duration
+ * in the protocol is still exact.  Use the accessors to get ticks.
+ */
 struct Protocol {
-  Dura t;    // Total time
-  Dura d;    // Delay
-  Dura s;    // Stimulus on time
-  Dura z;    // Stimulus off time
-  Dura p;    // Pulse time (or period, for analog)
-  Dura q;    // Pulse off time (analog: amplitude 0-2047)
-  byte i;    // Invert? 'i' == yes, otherwise no
-  byte j;    // Shape: 'l' = sinusoidal, 'r' = triangular, other = digital
-  byte next; // Number of next protocol, 255 = none
-  byte chan; // Channel number, 255 = none
-
-  void init() { *this = {{0,0}, {0,0}, {0,0}, {0,0}, {0,0}, {0,0}, 'u', ' ', 255, 255}; }
+  uint32_t t;     // Total time
+  uint32_t d;     // Delay
+  uint32_t s;     // Stimulus on time
+  uint32_t z;     // Stimulus off time
+  uint32_t p;     // Pulse time (or period, for analog)
+  uint32_t q;     // Pulse off time
+  uint16_t next;  // Number of next protocol, NO_PROT = none
+  uint16_t a;     // Analog amplitude 0-2047
+  byte scale;     // Durations are in units of 2^scale microseconds
+  byte i;         // Invert? 'i' == yes, otherwise no
+  byte j;         // Shape: 'l' = sinusoidal, 'r' = triangular, other = digital
+
+  void init() { *this = {0, 0, 0, 0, 0, 0, NO_PROT, 0, 0, 'u', ' '}; }
+
+  Dura ticks(uint32_t x) const { return (Dura){ (((int64_t)x) << scale) * MHZ }; }
+  Dura total() const { return ticks(t); }
+  Dura delay() const { return ticks(d); }
+  Dura stim_on() const { return ticks(s); }
+  Dura stim_off() const { return ticks(z); }
+  Dura pulse_on() const { return ticks(p); }
+  Dura pulse_off() const { return ticks(q); }
+
+  // Store a duration in microseconds into field x, coarsening the scale if needed.
+  // Fails (changing nothing) if it can't be done exactly.
+  bool store(uint32_t &x, int64_t us) {
+    if (us < 0) return false;
+    byte sc = scale;
+    while ((us >> sc) > 0xFFFFFFFFll) sc++;
+    if (sc > scale) {
+      uint32_t lost = (((uint32_t)1) << (sc - scale)) - 1;
+      uint32_t *fields[6] = { &t, &d, &s, &z, &p, &q };
+      for (int k = 0; k < 6; k++) if (fields[k] != &x && (*fields[k] & lost)) return false;
+      for (int k = 0; k < 6; k++) *fields[k] >>= (sc - scale);
+      scale = sc;
+    }
+    if (us & ((((int64_t)1) << scale) - 1)) return false;
+    x = (uint32_t)(us >> scale);
+    return true;
+  }
 
   // Parse one duration given by a label
   bool parse_labeled(byte label, byte *input) {
-    Dura x; x = {0, 0}; x.parse(input, 8);
-    if (x.s < 0 || x.k < 0) return false;
+    Dura x; x = {0}; x.parse(input, 8);
+    if (!x.is_valid()) return false;
     switch (label) {
-      case 't': t = x; break;
-      case 'd': d = x; break;
-      case 's': s = x; break;
-      case 'z': z = x; break;
-      case 'p': p = x; break;
-      case 'q': q = x; break;
-      case 'w': p = x; break;
+      case 't': return store(t, x.as_us());
+      case 'd': return store(d, x.as_us());
+      case 's': return store(s, x.as_us());
+      case 'z': return store(z, x.as_us());
+      case 'p': return store(p, x.as_us());
+      case 'q': return store(q, x.as_us());
+      case 'w': return store(p, x.as_us());
       default: return false;
     }
-    return true;
   }
 
   // Parse all durations (digital only)
   int parse_all(byte *input) {
     for (int i = 1; i < 6; i++) if (input[i*9 - 1] != ';') return 10+i;
-    Dura x; x = {0, 0};
+    Dura x; x = {0};
+    // Start from scale 0, or a previous long train would coarsen this one
+    t = d = s = z = p = q = 0;
+    scale = 0;
     // Manually unrolled loop
-    x.parse(input + 0*9, 8); if (!x.is_valid()) return 1; t = x;
-    x.parse(input + 1*9, 8); if (!x.is_valid()) return 2; d = x;
-    x.parse(input + 2*9, 8); if (!x.is_valid()) return 3; s = x;
-    x.parse(input + 3*9, 8); if (!x.is_valid()) return 4; z = x;
-    x.parse(input + 4*9, 8); if (!x.is_valid()) return 5; p = x;
-    x.parse(input + 5*9, 8); if (!x.is_valid()) return 6; q = x;
+    x.parse(input + 0*9, 8); if (!x.is_valid() || !store(t, x.as_us())) return 1;
+    x.parse(input + 1*9, 8); if (!x.is_valid() || !store(d, x.as_us())) return 2;
+    x.parse(input + 2*9, 8); if (!x.is_valid() || !store(s, x.as_us())) return 3;
+    x.parse(input + 3*9, 8); if (!x.is_valid() || !store(z, x.as_us())) return 4;
+    x.parse(input + 4*9, 8); if (!x.is_valid() || !store(p, x.as_us())) return 5;
+    x.parse(input + 5*9, 8); if (!x.is_valid() || !store(q, x.as_us())) return 6;
     if (input[6*9-1] == 'i') i = 'i'; else if (input[6*9-1] == 'u') i = 'u'; else return 7;
     return 0;
   }
@@ -267,10 +453,10 @@ struct Protocol {
     ps[i] = *this;
     while (i+1 < PROT && ps[i].next < PROT) {
       ps[i+1] = ps[ps[i].next];  // We are copying all the data, not just pointers!
-      ps[i].next = (byte)(i+1);  // Point existing one at new (probably lower) index.
+      ps[i].next = (uint16_t)(i+1);  // Point existing one at new (probably lower) index.
       i++;
     }
-    // Last one will point at 255 (terminator), and that doesn't change!
+    // Last one will point at NO_PROT (terminator), and that doesn't change!
     pi = i;
   }
 
@@ -282,9 +468,39 @@ struct Protocol {
   }
 };
 
+// Slots of finished trains, chained through `next`, for reuse while streaming.
+struct Spares {
+  uint16_t head;  // First free slot, NO_PROT = none
+  int n;      // Number of free slots
+  bool on;    // Recycle trains as they finish?  (Streaming run)
+
+  void init() { head = NO_PROT; n = 0; on = false; }
+
+  void put(Protocol *ps, uint16_t k) {
+    ps[k].next = head;
+    head = k;
+    n++;
+  }
+
+  // Returns the slot, or -1 if there isn't one
+  int take(Protocol *ps) {
+    if (head == NO_PROT) return -1;
+    uint16_t k = head;
+    head = ps[k].next;
+    n--;
+    return k;
+  }
+
+  // Frees a whole chain of trains starting at k
+  void put_chain(Protocol *ps, uint16_t k) {
+    while (k != NO_PROT) { uint16_t next = ps[k].next; put(ps, k); k = next; }
+  }
+};
+
 Protocol protocols[PROT]; // Slots for protocol inforation
 int proti = 0;            // Next available protocol index
-Protocol not_a_protocol = (Protocol){{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, ' ', ' ', 255, 255};
+Spares spares;            // Recycled protocol slots (streaming only)
+Protocol not_a_protocol = (Protocol){0, 0, 0, 0, 0, 0, NO_PROT, 0, 0, ' ', ' '};
 
 
 
@@ -293,6 +509,18 @@ Protocol not_a_protocol = (Protocol){{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0,
  *********************************
 **/
 
+/* Lateness histograms have log2 buckets: bucket 0 is under 16 ticks, bucket k
+ * is 2^(k+3) up to 2^(k+4) ticks, and the last is everything from 2^15 ticks
+ * (455 us) up.
+ */
+#define LATEN 13
+
+int lateness_bucket(int64_t late) {
+  if (late < 16) return 0;
+  if (late >= (1 << 15)) return LATEN - 1;
+  return 28 - __builtin_clz((uint32_t)late);   // 16-31 -> 1, 32-63 -> 2, ...
+}
+
 struct ChannelError {
   int nstim;     // Number of stimuli scheduled to start
   int smiss;     // Number of stimuli missed entirely
@@ -302,6 +530,22 @@ struct ChannelError {
   int emax1;     // Biggest absolute error in pulse end timing (clock ticks)
   Dura toff0;    // Total error in pulse start timing
   Dura toff1;    // Total error in pulse end timing  
+  uint32_t late0[LATEN];  // Histogram of pulse start lateness
+  uint32_t late1[LATEN];  // Histogram of pulse end lateness
+
+  // An edge that was due at `due` happened at `now`
+  void started(Dura due, Dura now) {
+    int64_t late = now.k - due.k;
+    if (late > emax0) emax0 = (late > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)late;
+    toff0 += (Dura){late};
+    late0[lateness_bucket(late)]++;
+  }
+  void ended(Dura due, Dura now) {
+    int64_t late = now.k - due.k;
+    if (late > emax1) emax1 = (late > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)late;
+    toff1 += (Dura){late};
+    late1[lateness_bucket(late)]++;
+  }
 
   void write(byte *target) {
     int ns = (nstim > 999999999 || nstim < 0) ? 999999999 : nstim;
@@ -312,7 +556,7 @@ struct ChannelError {
     int e1 = emax1 / MHZ; e1 = (e1 > 99999 || e1 < 0) ? 99999 : e1;
     int64_t t0 = toff0.as_us(); t0 = (t0 > 9999999999ll || t0 < 0) ? 9999999999ll : t0;
     int64_t t1 = toff1.as_us(); t1 = (t1 > 9999999999ll || t1 < 0) ? 9999999999ll : t1;
-    snprintf((char*)target, 60, "%09d%06d%09d%06d%05d%05d%10lld%10lld", ns, sm, np, pm, e0, e1, t0, t1);
+    snprintf((char*)target, 61, "%09d%06d%09d%06d%05d%05d%10lld%10lld", ns, sm, np, pm, e0, e1, (long long)t0, (long long)t1);
   }
 };
 
@@ -328,95 +572,172 @@ struct ChannelError {
 
 #define CHAN (DIG+ANA)
 
+/* Binary min-heap of digital channels keyed by when each next needs attention.
+ * Only channels that are due get popped and advanced, so the cost of an event
+ * depends on how many channels switch, not on how many are configured.
+ * `where` tracks heap position so that a channel can be dropped when aborted.
+ */
+struct Schedule {
+  Dura when[DIG];  // Next deadline for each channel (valid only if where[i] != 255)
+  byte heap[DIG];  // Channel indices, earliest deadline first
+  byte where[DIG]; // Position of each channel in heap, 255 = not scheduled
+  int n;           // Number of channels in heap
+
+  void init() { n = 0; for (int i = 0; i < DIG; i++) where[i] = 255; }
+
+  bool is_empty() { return n == 0; }
+
+  int top() { return heap[0]; }
+
+  Dura next() { return (n > 0) ? when[heap[0]] : (Dura){0}; }
+
+  void place(int k, byte c) { heap[k] = c; where[c] = (byte)k; }
+
+  void sift_up(int k) {
+    byte c = heap[k];
+    while (k > 0) {
+      int up = (k-1) >> 1;
+      if (!(when[c] < when[heap[up]])) break;
+      place(k, heap[up]);
+      k = up;
+    }
+    place(k, c);
+  }
+
+  void sift_down(int k) {
+    byte c = heap[k];
+    while (true) {
+      int l = 2*k + 1;
+      if (l >= n) break;
+      if (l+1 < n && when[heap[l+1]] < when[heap[l]]) l++;
+      if (!(when[heap[l]] < when[c])) break;
+      place(k, heap[l]);
+      k = l;
+    }
+    place(k, c);
+  }
+
+  void push(int c, Dura t) {
+    when[c] = t;
+    heap[n] = (byte)c;
+    n++;
+    sift_up(n-1);
+  }
+
+  int pop() {
+    int c = heap[0];
+    where[c] = 255;
+    n--;
+    if (n > 0) { heap[0] = heap[n]; sift_down(0); }
+    return c;
+  }
+
+  void remove(int c) {
+    int k = where[c];
+    if (k == 255) return;
+    where[c] = 255;
+    n--;
+    if (k < n) {
+      heap[k] = heap[n];
+      if (k > 0 && when[heap[k]] < when[heap[(k-1) >> 1]]) sift_up(k);
+      else sift_down(k);
+    }
+  }
+};
+
 struct Channel {
   Dura t;         // Time remaining
   Dura yn;        // Time until next stimulus status switch
   Dura pq;        // Time until next pulse status switch
   byte runlevel;  // Runlevel 0 = off, 1 = stim off, 2 = stim on pulse off, 3 = pulse on
   byte pin;       // The digital pin number for this output, or 255 = analog out
-  byte who;       // Which protocol we're running now, 255 = none
-  byte zero;      // Initial protocol to start at (used only for resetting), 255 = none
+  uint16_t who;   // Which protocol we're running now, NO_PROT = none
+  uint16_t zero;  // Initial protocol to start at (used only for resetting), NO_PROT = none
   ChannelError e; // Error statistics
+  uint16_t train; // Which train of the run we're on, counting from 0 (wraps)
 
   void init(int index) {
-    *this = (Channel){ {0, 0}, {0, 0}, {0, 0}, C_ZZZ, 0, 255, 255, {0, 0, 0, 0, 0, 0, 0, 0} };
+    *this = (Channel){ {0}, {0}, {0}, C_ZZZ, 0, NO_PROT, NO_PROT, {0, 0, 0, 0, 0, 0, 0, 0} };
     pin = (index < DIG) ? digi[index] : 255;
-    zero = 255;
+    zero = NO_PROT;
     if (index < DIG && assume_in[index]) pinMode(index, INPUT);
   }
 
   void refresh(Protocol *ps) {
     e = (ChannelError){0, 0, 0, 0, 0, 0, 0, 0};
-    t = yn = pq = (Dura){0, 0};
+    t = yn = pq = (Dura){0};
     runlevel = C_ZZZ; // Debug::shout(__LINE__, pin, runlevel);
+    train = 0;
     who = zero;
     while (who < PROT && ps[who].next < PROT) who = ps[who].next;
   }
 
-  void pin_low() { if (who != 255) digitalWrite(pin, LOW); }
-  void pin_high() { if (who != 255) digitalWrite(pin, HIGH); }
+  // Pin changes are batched in `o`; they take effect on `o.flush()`.
+  void pin_low(Outputs &o) { if (who != NO_PROT) o.low(pin); }
+  void pin_high(Outputs &o) { if (who != NO_PROT) o.high(pin); }
 
-  void pin_off(Protocol *ps) {
-    if (who != 255) {
-      if (ps[who].i == 'i') digitalWrite(pin, HIGH);
-      else                  digitalWrite(pin, LOW);
-    }
+  void pin_off(Protocol *ps, Outputs &o) {
+    if (who != NO_PROT) o.write(pin, ps[who].i == 'i');
   }
-  void pin_on(Protocol *ps) {
-    if (who != 255) {
-      if (ps[who].i == 'i') digitalWrite(pin, LOW);
-      else                  digitalWrite(pin, HIGH);
-    }
+  void pin_on(Protocol *ps, Outputs &o) {
+    if (who != NO_PROT) o.write(pin, ps[who].i != 'i');
   }
 
-  bool run_next_protocol(Protocol *ps, Dura d) {
+  bool run_next_protocol(Protocol *ps, Dura d, Outputs &o) {
     Protocol *p = ps + who;
-    pin_off(p);
+    pin_off(p, o);
+    uint16_t done = who;
     who = p->next;
-    if (who < 255) {
+    if (spares.on) {
+      spares.put(ps, done);
+      if (who != NO_PROT) zero = who;
+    }
+    if (who != NO_PROT) {
       p = ps + who;
-      pin_off(p);
+      pin_off(p, o);
+      train += 1;
       runlevel = C_WAIT; // Debug::shout(__LINE__, pin, runlevel, d);
-      t = p->t; t += d;
-      yn = p->d; yn += d;
+      t = p->total(); t += d;
+      yn = p->delay(); yn += d;
       return true;
     }
-    else if (zero < 255) {
-      digitalWrite(pin, LOW);
+    else if (zero != NO_PROT) {
+      o.low(pin);
       runlevel = C_ZZZ;
       return false;
     }
     else return false;
   }
 
-  bool alive() { return runlevel != C_ZZZ && who != 255; }
+  bool alive() { return runlevel != C_ZZZ && who != NO_PROT; }
 
-  Dura advance(Dura d, Protocol *ps) {
+  // Does everything due by `d`; lateness is measured against `now` (usually the same).
+  Dura advance(Dura d, Dura now, Protocol *ps, Outputs &o) {
     bool started_yn = false;
     bool started_pq = false;
 tail_recurse:
-    if (!alive()) return (Dura){0,0};
+    if (!alive()) return (Dura){0};
     if (runlevel == C_WAIT) {
       // Only relevant times are c->t and c->yn
       Dura *x = (yn < t) ? &yn : &t;
       if (d < *x) return *x;
       else {
         if (yn < t) {
-          pin_on(ps);
+          pin_on(ps, o);
           started_yn = true;
           started_pq = true;
           runlevel = C_HI; // Debug::shout(__LINE__, pin, runlevel, d);
-          pq = yn; pq += ps[who].p;
-          yn += ps[who].s;
+          e.started(yn, now);
+          pq = yn; pq += ps[who].pulse_on();
+          yn += ps[who].stim_on();
           e.nstim++;
           e.npuls++;
-          // TODO--timing errors here!
         }
         else {
-          pin_low();
+          pin_low(o);
           if (started_yn) { started_yn = false; e.smiss++; }
           if (started_pq) { started_pq = false; e.pmiss++; }
-          run_next_protocol(ps, t);
+          run_next_protocol(ps, t, o);
         }
         goto tail_recurse;   // Functionally: return advance(d, ps, started_yn, started_pq);      
       }
@@ -430,33 +751,35 @@ tail_recurse:
       else {
         if (pq_first) {
           if (runlevel == C_LO) {
-            pin_on(ps);
+            pin_on(ps, o);
             started_pq = true;
             runlevel = C_HI; // Debug::shout(__LINE__, pin, runlevel, d);
-            pq += ps[who].p;
+            e.started(pq, now);
+            pq += ps[who].pulse_on();
             e.npuls++;
-            // TODO--timing errors here!
           }
           else {
-            pin_off(ps);
+            pin_off(ps, o);
             runlevel = C_LO;
-            pq += ps[who].q;
+            e.ended(pq, now);
+            pq += ps[who].pulse_off();
             if (started_pq) { started_pq = false; e.pmiss++; }
           }
         }
         else if (yn_first) {
-          if (runlevel == C_HI) pin_off(ps);
+          if (runlevel == C_HI) { pin_off(ps, o); e.ended(yn, now); }
           runlevel = C_WAIT; // Debug::shout(__LINE__, pin, runlevel, d);
-          yn += ps[who].z;
+          yn += ps[who].stim_off();
           if (started_pq) { started_pq = false; e.pmiss++; }
           if (started_yn) { started_yn = false; e.smiss++; }
         }
         else {
           // t exhausted
-          pin_low();
+          if (runlevel == C_HI) e.ended(t, now);
+          pin_low(o);
           if (started_yn) { started_yn = false; e.smiss++; }
           if (started_pq) { started_pq = false; e.pmiss++; }
-          run_next_protocol(ps, t);
+          run_next_protocol(ps, t, o);
         }
         goto tail_recurse;
       }
@@ -477,24 +800,116 @@ tail_recurse:
     }
   }
 
-  static Dura advance(Channel *cs, Dura d, Protocol *ps, int &living) {
-    Dura x = (Dura){0, 0};
-    int a = 0;
-    for (int i = 0; i < DIG; i++) if (cs[i].alive()) {
-      a += 1;
-      Dura y = cs[i].advance(d, ps);
-      if (!y.is_empty()) {
-        if (x.is_empty() || y < x) x = y;
-      }
-      else if (!cs[i].alive()) a -= 1;
+  // Time of the first thing this channel needs to do (must be in C_WAIT, as at start).
+  Dura first_event() { return (yn < t) ? yn : t; }
+
+  static void schedule(Channel *cs, Schedule &sc) {
+    sc.init();
+    for (int i = 0; i < DIG; i++) if (cs[i].alive()) sc.push(i, cs[i].first_event());
+  }
+
+  static Dura advance(Channel *cs, Schedule &sc, Dura d, Dura now, Protocol *ps, int &living, Outputs &o) {
+    while (!sc.is_empty() && !(d < sc.next())) {
+      int i = sc.pop();
+      Dura y = cs[i].advance(d, now, ps, o);
+      if (cs[i].alive() && !y.is_empty()) sc.push(i, y);
     }
-    living = a;
-    return x;
+    living = sc.n;
+    return sc.next();
   }
 };
 
 Channel channels[CHAN];
-Channel not_a_channel = (Channel){ {0, 0}, {0, 0}, {0, 0}, C_ZZZ, 128, 255, 255, {0, 0, 0, 0, 0, 0, {0, 0}, {0, 0}}};
+Schedule schedule;
+
+
+
+/*****************************
+ * Precompiled edge timeline *
+ *****************************
+ *
+ * Optionally (`~+`), the channel state machines are run ahead of the clock
+ * and their output is stored as a list of times at which to apply a batch of
+ * port writes.  The list is a ring buffer that is topped up a chunk at a time
+ * whenever the main loop has idle time, so protocols of any length fit.
+ * While running, an edge then only costs a comparison and the port writes.
+ *
+ * Because the channels run ahead, their error statistics are also ahead.
+**/
+
+#define TLN 128
+#define TL_CHUNK 16
+
+struct Edge {
+  Dura at;    // When to apply
+  Outputs o;  // What to write
+};
+
+struct Timeline {
+  Edge edges[TLN];
+  int head;                // Index of next edge to play
+  int count;               // Number of edges compiled but not yet played
+  uint32_t stopped;        // Channels stopped individually (one bit each)
+  bool on;                 // Are we playing from the timeline?
+
+  void init() {
+    head = count = 0;
+    stopped = 0;
+    on = false;
+  }
+
+  bool is_done(Schedule &sc) { return count == 0 && sc.is_empty(); }
+
+  Dura next() { return (count > 0) ? edges[head].at : (Dura){0}; }
+
+  // Drop all compiled edges for channel i on pin; false if it was already stopped.
+  bool stop(int i, byte pin) {
+    if (i >= DIG || pin >= 24 || (stopped & (((uint32_t)1) << i))) return false;
+    stopped |= ((uint32_t)1) << i;
+    PortBit pb = pin_ports[pin];
+    uint32_t m = ((uint32_t)1) << pb.bit;
+    int n = 0;
+    for (int j = 0; j < count; j++) {
+      Edge &e = edges[(head + j) % TLN];
+      e.o.hi[pb.port] &= ~m;
+      e.o.lo[pb.port] &= ~m;
+      if (!e.o.hi[pb.port] && !e.o.lo[pb.port]) e.o.dirty &= (byte)~(1 << pb.port);
+      if (e.o.dirty) {
+        if (n != j) edges[(head + n) % TLN] = e;
+        n++;
+      }
+    }
+    count = n;
+    return true;
+  }
+
+  // Compile up to n more edges by advancing the channels to each deadline in turn.
+  int fill(Channel *cs, Schedule &sc, Protocol *ps, int n) {
+    int made = 0;
+    int living = 0;
+    while (made < n && count < TLN && !sc.is_empty()) {
+      Edge *e = edges + ((head + count) % TLN);
+      e->at = sc.next();
+      e->o.init();
+      Channel::advance(cs, sc, e->at, e->at, ps, living, e->o);
+      if (e->o.dirty) { count++; made++; }
+    }
+    return made;
+  }
+
+  // Apply every edge due by time d.
+  void play(Dura d, Trace &tr) {
+    while (count > 0 && !(d < edges[head].at)) {
+      if (tr.on) tr.note(edges[head].o, edges[head].at.k);
+      edges[head].o.flush();
+      head = (head + 1) % TLN;
+      count--;
+    }
+  }
+};
+
+Timeline timeline;
+Channel not_a_channel = (Channel){ {0}, {0}, {0}, C_ZZZ, 128, NO_PROT, NO_PROT, {0, 0, 0, 0, 0, 0, {0}, {0}}};
 
 
 
@@ -558,22 +973,56 @@ void yellr3d(int rl, Dura g, Dura n, Dura io) {
 byte msg[MSGN+1];
 int erri = 0;
 
-byte buf[BUFN];
-int bufi = 0;
+// Input is kept in a ring, but every byte is stored twice, BUFN apart, so
+// the unread bytes always sit contiguously at `buf` however the ring has
+// wrapped.  Consuming a command just moves `buf` forwards; nothing is copied.
+byte ring[2*BUFN];
+int ring_read = 0;   // Index of buf[0] in ring, always < BUFN
+int ring_write = 0;  // Index where the next byte arrives, always < BUFN
+byte *buf = ring;
+int bufi = 0;        // Number of unread bytes at buf
+
+// The parser for the command at buf notes how many bytes it needs (cmd_need)
+// and how far it has already scanned for a terminator (cmd_scan), so a
+// command arriving in pieces is looked at again only once it can go further.
+int cmd_need = 1;
+int cmd_scan = 1;
+
+/* After a garbled binary frame there is no telling where the next command
+ * starts, so input is thrown away until as much as the longest frame has
+ * gone, or until the host goes quiet.
+ */
+#define SKIP_QUIET (2*HTZ/1000)   // Ticks without input that end the skipping (2 ms)
+int skip_left = 0;                // Bytes still to throw away
+uint32_t skip_cyc;                // ARM_DWT_CYCCNT when input last arrived while skipping
+
+void reset_buf() {
+  ring_read = ring_write = 0;
+  buf = ring;
+  bufi = 0;
+  cmd_need = cmd_scan = 1;
+  skip_left = 0;
+}
 
-void discard(byte* buffer, int& iN, int shift) {
-  if (shift > iN) iN = 0;
-  else if (shift >= 1) {
-    for (int j = shift; j < iN; j++) buffer[j-shift] = buffer[j];
-    int result = iN - shift;
+void discard_buf(int shift) {
+  if (shift > bufi) shift = bufi;
+  if (shift >= 1) {
+    ring_read = (ring_read + shift) & (BUFN - 1);
+    buf = ring + ring_read;
+    bufi -= shift;
 #ifdef YELL_DEBUG
-    yell2ib(iN, result, buffer);
+    yell2ib(bufi + shift, bufi, buf);
 #endif
-    iN = result;    
   }
+  cmd_need = cmd_scan = 1;
 }
 
-void discard_buf(int shift) { discard(buf, bufi, shift); }
+// True if the command has its first n bytes; otherwise waits for them.
+bool need_buf(int n) {
+  if (bufi >= n) return true;
+  cmd_need = n;
+  return false;
+}
 
 void discard_command() {
   int i = 1;
@@ -582,16 +1031,42 @@ void discard_command() {
     if (b == '~' || b == '$') break;
     i++;
   }
-  discard(buf, bufi, i);
+  discard_buf(i);
+}
+
+// Throws away input being skipped; true while there may be more to skip.
+bool skip_input() {
+  if (skip_left <= 0) return false;
+  if (bufi > 0) {
+    int n = (bufi < skip_left) ? bufi : skip_left;
+    discard_buf(n);
+    skip_left -= n;
+    skip_cyc = ARM_DWT_CYCCNT;
+  }
+  else if ((uint32_t)(ARM_DWT_CYCCNT - skip_cyc) > SKIP_QUIET) skip_left = 0;
+  return skip_left > 0;
+}
+
+// Starts throwing away the next n bytes of input (counting from buf).
+void skip_input(int n) {
+  skip_left = n;
+  skip_cyc = ARM_DWT_CYCCNT;
+  skip_input();
 }
 
 void drain_to_buf() {
   int av = Serial.available();
+  if (av > BUFN - bufi) av = BUFN - bufi;
   if (av > 0) {
 #ifdef YELL_DEBUG
     int old = bufi;
 #endif
-    while ((av--) > 0 && bufi < BUFN) buf[bufi++] = Serial.read();
+    for (; av > 0; av--) {
+      byte b = Serial.read();
+      ring[ring_write] = ring[ring_write + BUFN] = b;
+      ring_write = (ring_write + 1) & (BUFN - 1);
+      bufi++;
+    }
 #ifdef YELL_DEBUG
     yell2ib(old, bufi, buf);
 #endif
@@ -632,7 +1107,28 @@ void write_voltage_5(int digital_value, char* buffer, bool digital) {
  *********************************************/
 
 #define DRIFT_OFFSET 128
-int drift_rate;           // Correction for drift
+#define DRIFT_FINE_OFFSET 132          // Marker byte 'f' then the fine drift, if one was saved
+#define DRIFT_FINE_UNITS 10000000000ll // Fine drift is in parts per 10^10
+int drift_rate;           // Correction for drift as 1/n (as set by `~^`)
+int drift_fine;           // Correction for drift in parts per 10^10 (as set by `~%`)
+int32_t drift_frac;       // Correction actually applied: extra ticks per tick, 32.32 fixed point
+
+int32_t drift_frac_from_rate(int rate) {
+  if (rate == 0) return 0;
+  int64_t f = (((int64_t)1) << 32) / rate;
+  return (f > 0x7FFFFFFF) ? 0x7FFFFFFF : ((f < -0x7FFFFFFF) ? -0x7FFFFFFF : (int32_t)f);
+}
+
+int32_t drift_frac_from_fine(int fine) { return (int32_t)((((int64_t)fine) << 32) / DRIFT_FINE_UNITS); }
+
+// 10^10 / 2^32 = 9765625 / 2^22
+int drift_fine_from_frac(int32_t frac) { return (int)((((int64_t)frac) * 9765625 + (1 << 21)) >> 22); }
+
+int drift_rate_from_fine(int fine) {
+  if (fine == 0) return 0;
+  int64_t n = DRIFT_FINE_UNITS / fine;
+  return (n >= 100000000 || n <= -100000000) ? 0 : (int)n;
+}
 
 #define WHON 62
 byte whoami[WHON];
@@ -704,6 +1200,14 @@ void init_eeprom() {
   }
   eeprom_read_who();
   drift_rate = eeprom_get_int(DRIFT_OFFSET);
+  if (EEPROM.read(DRIFT_FINE_OFFSET) == 'f') {
+    drift_fine = eeprom_get_int(DRIFT_FINE_OFFSET+1);
+    drift_frac = drift_frac_from_fine(drift_fine);
+  }
+  else {
+    drift_frac = drift_frac_from_rate(drift_rate);
+    drift_fine = drift_fine_from_frac(drift_frac);
+  }
 }
 
 void init_analog() {
@@ -714,6 +1218,7 @@ void init_analog() {
 }
 
 void init_digital() {
+  outputs.init();
   for (int i = 0; i<DIG; i++) { 
     int pi = digi[i];
     if (assume_in[i]) pinMode(pi, INPUT);
@@ -730,9 +1235,26 @@ void init_digital() {
  * Runtime *
  ***********/
 
+/* Masks interrupts and returns the old mask, to be handed back to `release_interrupts`.
+ * Unlike `noInterrupts()`/`interrupts()`, this nests: it is safe inside an interrupt
+ * or inside another masked section.
+ */
+#if defined(KINETISK)
+inline uint32_t hold_interrupts() {
+  uint32_t m;
+  __asm__ volatile("mrs %0, primask\n\tcpsid i" : "=r" (m) : : "memory");
+  return m;
+}
+inline void release_interrupts(uint32_t m) { __asm__ volatile("msr primask, %0" : : "r" (m) : "memory"); }
+#else
+inline uint32_t hold_interrupts() { noInterrupts(); return 0; }
+inline void release_interrupts(uint32_t m) { if (!m) interrupts(); }
+#endif
+
 volatile int tick;        // Last CPU clock count
-volatile int tock;        // Clock counts since last correction
+int64_t tock;             // Fraction of a tick of drift correction not yet applied (32.32 fixed point)
 Dura global_clock;        // Time since start of running.
+Dura board_clock;         // Time since power on (never reset; for starting runs at an agreed time)
 Dura next_event;          // Time of next event.  Just busywait until then.
 
 #define MIN_BUSY_US 1000
@@ -745,11 +1267,622 @@ Dura io_anyway;           // Time at which you need to read I/O even if it may i
 #define RUN_COMPLETED 0
 #define RUN_PROGRAM   1
 #define RUN_GO        2
+#define RUN_ARMED     3
 volatile int runlevel;   // -2 error; -1 stopping to error; 0 ran; 1 accepting commands; 2 running
 volatile int alive;      // Number of channels alive and running
 
 volatile bool led_is_on;
 
+/* Hardware timer that calls `edge_interrupt()` after a given number of ticks.
+ * On the board this is a PIT channel (via IntervalTimer); elsewhere it is
+ * simulated by checking the cycle counter each time through `loop()`.
+ * Long waits are broken up so that the timer period never gets out of range.
+ */
+#define EDGE_MIN_TICKS (MHZ/2)
+#define EDGE_MAX_TICKS (HTZ/4)
+
+struct EdgeTimer {
+  volatile bool on;     // Is the run being driven from the timer?
+#if defined(KINETISK)
+  IntervalTimer pit;
+#else
+  volatile bool armed;  // Simulated timer is waiting
+  uint32_t due;         // Cycle count at which simulated timer goes off
+#endif
+
+  void init() {
+    cancel();
+    on = false;
+  }
+
+  void arm(int64_t ticks) {
+    if (ticks < EDGE_MIN_TICKS) ticks = EDGE_MIN_TICKS;
+    if (ticks > EDGE_MAX_TICKS) ticks = EDGE_MAX_TICKS;
+#if defined(KINETISK)
+    pit.begin(edge_interrupt, ((float)ticks) / MHZ);
+#else
+    due = ((uint32_t)ARM_DWT_CYCCNT) + (uint32_t)ticks;
+    armed = true;
+#endif
+  }
+
+  void cancel() {
+#if defined(KINETISK)
+    pit.end();
+#else
+    armed = false;
+#endif
+  }
+
+  void poll() {
+#if !defined(KINETISK)
+    if (armed && (int32_t)(((uint32_t)ARM_DWT_CYCCNT) - due) >= 0) {
+      armed = false;
+      edge_interrupt();
+    }
+#endif
+  }
+};
+
+EdgeTimer edge_timer;
+
+/* The analog channel is run from its own timer interrupt at a fixed sample rate.
+ * A 32-bit phase accumulator indexes `wave[]` (or folds into a triangle), so each
+ * sample costs the same whatever the period, amplitude, or shape.  The analog
+ * channel keeps its own time by counting samples.  Only whole half-waves are
+ * played in each stimulus-on block; the last partial one is skipped.
+ */
+#define ANALOG_US 25
+#define ANALOG_TICKS (MHZ*ANALOG_US)
+#define ANALOG_MIN_PERIOD (MHZ*1000)
+#define HALF_WAVE (((uint64_t)1) << 31)
+
+struct Analog {
+  volatile bool running;   // Producing samples (timer is on)
+  volatile bool winding;   // Finish the current half-wave, then stop
+  Protocol *ps;
+  uint16_t who;            // Protocol being played
+  uint16_t train;          // Which train that is, counting from 0 (wraps)
+  int64_t now;             // Ticks since start, counted by samples
+  int64_t t;               // When protocol ends
+  int64_t yn;              // When current block ends
+  bool on;                 // In a stimulus-on block?
+  bool tri;                // Triangle (true) or sine (false)
+  int ampl;                // 0 to ANALOG_AMPL, negative if inverted
+  uint32_t phase;          // Position within the wave
+  uint32_t inc;            // Phase step per sample
+  uint64_t left;           // Phase left to go in the whole half-waves of this block
+#if defined(KINETISK)
+  IntervalTimer timer;
+#else
+  uint32_t due;            // Cycle count of next simulated sample
+#endif
+
+  void load(int64_t at) {
+    Protocol *p = ps + who;
+    t = at + p->total().k;
+    yn = at + p->delay().k;
+    on = false;
+    left = 0;
+    phase = 0;
+    int64_t period = p->pulse_on().k;
+    inc = (period >= ANALOG_MIN_PERIOD) ? (uint32_t)((((uint64_t)ANALOG_TICKS) << 32) / period) : 0;
+    ampl = (p->a > ANALOG_AMPL) ? ANALOG_AMPL : (int)p->a;
+    if (p->i == 'i') ampl = -ampl;
+    tri = p->j == 'r';
+  }
+
+  void start(Protocol *protos, uint16_t first) {
+    if (first == NO_PROT) return;
+    ps = protos;
+    who = first;
+    train = 0;
+    now = 0;
+    winding = false;
+    load(0);
+    running = true;
+#if defined(KINETISK)
+    timer.priority(160);   // Digital edges come first
+    timer.begin(analog_interrupt, ANALOG_US);
+#else
+    due = ((uint32_t)ARM_DWT_CYCCNT) + ANALOG_TICKS;
+#endif
+  }
+
+  void stop() {
+#if defined(KINETISK)
+    timer.end();
+#endif
+    running = false;
+    winding = false;
+    analogWrite(A14, ANALOG_ZERO);
+  }
+
+  void wind_down() { if (running) winding = true; }
+
+  int shape() {
+    int x = (int)(phase >> (32 - 12));   // 0 to ANALOG_DIVS-1
+    if (!tri) return wave[x] - ANALOG_ZERO;
+    int v = (x < 1024) ? 2*x : ((x < 3072) ? 4096 - 2*x : 2*x - 8192);
+    return (v > ANALOG_AMPL) ? ANALOG_AMPL : ((v < -ANALOG_AMPL) ? -ANALOG_AMPL : v);
+  }
+
+  void step() {
+    now += ANALOG_TICKS;
+    while (!(now < t)) {
+      if (ps[who].next == NO_PROT) { stop(); return; }
+      int64_t at = t;
+      who = ps[who].next;
+      train += 1;
+      load(at);
+    }
+    if (!(now < yn)) {
+      Protocol *p = ps + who;
+      on = !on;
+      if (on) {
+        int64_t on_time = p->stim_on().k;
+        yn += on_time;
+        phase = 0;
+        left = (inc > 0) ? ((uint64_t)((2*on_time) / p->pulse_on().k)) * HALF_WAVE : 0;
+      }
+      else {
+        yn += p->stim_off().k;
+        left = 0;
+      }
+    }
+    if (winding) {
+      uint64_t to_zero = HALF_WAVE - (phase & (HALF_WAVE - 1));
+      if (left > to_zero) left = to_zero;
+    }
+    int v = 0;
+    if (left > inc) {
+      left -= inc;
+      phase += inc;
+      v = shape();
+    }
+    else left = 0;
+    if (winding && left == 0) { stop(); return; }
+    analogWrite(A14, ANALOG_ZERO + ((v * ampl) >> 11));
+  }
+
+  void poll() {
+#if !defined(KINETISK)
+    while (running && (int32_t)(((uint32_t)ARM_DWT_CYCCNT) - due) >= 0) {
+      due += ANALOG_TICKS;
+      step();
+    }
+#endif
+  }
+};
+
+Analog analog;
+
+
+/*********************
+ * Input acquisition *
+ *********************
+ *
+ * Selected inputs (analog A-J, digital K-W) are sampled from a timer interrupt
+ * that yields to the edge and analog-output timers.  It only stamps the sample
+ * and reads the digital inputs; the analog inputs are then converted one after
+ * another in the background, each finishing in the ADC interrupt, so nothing
+ * ever waits on the ADC.  A sample is the low 32 bits
+ * of the clock, then two bytes per analog input (in order) with its raw reading,
+ * then, if any digital input is selected, two bytes with bit k set if input
+ * 'K'+k is high.  Samples are packed into packets that the main loop sends as
+ * they fill (or when the oldest sample has waited 100 ms):
+ *   `~{`, number of samples, flags, epoch, sample size in bytes, samples...
+ * Flags: 1 = samples were dropped just before these, 2 = taken during a run (so
+ * the clock counts from its start), 4 = acquisition has stopped and this is the
+ * last packet.  The epoch counts run starts; no packet spans two.
+**/
+
+#define ACQN 16             // Packets held on the board; power of two
+#define ACQ_PACKET 62
+#define ACQ_HEADER 6
+#define ACQ_ANALOG 10       // A through J
+#define ACQ_INPUTS 23       // A through W
+#define ACQ_MIN_US 50       // Shortest sampling period, plus this much per analog input
+#define ACQ_WAIT (HTZ/10)   // Longest a sample waits for its packet to fill
+
+#if defined(KINETISK)
+// ADC0 channel of A0-A9 on a Teensy 3.1/3.2 (as channel2sc1a in the core's analog.c)
+const byte acq_sc1a[ACQ_ANALOG] = { 5, 14, 8, 9, 13, 12, 6, 7, 15, 4 };
+#endif
+
+struct Acquire {
+  byte packets[ACQN][ACQ_PACKET];
+  volatile uint32_t written;  // Packets ever filled (index mod ACQN)
+  volatile uint32_t read;     // Packets ever sent to the host
+  volatile int fill;          // Bytes used in the packet being filled, 0 = not started
+  uint32_t first;             // ARM_DWT_CYCCNT when that packet was started
+  byte chans[ACQ_INPUTS];     // Inputs sampled, analog ones first
+  byte staged[ACQ_PACKET];    // Sample being taken, until its analog inputs are converted
+  bool staged_running;        // Was it taken during a run...
+  byte staged_epoch;          // ...and which one
+  volatile int converting;    // Analog input being converted for it, -1 = none
+  int nana;                   // How many analog inputs
+  int nin;                    // How many inputs in all
+  int size;                   // Bytes per sample
+  volatile byte epoch;        // Run starts, mod 256
+  bool lost;                  // Dropped samples since the last packet was started
+  volatile bool on;
+  volatile bool ending;       // Stopped, but the last packet is not yet sent
+#if defined(KINETISK)
+  IntervalTimer timer;
+#else
+  uint32_t period;            // Ticks between simulated samples
+  uint32_t due;               // Cycle count of the next simulated sample
+#endif
+
+  bool pending() { return on || ending || read != written; }
+
+  // Call with interrupts off.
+  void seal() {
+    if (fill > ACQ_HEADER) written++;
+    fill = 0;
+  }
+
+  // Stamps a sample and reads its digital inputs; the analog ones follow in `converted`.
+  void sample() {
+    if (converting >= 0) { lost = true; return; }   // Still converting the last one
+    staged_running = runlevel == RUN_GO;
+    staged_epoch = epoch;
+    // The main loop keeps the clock; add on what it hasn't counted yet (low bits only)
+    write_le32(staged, ((uint32_t)global_clock.k) + (((uint32_t)ARM_DWT_CYCCNT) - (uint32_t)tick));
+    if (nin > nana) {
+      uint32_t bits = 0;
+      for (int k = nana; k < nin; k++) if (digitalRead(digi[chans[k] - 'A'])) bits |= ((uint32_t)1) << (chans[k] - 'K');
+      staged[size - 2] = (byte)bits;
+      staged[size - 1] = (byte)(bits >> 8);
+    }
+#if defined(KINETISK)
+    if (nana > 0) {
+      converting = 0;
+      ADC0_SC1A = ADC_SC1_AIEN | acq_sc1a[chans[0] - 'A'];
+      return;
+    }
+#else
+    for (int k = 0; k < nana; k++) {
+      int v = analogRead(chans[k] - 'A');
+      staged[4 + 2*k] = (byte)v;
+      staged[5 + 2*k] = (byte)(v >> 8);
+    }
+#endif
+    store();
+  }
+
+#if defined(KINETISK)
+  // From the ADC interrupt: analog input `converting` read `v`; start the next or store the sample.
+  void converted(int v) {
+    int k = converting;
+    if (k < 0) return;
+    staged[4 + 2*k] = (byte)v;
+    staged[5 + 2*k] = (byte)(v >> 8);
+    if (++k < nana) {
+      converting = k;
+      ADC0_SC1A = ADC_SC1_AIEN | acq_sc1a[chans[k] - 'A'];
+    }
+    else {
+      converting = -1;
+      store();
+    }
+  }
+#endif
+
+  // Moves the staged sample into the packet being filled.  Only called at the
+  // acquisition priority (the timer and the ADC share it), so never reentered.
+  void store() {
+    byte *p = packets[written & (ACQN - 1)];
+    if (fill > 0 && (p[4] != staged_epoch || ((p[3] & 2) != 0) != staged_running)) seal();
+    if (fill == 0) {
+      if (written - read >= ACQN) { lost = true; return; }
+      p = packets[written & (ACQN - 1)];
+      p[0] = '~';
+      p[1] = '{';
+      p[2] = 0;
+      p[3] = (lost ? 1 : 0) | (staged_running ? 2 : 0);
+      p[4] = staged_epoch;
+      p[5] = (byte)size;
+      fill = ACQ_HEADER;
+      first = ARM_DWT_CYCCNT;
+      lost = false;
+    }
+    memcpy(p + fill, staged, size);
+    fill += size;
+    p[2] += 1;
+    if (fill + size > ACQ_PACKET) seal();
+  }
+
+  void start(uint32_t mask, uint32_t us) {
+    nana = nin = 0;
+    for (int k = 0; k < ACQ_INPUTS; k++) if (mask & (((uint32_t)1) << k)) {
+      if (k < ACQ_ANALOG) nana++;
+      chans[nin++] = 'A' + k;
+    }
+    size = 4 + 2*nana + ((nin > nana) ? 2 : 0);
+    fill = 0;
+    lost = false;
+    ending = false;
+    converting = -1;
+    on = true;
+#if defined(KINETISK)
+    // One ordinary read each sets the ADC up (resolution, averaging, mux) for these inputs
+    for (int k = 0; k < nana; k++) analogRead(chans[k] - 'A');
+    NVIC_SET_PRIORITY(IRQ_ADC0, 192);
+    NVIC_ENABLE_IRQ(IRQ_ADC0);
+    timer.priority(192);   // After edges and analog output; same as the ADC, so they take turns
+    timer.begin(acquire_interrupt, (int)us);
+#else
+    period = us * MHZ;
+    due = ((uint32_t)ARM_DWT_CYCCNT) + period;
+#endif
+  }
+
+  // Stops sampling; the main loop then sends what is left, and a last (empty) packet.
+  void finish() {
+    if (!on) return;
+#if defined(KINETISK)
+    timer.end();
+#endif
+    // May be called with interrupts already masked (as from `process_reset`)
+    uint32_t held = hold_interrupts();
+#if defined(KINETISK)
+    NVIC_DISABLE_IRQ(IRQ_ADC0);
+    if (converting >= 0) ADC0_SC1A = ADC_SC1_ADCH(31);   // Abandon the sample being converted
+#endif
+    converting = -1;
+    on = false;
+    seal();
+    ending = true;
+    release_interrupts(held);
+  }
+
+  void poll() {
+#if !defined(KINETISK)
+    while (on && (int32_t)(((uint32_t)ARM_DWT_CYCCNT) - due) >= 0) {
+      due += period;
+      sample();
+    }
+#endif
+  }
+};
+
+Acquire acquire;
+
+
+/********************
+ * Hardware trigger *
+ ********************
+ *
+ * When armed, an edge on an input pin starts the run from its interrupt, and
+ * the clock counts from the cycle the edge was seen at, not from when the run
+ * got going (the difference is kept as the latency).  Elsewhere, pin levels
+ * are polled from the main loop instead.
+ *
+ * The trigger can instead be a time on the board clock, which the main loop
+ * watches (busy-waiting once it is close) so boards can start together.
+**/
+
+#define SCHED_BUSY_US 200
+
+struct Trigger {
+  volatile bool armed;
+  volatile bool fired;       // Started a run since the last reset
+  volatile bool starting;    // Run is being started by the trigger right now
+  bool scheduled;            // Waiting for the board clock to reach `due`, not for a pin
+  Dura due;
+  byte pin;
+  bool rising;
+  bool precompile;           // How to run: as `~+`...
+  bool interrupt;            // ...or as `~>` (neither = as `~*`)
+  volatile uint32_t cyc;     // ARM_DWT_CYCCNT at the edge
+  volatile uint32_t latency; // Cycles from the edge until the run was going
+#if !defined(KINETISK)
+  int level;                 // Pin level last polled
+#endif
+
+  void init() {
+    disarm();
+    fired = starting = false;
+    cyc = latency = 0;
+  }
+
+  void arm_at(Dura when, bool pre, bool intr) {
+    due = when;
+    precompile = pre;
+    interrupt = intr;
+    scheduled = true;
+    armed = true;
+  }
+
+  void arm(byte p, bool up, bool pre, bool intr) {
+    pin = p;
+    rising = up;
+    precompile = pre;
+    interrupt = intr;
+    scheduled = false;
+    pinMode(pin, INPUT);
+    armed = true;
+#if defined(KINETISK)
+    attachInterrupt(pin, trigger_interrupt, rising ? RISING : FALLING);
+#else
+    level = digitalRead(pin);
+#endif
+  }
+
+  void disarm() {
+#if defined(KINETISK)
+    if (armed && !scheduled) detachInterrupt(pin);
+#endif
+    armed = false;
+    scheduled = false;
+  }
+
+  void poll() {
+    if (!armed) return;
+    if (scheduled) {
+      uint32_t now;
+      int64_t late;
+      do {
+        now = ARM_DWT_CYCCNT;
+        late = board_clock.k + (int32_t)(now - (uint32_t)tick) - due.k;
+      } while (late < 0 && late > -MHZ*SCHED_BUSY_US);
+      if (late >= 0) trigger_start(now - (uint32_t)late);
+      return;
+    }
+#if !defined(KINETISK)
+    int now = digitalRead(pin);
+    bool edge = now != level && ((now != 0) == rising);
+    level = now;
+    if (edge) trigger_interrupt();
+#endif
+  }
+};
+
+Trigger trigger;
+
+
+/********************
+ * Clock discipline *
+ ********************
+ *
+ * Steers the drift correction so that the clock keeps time with a reference
+ * pulse (e.g. 1 PPS) on an input pin.  Edges are stamped with the cycle counter
+ * from a pin interrupt (polled elsewhere), and the main loop works out the
+ * correction with a second-order phase-locked loop: the phase error (how far
+ * the corrected clock has got ahead of the pulses) sets the correction, and
+ * more slowly moves the frequency estimate underneath it.  The first interval
+ * sets the frequency estimate outright.  Edges that are not a whole number of
+ * periods apart (to within 1%) start it all over again.
+**/
+
+#define DISC_MIN_US 10000
+#define DISC_MAX_US 20000000
+#define DISC_LOCK_TICKS (10*MHZ)   // Locked once the phase stays within 10 us...
+#define DISC_LOCK_EDGES 8          // ...for this many edges in a row
+#define DISC_KP 2                  // Correction moves by phase/period/2^DISC_KP...
+#define DISC_KI 6                  // ...and the frequency estimate by phase/period/2^DISC_KI
+#define DISC_MAX_FRAC 42949673     // 1% in 32.32 fixed point
+#define DISCN 4
+
+struct Discipline {
+  bool on;
+  byte pin;
+  bool rising;
+  int64_t period;                // Ticks between reference edges
+  volatile uint32_t cyc[DISCN];  // Cycle counts at edges not yet used
+  volatile uint32_t written;
+  uint32_t read;
+  bool primed;                   // Have an edge to measure the next one from
+  bool tracking;                 // Frequency estimate made; now steering the phase
+  uint32_t last;                 // Cycle count at that edge
+  int64_t phase;                 // Ticks the corrected clock is ahead of the reference
+  int64_t freq;                  // Frequency estimate, 32.32 like drift_frac
+  int steady;                    // Edges in a row within DISC_LOCK_TICKS
+  uint32_t edges;                // Edges used since starting
+#if !defined(KINETISK)
+  int level;                     // Pin level last polled
+#endif
+
+  void relock() {
+    primed = tracking = false;
+    phase = 0;
+    steady = 0;
+  }
+
+  void start(byte p, bool up, uint32_t us) {
+    stop();
+    pin = p;
+    rising = up;
+    period = ((int64_t)us) * MHZ;
+    read = written;
+    edges = 0;
+    relock();
+    pinMode(pin, INPUT);
+    on = true;
+#if defined(KINETISK)
+    attachInterrupt(pin, discipline_interrupt, rising ? RISING : FALLING);
+#else
+    level = digitalRead(pin);
+#endif
+  }
+
+  // Stops steering; the last correction stays in place.
+  void stop() {
+#if defined(KINETISK)
+    if (on) detachInterrupt(pin);
+#endif
+    on = false;
+    relock();
+  }
+
+  bool locked() { return on && steady >= DISC_LOCK_EDGES; }
+
+  void edge(uint32_t c) {
+    cyc[written & (DISCN - 1)] = c;
+    written += 1;
+  }
+
+  void steer(uint32_t c) {
+    uint32_t m = c - last;
+    bool primed_before = primed;
+    last = c;
+    primed = true;
+    if (!primed_before) return;
+    int64_t k = (((int64_t)m) + period/2) / period;
+    int64_t off = ((int64_t)m) - k*period;
+    if (k < 1 || k > 8 || off > k*period/100 || -off > k*period/100) {
+      relock();
+      primed = true;
+      return;
+    }
+    int64_t e = ((int64_t)m) + ((((int64_t)m) * drift_frac) >> 32) - k*period;
+    edges += 1;
+    int64_t u;
+    if (!tracking) {
+      freq = drift_frac - (e << 32) / m;
+      phase = 0;
+      tracking = true;
+      u = freq;
+    }
+    else {
+      phase += e;
+      if (phase > period/4 || -phase > period/4) {
+        relock();
+        primed = true;
+        return;
+      }
+      int64_t x = (phase << 32) / period;
+      freq -= x >> DISC_KI;
+      u = freq - (x >> DISC_KP);
+    }
+    if (u > DISC_MAX_FRAC) u = DISC_MAX_FRAC;
+    if (u < -DISC_MAX_FRAC) u = -DISC_MAX_FRAC;
+    drift_frac = (int32_t)u;
+    drift_fine = drift_fine_from_frac(drift_frac);
+    drift_rate = drift_rate_from_fine(drift_fine);
+    steady = (tracking && phase <= DISC_LOCK_TICKS && -phase <= DISC_LOCK_TICKS) ? steady + 1 : 0;
+  }
+
+  void poll() {
+    if (!on) return;
+#if !defined(KINETISK)
+    int now = digitalRead(pin);
+    bool up = now != level && ((now != 0) == rising);
+    level = now;
+    if (up) edge(ARM_DWT_CYCCNT);
+#endif
+    while (read != written) {
+      if (written - read > DISCN) { read = written; relock(); break; }   // Fell behind; edges were overwritten
+      steer(cyc[read & (DISCN - 1)]);
+      read += 1;
+    }
+  }
+};
+
+Discipline discipline;
+
 void error_with_message(const char* what, int n, const char* detail, int m) {
   if (erri == 0) {
     msg[0] = '$';
@@ -778,49 +1911,75 @@ void error_with_message(const char* what, char letter) {
 
 void error_with_message(const char* what) { error_with_message(what, MSGN, "", 0); }
 
+void analog_interrupt() { analog.step(); }
+
+void acquire_interrupt() { acquire.sample(); }
+
+#if defined(KINETISK)
+void adc0_isr() { acquire.converted(ADC0_RA); }
+#endif
+
 void analog_cooldown() {
   if (runlevel == RUN_TO_ERROR) {
-    if (channels[DIG].who == 255) {
-      if (channels[DIG].zero != 255) analogWrite(A14, ANALOG_ZERO);
-      runlevel = RUN_ERROR;
-    }
-    else {
-      // TODO--nice cooldown!
-      analogWrite(A14, ANALOG_ZERO);
-      runlevel = RUN_ERROR;
-    }
+    if (analog.running) analog.wind_down();   // Becomes an error once the half-wave is done
+    else runlevel = RUN_ERROR;
   }
 }
 
-void go_go_go() {
+/* Puts every channel back at the start of its chain, sets the pins to their
+ * off levels, and (for `~+`) compiles the start of the timeline.  Done when a
+ * run starts, or when it is armed, so that the trigger only has to start it.
+ */
+void get_set(bool precompile) {
+  alive = 0;
+  for (int i = 0; i < DIG; i++) {
+    Channel *c = channels + i;
+    c->who = c->zero;
+    c->train = 0;
+    if (c->who == NO_PROT) continue;
+    alive += 1;
+    Protocol *p = protocols + c->who;
+    c->pin_off(p, outputs);
+    c->t = p->total();
+    c->yn = p->delay();
+    c->runlevel = C_WAIT; // Debug::shout(__LINE__, c->pin, c->runlevel);
+  }
+  outputs.flush();
+  Channel::schedule(channels, schedule);
+  timeline.init();
+  if (precompile) {
+    timeline.on = true;
+    timeline.fill(channels, schedule, protocols, TLN);
+    next_event = timeline.next();
+  }
+  else next_event = schedule.next();
+}
+
+void go_go_go(bool precompile, bool interrupt) {
   if (runlevel == RUN_PROGRAM) {
     runlevel = RUN_LOCKED;
-    alive = 0;
+    // Armed runs were made ready when they were armed
+    if (!trigger.starting) get_set(precompile);
     if (led_is_on) {
       led_is_on = false;
       digitalWrite(LED_PIN, LOW);
     }
-    int found = 0;
-    for (int i = 0; i < DIG; i++) {
-      Channel *c = channels + i;
-      c->who = c->zero;
-      if (c->who == 255) continue;
-      alive += 1;
-      Protocol *p = protocols + c->who;
-      c->pin_off(p);
-      c->t = p->t;
-      c->yn = p->d;
-      c->runlevel = C_WAIT; // Debug::shout(__LINE__, c->pin, c->runlevel);
-      if (found) next_event = next_event.or_smaller(p->d);
-      else next_event = p->d;
-      found += 1;
-    }
-    global_clock = (Dura){0, 0};
+    // Catch the board clock up before the global clock starts over
+    uint32_t held = hold_interrupts();
+    time_passes();
+    tock = 0;
+    // Count from the edge itself, if there was one
+    global_clock = (Dura){ trigger.starting ? (int64_t)(uint32_t)(tick - trigger.cyc) : 0 };
+    release_interrupts(held);
+    acquire.epoch += 1;
     io_anyway = global_clock;
     io_anyway += MHZ * MAX_BUSY_US;
-    tick = ARM_DWT_CYCCNT;
-    tock = 0;
     runlevel = RUN_GO;
+    analog.start(protocols, channels[DIG].zero);
+    if (interrupt) {
+      edge_timer.on = true;
+      edge_timer.arm(next_event.k - global_clock.k);
+    }
   }
   else if (runlevel != RUN_ERROR && runlevel != RUN_TO_ERROR) {
     error_with_message("Attempt to start running from invalid state.");
@@ -828,11 +1987,44 @@ void go_go_go() {
 }
 
 bool run_iteration() {
-  // Can't pass volatile as reference, so buffer it
-  int living = alive;
-  next_event = Channel::advance(channels, global_clock, protocols, living);
-  alive = living;
-  return alive != 0;
+  bool going;
+  if (timeline.on) {
+    if (timeline.count == 0) timeline.fill(channels, schedule, protocols, TL_CHUNK);  // Ran dry; compile in a hurry
+    trace.sync(global_clock.k, tick);
+    timeline.play(global_clock, trace);
+    next_event = timeline.next();
+    going = !timeline.is_done(schedule);
+  }
+  else {
+    // Can't pass volatile as reference, so buffer it
+    int living = alive;
+    if (trace.on) {
+      // One deadline at a time (as when compiling), so each edge is traced against its own;
+      // lateness is still taken from the real clock
+      trace.sync(global_clock.k, tick);
+      while (!schedule.is_empty() && !(global_clock < schedule.next())) {
+        Dura at = schedule.next();
+        Channel::advance(channels, schedule, at, global_clock, protocols, living, outputs);
+        trace.note(outputs, at.k);
+        outputs.flush();
+      }
+      living = schedule.n;
+      next_event = schedule.next();
+    }
+    else {
+      next_event = Channel::advance(channels, schedule, global_clock, global_clock, protocols, living, outputs);
+      outputs.flush();
+    }
+    alive = living;
+    going = alive != 0;
+  }
+  if (!going && analog.running) {
+    // Only the analog channel is left; check back now and then
+    next_event = global_clock;
+    next_event += MHZ * MIN_BUSY_US;
+    return true;
+  }
+  return going;
 }
 
 
@@ -851,29 +2043,39 @@ Channel* process_get_channel(byte ch) {
 
 Protocol* process_get_protocol(byte ch) {
   Channel *c = process_get_channel(ch);
-  if (c->who != 255) return protocols + c->who;
+  if (c->who != NO_PROT) return protocols + c->who;
   else {
     error_with_message("No protocol for channel ", (char)ch);
     return &not_a_protocol;
   }
 }
 
+// Number of protocol slots that can still be handed out
+int process_free_protocols() { return (PROT - proti) + spares.n; }
+
+// Index of a fresh protocol slot, or -1 if they're all used up
+int process_take_protocol() {
+  int k = spares.take(protocols);
+  if (k < 0 && proti < PROT) k = proti++;
+  if (k >= 0) protocols[k].init();
+  return k;
+}
+
 Protocol* process_ensure_protocol(byte ch) {
   Channel *c = process_get_channel(ch);
-  if (c->who != 255) return protocols + c->who;
-  else if (c->zero != 255) {
+  if (c->who != NO_PROT) return protocols + c->who;
+  else if (c->zero != NO_PROT) {
     c->refresh(protocols);
     return protocols + c->who;
   }
-  else if (proti < PROT) {
-    c->zero = proti;
+  int k = process_take_protocol();
+  if (k >= 0) {
+    c->zero = (uint16_t)k;
     c->who = c->zero;
     if (c->pin < 255) {
       if (c->pin != LED_PIN) pinMode(c->pin, OUTPUT);
       digitalWrite(c->pin, LOW);
     }
-    protocols[proti].init();
-    proti++;
     return protocols + c->who;
   }
   else return process_get_protocol(ch);   // Defer to get for error handling
@@ -881,38 +2083,78 @@ Protocol* process_ensure_protocol(byte ch) {
 
 Protocol* process_new_protocol(byte ch) {
   Channel *c = process_get_channel(ch);
-  if (proti < PROT) {
-    byte old = c->who;
-    while (c->who != 255) { old = c->who; c->who = protocols[c->who].next; }
-    protocols[old].next = (byte)proti;
-    c->who = (byte)proti;
-    protocols[proti].init();
-    proti++;
+  int k = process_take_protocol();
+  if (k >= 0) {
+    uint16_t old = c->who;
+    while (c->who != NO_PROT) { old = c->who; c->who = protocols[c->who].next; }
+    protocols[old].next = (uint16_t)k;
+    c->who = (uint16_t)k;
     return protocols + c->who;
   }
   else {
-    c->who = 255;
+    c->who = NO_PROT;
     return process_get_protocol(ch);    // Defer to get for error handling
   }
 }
 
+// Adds a train to the end of a running channel's chain.  Unlike
+// process_new_protocol, the channel keeps running what it was running.
+// Call with interrupts off.
+Protocol* process_stream_protocol(byte ch) {
+  Channel *c = process_get_channel(ch);
+  if (c->who == NO_PROT || !c->alive()) {
+    error_with_message("Stream ran dry on channel ", (char)ch);
+    return &not_a_protocol;
+  }
+  int k = process_take_protocol();
+  if (k < 0) {
+    error_with_message("Out of protocol slots streaming to ", (char)ch);
+    return &not_a_protocol;
+  }
+  uint16_t old = c->who;
+  while (protocols[old].next != NO_PROT) old = protocols[old].next;
+  protocols[old].next = (uint16_t)k;
+  return protocols + k;
+}
+
 void process_reset() {
+  noInterrupts();
+  edge_timer.init();
+  analog.stop();
+  analog.train = 0;
+  acquire.finish();
+  trigger.init();
   Protocol::init(protocols, proti);
+  spares.init();
+  trace.init();
   Channel::init(channels);
+  schedule.init();
+  timeline.init();
   erri = 0;
   alive = 0;
   runlevel = RUN_PROGRAM;
+  interrupts();
 }
 
 void process_refresh() {
-  if (runlevel == RUN_COMPLETED) {
+  if (spares.on) error_with_message("Cannot refresh a streamed run");
+  else if (runlevel == RUN_COMPLETED) {
     Channel::refresh(channels, protocols);
+    analog.train = 0;
     runlevel = RUN_PROGRAM;  
   }
 }
 
 void process_start_running() {
-  go_go_go();
+  go_go_go(false, false);
+}
+
+void process_start_precompiled() {
+  go_go_go(true, false);
+}
+
+void process_start_interrupts() {
+  go_go_go(false, true);
 }
 
 void process_start_running(byte who) {
@@ -930,41 +2172,96 @@ void process_start_running(byte who) {
 
 void process_stop_running(byte who) {
   Channel *c = process_get_channel(who);
+  noInterrupts();
   if (runlevel == RUN_GO) {
-    if (c->who != 255) {
-      c->pin_low();
+    if (c == channels + DIG) {
+      analog.wind_down();
+      c->who = NO_PROT;
+    }
+    else if (timeline.on) {
+      // Channel may have finished compiling but still have edges to play.
+      if (c->zero != NO_PROT && timeline.stop(c - channels, c->pin)) {
+        outputs.low(c->pin);
+        outputs.flush();
+        c->runlevel = C_ZZZ;
+        if (spares.on) spares.put_chain(protocols, c->who);
+        c->who = NO_PROT;
+        if (c - channels < DIG) schedule.remove(c - channels);
+        if (alive > 0) alive -= 1;
+        if (alive == 0 && !analog.running) stop_running();
+      }
+    }
+    else if (c->who != NO_PROT) {
+      c->pin_low(outputs);
       c->runlevel = C_ZZZ; // Debug::shout(__LINE__, c->pin, c->runlevel);
-      c->who = 255;
+      if (spares.on) spares.put_chain(protocols, c->who);
+      c->who = NO_PROT;
+      outputs.flush();
+      if (c - channels < DIG) schedule.remove(c - channels);
       if (alive > 0) alive -= 1;
-      if (alive == 0) runlevel = RUN_COMPLETED;
+      if (alive == 0 && !analog.running) stop_running();
     }
   }
+  interrupts();
 }
 
-void process_stop_running() {
+// Call with interrupts off (or from the edge interrupt).
+void stop_running() {
+  edge_timer.init();
+  analog.wind_down();
   for (int i = 0; i < DIG; i++) {
     Channel *c = channels + i;
-    if (c->who != 255) {
-      c->pin_low();
+    if (timeline.on && c->zero != NO_PROT) outputs.low(c->pin);   // May be ahead of what's been played
+    if (c->who != NO_PROT) {
+      c->pin_low(outputs);
       c->runlevel = C_ZZZ; // Debug::shout(__LINE__, c->pin, c->runlevel);
-      c->who = 255;
+      c->who = NO_PROT;
     }
   }
+  outputs.flush();
+  schedule.init();
+  timeline.init();
   alive = 0;
   runlevel = RUN_COMPLETED;
 }
 
+void process_stop_running() {
+  noInterrupts();
+  stop_running();
+  interrupts();
+}
+
 void process_say_the_time() {
+  noInterrupts();   // The clock moves on in the edge interrupt
+  Dura now = (Dura){0};
+  if (runlevel == RUN_GO) {
+    time_passes();
+    now = global_clock;
+  }
+  interrupts();
   msg[0] = '$';
-  ((runlevel == RUN_GO) ? global_clock : (Dura){0, 0}).write_15(msg+1);
+  now.write_15(msg+1);
   msg[16] = '\n';
   msg[17] = 0;
   tell_msg();
 }
 
-void process_say_the_drift(int old_drift, int new_drift, bool changed, bool query) {
+// As `~#`, but for the board clock, which runs in every state and is never reset.
+void process_say_the_board_time() {
+  noInterrupts();
+  time_passes();
+  Dura now = board_clock;
+  interrupts();
+  msg[0] = '$';
+  now.write_15(msg+1);
+  msg[16] = '\n';
+  msg[17] = 0;
+  tell_msg();
+}
+
+void process_say_the_drift(byte which, int old_drift, int new_drift, bool changed, bool query) {
   msg[0] = '~';
-  msg[1] = '^';
+  msg[1] = which;
   int drift = old_drift;
   if (drift < 0) { drift = -drift; msg[2] = '-'; } else msg[2] = '+';
   if (drift >= 100000000) drift = 0;
@@ -982,6 +2279,130 @@ void process_say_empty() {
   Serial.send_now();
 }
 
+// Replies `~&` and four digits: how many more trains can be stored right now.
+void process_say_the_credits() {
+  noInterrupts();
+  int n = process_free_protocols();
+  interrupts();
+  char reply[7];
+  reply[0] = '~';
+  reply[1] = '&';
+  reply[2] = '0' + (n/1000)%10;
+  reply[3] = '0' + (n/100)%10;
+  reply[4] = '0' + (n/10)%10;
+  reply[5] = '0' + n%10;
+  reply[6] = 0;
+  Serial.write(reply, 6);
+  Serial.send_now();
+}
+
+void process_say_the_errors(byte ch) {
+  noInterrupts();   // Statistics are updated from the edge interrupt
+  ChannelError e = process_get_channel(ch)->e;
+  interrupts();
+  msg[0] = '$';
+  e.write(msg+1);
+  msg[61] = '\n';
+  msg[62] = 0;
+  Serial.write((char*)msg);
+  Serial.send_now();
+}
+
+/* Lateness histogram: `~|`, `<` (pulse starts) or `>` (pulse ends), the channel,
+ * the largest lateness in ticks, then the LATEN bucket counts, all little-endian
+ * 32-bit numbers.  60 bytes in all.
+ */
+void process_say_the_lateness(byte ch, byte which) {
+  Channel *c = process_get_channel(ch);
+  bool ends = which == '>';
+  byte reply[4 + 4*(LATEN+1)];
+  reply[0] = '~';
+  reply[1] = '|';
+  reply[2] = which;
+  reply[3] = ch;
+  noInterrupts();   // Counts are updated from the edge interrupt
+  write_le32(reply + 4, (uint32_t)(ends ? c->e.emax1 : c->e.emax0));
+  for (int k = 0; k < LATEN; k++) write_le32(reply + 8 + 4*k, ends ? c->e.late1[k] : c->e.late0[k]);
+  interrupts();
+  Serial.write(reply, sizeof(reply));
+  Serial.send_now();
+}
+
+// Runlevel of channel `i` (DIG is the analog channel) and the train it is on.
+// Call with interrupts off.
+byte process_channel_state(int i, uint16_t &train) {
+  if (i == DIG) {
+    train = analog.train;
+    return analog.running ? (analog.on ? C_HI : C_WAIT) : C_ZZZ;
+  }
+  Channel *c = channels + i;
+  train = c->train;
+  return c->alive() ? c->runlevel : C_ZZZ;
+}
+
+// Replies `~`, the channel, its runlevel digit, `;`, and its train number in three digits (modulo 1000).
+void process_say_the_channel(byte ch) {
+  Channel *c = process_get_channel(ch);
+  if (c == &not_a_channel) return;
+  uint16_t train;
+  noInterrupts();
+  byte level = process_channel_state(c - channels, train);
+  interrupts();
+  char reply[8];
+  reply[0] = '~';
+  reply[1] = ch;
+  reply[2] = '0' + level;
+  reply[3] = ';';
+  reply[4] = '0' + (train/100)%10;
+  reply[5] = '0' + (train/10)%10;
+  reply[6] = '0' + train%10;
+  reply[7] = 0;
+  Serial.write(reply, 7);
+  Serial.send_now();
+}
+
+/* Snapshot of the whole board in one packet: `~=`, the state character (as
+ * for `~@`), the clock in ticks (little-endian 64 bits, 0 unless running),
+ * then SNAP_BITS bits per channel, A first and Z last, packed little-endian:
+ * the runlevel in the low 2 bits and the train number (modulo 4096) above it.
+ * 55 bytes in all.  Everything is read at one instant.
+ */
+#define SNAP_BITS 14
+#define SNAP_PACKET (11 + (CHAN*SNAP_BITS + 7)/8)
+
+void process_say_the_snapshot() {
+  byte reply[SNAP_PACKET];
+  memset(reply, 0, sizeof(reply));
+  reply[0] = '~';
+  reply[1] = '=';
+  switch(runlevel) {
+    case RUN_GO: reply[2] = '*'; break;
+    case RUN_COMPLETED: reply[2] = '/'; break;
+    case RUN_PROGRAM: reply[2] = '.'; break;
+    case RUN_ARMED: reply[2] = '_'; break;
+    default: reply[2] = '!';
+  }
+  uint16_t state[CHAN];
+  noInterrupts();
+  uint64_t clock = (runlevel == RUN_GO) ? (uint64_t)global_clock.k : 0;
+  for (int i = 0; i < CHAN; i++) {
+    uint16_t train;
+    state[i] = process_channel_state(i, train);
+    state[i] |= (train & 0xFFF) << 2;
+  }
+  interrupts();
+  int bit = 11*8;
+  for (int i = 0; i < CHAN; i++) {
+    for (int k = 0; k < SNAP_BITS; k++, bit++) {
+      if (state[i] & (1 << k)) reply[bit >> 3] |= 1 << (bit & 7);
+    }
+  }
+  write_le32(reply + 3, (uint32_t)clock);
+  write_le32(reply + 7, (uint32_t)(clock >> 32));
+  Serial.write(reply, sizeof(reply));
+  Serial.send_now();
+}
+
 int median_of_three(int a, int b, int c) {
   if (a < b) {
     if (b < c) return b;
@@ -1011,7 +2432,8 @@ void process_say_the_voltage(char ch) {
   if (ch == 'X' || ch == 'Z') error_with_message("Cannot ever read input on this channel: ", ch);
   else {
     Channel *c = process_get_channel(ch);
-    if (c->zero != 255) error_with_message("Channel voltage request not valid because running on: ", ch);
+    if (c->zero != NO_PROT) error_with_message("Channel voltage request not valid because running on: ", ch);
+    else if (ch <= 'J' && acquire.on) error_with_message("Channel voltage request not valid while acquiring: ", ch);
     else {
       pinMode(digi[ch - 'A'], INPUT);
       msg[0] = '~';
@@ -1024,12 +2446,41 @@ void process_say_the_voltage(char ch) {
 
 bool process_set_the_drift(int new_drift, int save) {
   drift_rate = (new_drift == 1) ? 2 : new_drift;
-  if (save) return eeprom_set_int(drift_rate, DRIFT_OFFSET);
+  drift_frac = drift_frac_from_rate(drift_rate);
+  drift_fine = drift_fine_from_frac(drift_frac);
+  if (save) {
+    bool changed = eeprom_set_int(drift_rate, DRIFT_OFFSET);
+    if (EEPROM.read(DRIFT_FINE_OFFSET) == 'f') { EEPROM.write(DRIFT_FINE_OFFSET, 0); changed = true; }
+    return changed;
+  }
   else return false;
 }
 
+bool process_set_the_fine_drift(int fine, int save) {
+  drift_fine = fine;
+  drift_frac = drift_frac_from_fine(fine);
+  drift_rate = drift_rate_from_fine(fine);
+  if (save) {
+    bool changed = eeprom_set_int(fine, DRIFT_FINE_OFFSET+1);
+    if (EEPROM.read(DRIFT_FINE_OFFSET) != 'f') { EEPROM.write(DRIFT_FINE_OFFSET, 'f'); changed = true; }
+    return changed;
+  }
+  else return false;
+}
+
+int process_load_the_drift(bool fine) {
+  if (EEPROM.read(DRIFT_FINE_OFFSET) == 'f') {
+    int f = eeprom_get_int(DRIFT_FINE_OFFSET+1);
+    process_set_the_fine_drift(f, false);
+  }
+  else process_set_the_drift(eeprom_get_int(DRIFT_OFFSET), false);
+  return fine ? drift_fine : drift_rate;
+}
+
+// Handles both `~^` (drift as 1/n) and `~%` (drift in parts per 10^10).
+// The last character is `.` to set, `!` to set and save, `?` to query, `^` to load the saved value.
 bool process_drift_command() {
-  if (bufi < 12) return false;
+  if (!need_buf(12)) return false;
   int sign = 0;
   if (buf[2] == '+') sign = 1;
   else if (buf[2] == '-') sign = -1;
@@ -1048,24 +2499,385 @@ bool process_drift_command() {
       else number = 10*number + (buf[i] - '0');
     }
     if (number > -1000000000 && number < 1000000000) {
-      if (buf[12] == '^') {
-        drift_rate = eeprom_get_int(DRIFT_OFFSET);
-        buf[12] = '?';
-      }
-      int old_drift = drift_rate;
+      bool fine = buf[1] == '%';
+      byte mode = buf[11];
+      int old_drift = fine ? drift_fine : drift_rate;
       bool changed = false;
-      if (buf[11] != '?') {
-        changed = process_set_the_drift(sign*number, buf[12] == '!');
+      if (mode != '?' && discipline.on) {
+        error_with_message("Drift is set by the reference clock: ", (char*)buf, 12);
+        discard_buf(12);
+        return true;
+      }
+      if (mode == '^') { old_drift = process_load_the_drift(fine); mode = '?'; }
+      else if (mode != '?') {
+        if (fine) changed = process_set_the_fine_drift(sign*number, mode == '!');
+        else changed = process_set_the_drift(sign*number, mode == '!');
       }
-      process_say_the_drift(old_drift, sign*number, changed, buf[12] == '?');
+      process_say_the_drift(buf[1], old_drift, sign*number, changed, mode == '?');
     }
   }
   discard_buf(12);
   return true;
 }
 
+/* `~-`, the input channel with the reference pulse (or `.` to stop), `+` or `-`
+ * for rising or falling edges, and the period in microseconds (eight digits).
+ * 12 bytes in all, like the drift commands.
+ */
+void process_discipline_command() {
+  byte ch = buf[2];
+  byte edge = buf[3];
+  uint32_t us = 0;
+  bool ok = true;
+  for (int i = 4; i < 12; i++) {
+    if (buf[i] < '0' || buf[i] > '9') ok = false;
+    us = 10*us + (buf[i] - '0');
+  }
+  if (ch == '.') discipline.stop();
+  else if (ch < 'A' || ch >= 'A' + ACQ_INPUTS) error_with_message("Cannot take reference clock from channel ", (char)ch);
+  else if (edge != '+' && edge != '-') error_with_message("Reference edge must be + or -: ", (char*)buf, 12);
+  else if (!ok || us < DISC_MIN_US || us > DISC_MAX_US) error_with_message("Bad reference clock period: ", (char*)buf, 12);
+  else if (channels[ch - 'A'].zero != NO_PROT) error_with_message("Cannot take reference clock from output channel ", (char)ch);
+  else if (trigger.armed && !trigger.scheduled && trigger.pin == digi[ch - 'A']) error_with_message("Cannot take reference clock from trigger channel ", (char)ch);
+  else discipline.start(digi[ch - 'A'], edge == '+', us);
+}
+
+/* Reference clock report: `~``, `.` (off), `?` (not locked) or `!` (locked), the
+ * phase error in ticks and the drift correction in parts per 10^10 (each a sign
+ * and eight digits), and the number of edges used (eight digits).  29 bytes.
+ */
+void process_say_the_discipline() {
+  char state = discipline.locked() ? '!' : (discipline.on ? '?' : '.');
+  int64_t nums[2] = { discipline.phase, drift_fine };
+  char reply[30];
+  reply[0] = '~';
+  reply[1] = '`';
+  reply[2] = state;
+  for (int j = 0; j < 2; j++) {
+    int64_t x = nums[j];
+    reply[3 + 9*j] = (x < 0) ? '-' : '+';
+    if (x < 0) x = -x;
+    if (x > 99999999) x = 99999999;
+    for (int i = 0; i < 8; i++) { reply[11 + 9*j - i] = '0' + (int)(x % 10); x /= 10; }
+  }
+  uint32_t n = discipline.edges % 100000000;
+  for (int i = 0; i < 8; i++) { reply[28 - i] = '0' + n%10; n /= 10; }
+  reply[29] = 0;
+  Serial.write(reply, 29);
+  Serial.send_now();
+}
+
+/* Binary upload: `~[`, a record count (1 or 2), the packed records, then a
+ * CRC-16 (CCITT, low byte first) over the count and records.  Each record is the
+ * channel letter, flags, and then t, d, s, z, p, q as little-endian 32-bit
+ * microseconds.  The body may contain any byte, so the frame is skipped by
+ * its length, never scanned.  Replies `~]` if taken, `~!` if not.
+ * While a streamed run is going, every record is appended to its channel.
+ */
+#define BIN_RECORD 26
+#define BIN_MAX_RECORDS 2
+#define BIN_MAX_FRAME (3 + BIN_MAX_RECORDS*BIN_RECORD + 2)
+#define BIN_APPEND 1
+#define BIN_INVERT 2
+
+// Length of the binary frame at the start of buf; 0 if it isn't all here yet, -1 if it's garbled.
+int binary_frame_length() {
+  if (!need_buf(3)) return 0;
+  int n = buf[2];
+  if (n < 1 || n > BIN_MAX_RECORDS) return -1;
+  int len = 3 + n*BIN_RECORD + 2;
+  return need_buf(len) ? len : 0;
+}
+
+uint16_t crc16(const byte *data, int n) {
+  uint16_t crc = 0xFFFF;
+  for (int i = 0; i < n; i++) {
+    crc ^= ((uint16_t)data[i]) << 8;
+    for (int j = 0; j < 8; j++) crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+uint32_t read_le32(const byte *b) {
+  return ((uint32_t)b[0]) | (((uint32_t)b[1]) << 8) | (((uint32_t)b[2]) << 16) | (((uint32_t)b[3]) << 24);
+}
+
+// Returns false if the whole frame isn't here yet.  Only takes the frame if `accept`.
+bool process_binary_command(bool accept) {
+  int len = binary_frame_length();
+  if (len == 0) return false;
+  if (len < 0) {
+    if (runlevel != RUN_ERROR) error_with_message("Bad binary record count: ", (char*)buf, 3);
+    Serial.write("~!", 2); Serial.send_now();
+    skip_input(BIN_MAX_FRAME);   // The rest of the frame may hold anything, even `~`
+    return true;
+  }
+  bool ok = accept;
+  if (ok && crc16(buf + 2, len - 4) != (uint16_t)(buf[len-2] | (buf[len-1] << 8))) {
+    error_with_message("Binary upload failed CRC");
+    ok = false;
+  }
+  for (int k = 0; ok && k < buf[2]; k++) {
+    byte *r = buf + 3 + k*BIN_RECORD;
+    byte ch = r[0];
+    if (ch < 'A' || ch >= 'A' + DIG) {
+      error_with_message("Binary upload to bad channel: ", (char)ch);
+      ok = false;
+      break;
+    }
+    bool running = runlevel == RUN_GO;
+    bool append = (r[1] & BIN_APPEND) && channels[ch - 'A'].zero != NO_PROT;
+    if (running) noInterrupts();   // Channel may move on to this train from the edge interrupt
+    Protocol *p = running ? process_stream_protocol(ch) : (append ? process_new_protocol(ch) : process_ensure_protocol(ch));
+    ok = runlevel == (running ? RUN_GO : RUN_PROGRAM);   // Otherwise out of protocols (or dry)
+    if (ok) {
+      p->scale = 0;   // Records are whole microseconds, so they always fit
+      p->t = read_le32(r +  2);
+      p->d = read_le32(r +  6);
+      p->s = read_le32(r + 10);
+      p->z = read_le32(r + 14);
+      p->p = read_le32(r + 18);
+      p->q = read_le32(r + 22);
+      p->i = (r[1] & BIN_INVERT) ? 'i' : 'u';
+    }
+    if (running) interrupts();
+  }
+  if (!accept && runlevel != RUN_ERROR) error_with_message("Binary upload only allowed when setting or streaming");
+  Serial.write(ok ? "~]" : "~!", 2);
+  Serial.send_now();
+  discard_buf(len);
+  return true;
+}
+
+/* Trace dump: `~<` starts sending the edge trace; it goes out one packet per
+ * idle pass through the loop so that it never holds up an edge.  Each packet
+ * is 56 bytes: `~<`, the number of edges n (0 to 3), flags (1 = more to come,
+ * 2 = tracing is on), the count of edges lost so far (LE 32 bits), then three
+ * 16-byte edge slots of which the first n are used.  Each edge is the cycle
+ * count, lateness in ticks (signed), scheduled tick (48 bits), all little-endian,
+ * then the channel index and the new level.
+ */
+#define TRACE_PER_PACKET 3
+#define TRACE_PACKET (8 + 16*TRACE_PER_PACKET)
+
+void write_le32(byte *b, uint32_t x) {
+  b[0] = (byte)x; b[1] = (byte)(x >> 8); b[2] = (byte)(x >> 16); b[3] = (byte)(x >> 24);
+}
+
+void process_trace_command(byte b) {
+  switch(b) {
+    case '(':
+      noInterrupts();
+      trace.written = trace.read = trace.lost = 0;
+      trace.on = true;
+      interrupts();
+      break;
+    case ')': trace.on = false; break;
+    case '<': trace.dumping = true; break;
+    default: break;
+  }
+}
+
+void process_trace_dump() {
+  if (Serial.availableForWrite() < TRACE_PACKET) return;
+  byte packet[TRACE_PACKET];
+  uint32_t w = trace.written;   // Only the edge interrupt adds, so this can only be low
+  uint32_t r = trace.read;
+  int n = (w - r > TRACE_PER_PACKET) ? TRACE_PER_PACKET : (int)(w - r);
+  memset(packet, 0, TRACE_PACKET);
+  packet[0] = '~';
+  packet[1] = '<';
+  packet[2] = (byte)n;
+  packet[3] = ((w - r > (uint32_t)n) ? 1 : 0) | (trace.on ? 2 : 0);
+  write_le32(packet + 4, trace.lost);
+  for (int i = 0; i < n; i++) {
+    TraceEdge &e = trace.edges[(r + i) & (TRACEN - 1)];
+    byte *x = packet + 8 + 16*i;
+    write_le32(x, e.cyc);
+    write_le32(x + 4, (uint32_t)e.late);
+    write_le32(x + 8, e.when_lo);
+    x[12] = (byte)e.when_hi;
+    x[13] = (byte)(e.when_hi >> 8);
+    x[14] = e.chan;
+    x[15] = e.level;
+  }
+  trace.read = r + n;
+  if (!(packet[3] & 1)) trace.dumping = false;
+  Serial.write(packet, TRACE_PACKET);
+  Serial.send_now();
+}
+
+/* `~{`, six hex digits selecting inputs (bit k is input 'A'+k), and the sampling
+ * period in microseconds (six digits).  Inputs must not be outputs.
+ */
+void process_acquire_command() {
+  uint32_t mask = 0;
+  uint32_t us = 0;
+  bool ok = true;
+  for (int i = 2; i < 8; i++) {
+    byte b = buf[i];
+    int v = (b >= '0' && b <= '9') ? b - '0' : ((b >= 'A' && b <= 'F') ? b - 'A' + 10 : ((b >= 'a' && b <= 'f') ? b - 'a' + 10 : -1));
+    if (v < 0) ok = false;
+    mask = (mask << 4) | (v & 0xF);
+  }
+  for (int i = 8; i < 14; i++) {
+    if (buf[i] < '0' || buf[i] > '9') ok = false;
+    us = 10*us + (buf[i] - '0');
+  }
+  int nana = 0;
+  for (int k = 0; k < ACQ_ANALOG; k++) if (mask & (((uint32_t)1) << k)) nana++;
+  if (!ok || mask == 0 || (mask >> ACQ_INPUTS) != 0) error_with_message("Bad inputs to acquire: ", (char*)buf, 14);
+  else if (us < (uint32_t)(ACQ_MIN_US*(1 + nana))) error_with_message("Sampling too fast for inputs: ", (char*)buf, 14);
+  else if (acquire.pending()) error_with_message("Already acquiring");
+  else {
+    for (int k = 0; k < ACQ_INPUTS; k++) if (mask & (((uint32_t)1) << k)) {
+      if (channels[k].zero != NO_PROT) { error_with_message("Cannot acquire from output channel ", (char)('A' + k)); return; }
+    }
+    for (int k = 0; k < ACQ_INPUTS; k++) if (mask & (((uint32_t)1) << k)) pinMode(digi[k], INPUT);
+    acquire.start(mask, us);
+  }
+}
+
+void process_acquire_dump() {
+  if (Serial.availableForWrite() < ACQ_PACKET) return;
+  noInterrupts();
+  if (acquire.on && acquire.fill > 0 && (uint32_t)(ARM_DWT_CYCCNT - acquire.first) > ACQ_WAIT) acquire.seal();
+  interrupts();
+  byte packet[ACQ_PACKET];
+  uint32_t r = acquire.read;
+  if (r != acquire.written) {
+    memcpy(packet, acquire.packets[r & (ACQN - 1)], ACQ_PACKET);
+    acquire.read = r + 1;
+  }
+  else if (acquire.ending) {
+    memset(packet, 0, ACQ_PACKET);
+    packet[0] = '~';
+    packet[1] = '{';
+    packet[3] = 4 | (acquire.lost ? 1 : 0);
+    packet[4] = acquire.epoch;
+    packet[5] = (byte)acquire.size;
+    acquire.ending = false;
+  }
+  else return;
+  Serial.write(packet, ACQ_PACKET);
+  Serial.send_now();
+}
+
+void discipline_interrupt() {
+  discipline.edge(ARM_DWT_CYCCNT);
+}
+
+// Starts the run from the edge on the trigger pin; it is the first thing that happens.
+void trigger_interrupt() {
+  uint32_t cyc = ARM_DWT_CYCCNT;
+  if (!trigger.armed || trigger.scheduled || runlevel != RUN_ARMED) return;
+  trigger_start(cyc);
+}
+
+// Starts the run as if it had started on cycle `cyc`.
+void trigger_start(uint32_t cyc) {
+  if (runlevel != RUN_ARMED) return;
+  trigger.disarm();
+  trigger.cyc = cyc;
+  trigger.fired = true;
+  runlevel = RUN_PROGRAM;
+  trigger.starting = true;
+  go_go_go(trigger.precompile, trigger.interrupt);
+  trigger.starting = false;
+  trigger.latency = ARM_DWT_CYCCNT - cyc;
+}
+
+/* `~_`, the input channel, `+` (rising edge) or `-` (falling edge), and how to
+ * run once triggered: `*` (as `~*`), `+` (as `~+`), or `>` (as `~>`).
+ */
+void process_arm_command() {
+  byte ch = buf[2];
+  byte edge = buf[3];
+  byte how = buf[4];
+  if (ch < 'A' || ch >= 'A' + ACQ_INPUTS) error_with_message("Cannot trigger from channel ", (char)ch);
+  else if (edge != '+' && edge != '-') error_with_message("Trigger edge must be + or -: ", (char*)buf, 5);
+  else if (how != '*' && how != '+' && how != '>') error_with_message("Trigger must run with * + or >: ", (char*)buf, 5);
+  else if (channels[ch - 'A'].zero != NO_PROT) error_with_message("Cannot trigger from output channel ", (char)ch);
+  else if (discipline.on && discipline.pin == digi[ch - 'A']) error_with_message("Cannot trigger from reference clock channel ", (char)ch);
+  else if (spares.on) error_with_message("Cannot trigger a streamed run");
+  else {
+    if (!led_is_on) {
+      led_is_on = true;
+      digitalWrite(LED_PIN, HIGH);
+    }
+    get_set(how == '+');
+    noInterrupts();
+    runlevel = RUN_ARMED;
+    trigger.arm(digi[ch - 'A'], edge == '+', how == '+', how == '>');
+    interrupts();
+  }
+}
+
+/* `~:`, how to run (as for `~_`), and the time on the board clock to start at,
+ * in the same format as `~,` replies with.  18 bytes in all.
+ */
+void process_schedule_command() {
+  byte how = buf[2];
+  Dura when;
+  when.parse(buf + 3, 15);
+  noInterrupts();
+  time_passes();
+  Dura now = board_clock;
+  interrupts();
+  if (how != '*' && how != '+' && how != '>') error_with_message("Scheduled start must run with * + or >: ", (char*)buf, 18);
+  else if (!when.is_valid() || buf[11] != '.') error_with_message("Bad time to start: ", (char*)buf, 18);
+  else if (when < now) error_with_message("Scheduled start is already past: ", (char*)buf, 18);
+  else if (spares.on) error_with_message("Cannot trigger a streamed run");
+  else {
+    if (!led_is_on) {
+      led_is_on = true;
+      digitalWrite(LED_PIN, HIGH);
+    }
+    get_set(how == '+');
+    noInterrupts();
+    runlevel = RUN_ARMED;
+    trigger.arm_at(when, how == '+', how == '>');
+    interrupts();
+  }
+}
+
+void process_disarm() {
+  noInterrupts();
+  if (runlevel == RUN_ARMED) {
+    trigger.disarm();
+    runlevel = RUN_PROGRAM;
+  }
+  interrupts();
+}
+
+/* Trigger report: `~;`, `_` (armed), `!` (started a run) or `.` (neither), the
+ * cycle count at the edge in ten digits, and the ticks from the edge until the
+ * run was going in eight digits.  21 bytes in all.
+ */
+void process_say_the_trigger() {
+  noInterrupts();
+  char state = trigger.armed ? '_' : (trigger.fired ? '!' : '.');
+  uint32_t cyc = trigger.cyc;
+  uint32_t latency = trigger.latency;
+  interrupts();
+  char reply[22];
+  reply[0] = '~';
+  reply[1] = ';';
+  reply[2] = state;
+  for (int i = 0; i < 10; i++) { reply[12-i] = '0' + cyc%10; cyc /= 10; }
+  if (latency > 99999999) latency = 99999999;
+  for (int i = 0; i < 8; i++) { reply[20-i] = '0' + latency%10; latency /= 10; }
+  reply[21] = 0;
+  Serial.write(reply, 21);
+  Serial.send_now();
+}
+
 void process_error_command() {
-  if (bufi < 2) return;
+  if (!need_buf(2)) return;
+  if (buf[0] == '~' && buf[1] == '[') {
+    process_binary_command(false);
+    return;
+  }
   if (buf[0] != '~') {
     discard_command();
     return;
@@ -1073,6 +2885,11 @@ void process_error_command() {
   // Was a fixed-length command.  Pick out the meaningful ones.
   switch(buf[1]) {
     case '@': Serial.write("~!", 2); Serial.send_now(); break;
+    case '=': process_say_the_snapshot(); break;
+    case ';': process_say_the_trigger(); break;
+    case ',': process_say_the_board_time(); break;
+    case '`': process_say_the_discipline(); break;
+    case '}': acquire.finish(); break;
     case '.': process_reset(); break;
     case '\'': process_say_empty(); break;
     case '#': tell_msg(); break;
@@ -1083,7 +2900,11 @@ void process_error_command() {
 }
 
 void process_complete_command() {
-  if (bufi < 2) return;
+  if (!need_buf(2)) return;
+  if (buf[0] == '~' && buf[1] == '[') {
+    process_binary_command(false);
+    return;
+  }
   if (buf[0] != '~') {
     error_with_message("unknown command starting: ", (char*)buf, 1);
     discard_command();
@@ -1091,18 +2912,40 @@ void process_complete_command() {
   }
   switch(buf[1]) {
     case '@': Serial.write("~/"); Serial.send_now(); break;
+    case '=': process_say_the_snapshot(); break;
+    case ';': process_say_the_trigger(); break;
+    case ',': process_say_the_board_time(); break;
     case '.': process_reset(); break;
     case '"': process_refresh(); break;
     case '#': process_say_the_time(); break;
     case '?': tell_who(); break;
     case '/': break;
     case '\'': process_say_empty(); break;
-    case '^': if (!process_drift_command()) return; break;
+    case '&': process_say_the_credits(); break;
+    case '(':
+    case ')':
+    case '<': process_trace_command(buf[1]); break;
+    case '{':
+      if (!need_buf(14)) return;
+      process_acquire_command();
+      discard_buf(14);
+      return;
+    case '}': acquire.finish(); break;
+    case '^':
+    case '%': if (!process_drift_command()) return; break;
+    case '-':
+      if (!need_buf(12)) return;
+      process_discipline_command();
+      discard_buf(12);
+      return;
+    case '`': process_say_the_discipline(); break;
     default:
       if (buf[1] >= 'A' && buf[1] <= 'Z' && buf[1] != 'Y') {
-        if (bufi < 3) return;
+        if (!need_buf(3)) return;
         if (buf[2] == '/') { discard_buf(3); return; }
         else if (buf[2] == '?') { process_say_the_voltage(buf[1]); return; }
+        else if (buf[2] == '@') { process_say_the_channel(buf[1]); discard_buf(3); return; }
+        else if (buf[2] == '<' || buf[2] == '>') { process_say_the_lateness(buf[1], buf[2]); discard_buf(3); return; }
       }
       error_with_message("Command not valid (run complete): ", (char*)buf, 2);
   }
@@ -1110,10 +2953,11 @@ void process_complete_command() {
 }
 
 void process_init_command() {
-  if (bufi < 2) return;
+  if (!need_buf(2)) return;
   if (buf[0] == '$') {
-    int i = 1;
+    int i = cmd_scan;
     for (; i < bufi && buf[i] != '\n'; i++) {}
+    cmd_scan = i;
     if (i < bufi) {
       if (memcmp("IDENTITY", buf+1, 8) != 0) {
         error_with_message("Expected $IDENTITY found:", (char*)buf, bufi);
@@ -1128,11 +2972,12 @@ void process_init_command() {
       error_with_message("$ without newline in: ", (char*)buf, bufi);
       discard_command();
     }
+    else cmd_need = bufi + 1;
     return;
   }
   byte b = buf[1];
   if (b >= 'A' && b <= 'Z' && b != 'Y') {
-    if (bufi < 3) return;
+    if (!need_buf(3)) return;
     byte ch = b;
     b = buf[2];
     switch(b) {
@@ -1143,7 +2988,7 @@ void process_init_command() {
       case '&': process_new_protocol(ch); break;
       case '=':
       case ':':
-        if (bufi < 57) return;
+        if (!need_buf(57)) return;
         if (ch == 'Z') {
           error_with_message("Cannot set all on channel Z: ", (char*)buf, 12);
         }
@@ -1169,18 +3014,32 @@ void process_init_command() {
       case 'p':
       case 'q':
       case 'w': 
-        if (bufi < 11) return;
+        if (!need_buf(11)) return;
         if ((b == 'w' && ch != 'Z') || (ch == 'Z' && (b == 'p' || b == 'q'))) {
           error_with_message("Bad command for channel: ", (char*)buf, 11);
         }
         else {
-          if (!process_ensure_protocol(ch)->parse_labeled(b, buf+3)) {
+          Protocol *p = process_ensure_protocol(ch);
+          if (!p->parse_labeled(b, buf+3)) {
             error_with_message("Bad duration format: ", (char*)buf, 11);
           }
+          else if (b == 'w' && p->pulse_on().k < ANALOG_MIN_PERIOD) {
+            error_with_message("Analog period too short: ", (char*)buf, 11);
+          }
         }
         discard_buf(11);
         return;
-      case 'a': /* TODO */ return;
+      case 'a':
+        if (!need_buf(7)) return;
+        if (ch != 'Z') error_with_message("Analog required: ", (char*)buf, 7);
+        else {
+          int a = 0;
+          for (int i = 3; i < 7 && a >= 0; i++) a = (buf[i] >= '0' && buf[i] <= '9') ? 10*a + (buf[i] - '0') : -1;
+          if (a < 0 || a > ANALOG_AMPL) error_with_message("Bad amplitude: ", (char*)buf, 7);
+          else process_ensure_protocol(ch)->a = (uint16_t)a;
+        }
+        discard_buf(7);
+        return;
       default:
         error_with_message("Channel command not valid (setting): ", (char*)buf, 3);
     }
@@ -1189,13 +3048,47 @@ void process_init_command() {
   else {
     switch(b) {
       case '@': Serial.write("~."); Serial.send_now(); break;
+      case '=': process_say_the_snapshot(); break;
+      case ';': process_say_the_trigger(); break;
+      case ',': process_say_the_board_time(); break;
       case '.': process_reset(); break;
       case '#': process_say_the_time(); break;
       case '?': tell_who(); break;
       case '\'': process_say_empty(); break;
       case '/': break;
       case '*': process_start_running(); break;
-      case '^': if (!process_drift_command()) return; break;
+      case '+': process_start_precompiled(); break;
+      case '>': process_start_interrupts(); break;
+      case '_':
+        if (!need_buf(5)) return;
+        process_arm_command();
+        discard_buf(5);
+        return;
+      case ':':
+        if (!need_buf(18)) return;
+        process_schedule_command();
+        discard_buf(18);
+        return;
+      case '[': process_binary_command(true); return;
+      case '&': process_say_the_credits(); break;
+      case '!': spares.on = true; process_say_the_credits(); break;
+      case '(':
+      case ')':
+      case '<': process_trace_command(b); break;
+      case '{':
+        if (!need_buf(14)) return;
+        process_acquire_command();
+        discard_buf(14);
+        return;
+      case '}': acquire.finish(); break;
+      case '^':
+      case '%': if (!process_drift_command()) return; break;
+      case '-':
+        if (!need_buf(12)) return;
+        process_discipline_command();
+        discard_buf(12);
+        return;
+      case '`': process_say_the_discipline(); break;
       default:
         error_with_message("Command not valid (setting): ", (char*)buf, 2);
     }
@@ -1204,7 +3097,11 @@ void process_init_command() {
 }
 
 void process_runtime_command() {
-  if (bufi < 2) return;
+  if (!need_buf(2)) return;
+  if (buf[0] == '~' && buf[1] == '[') {
+    process_binary_command(spares.on);
+    return;
+  }
   if (buf[0] != '~') {
     error_with_message("Channel command not valid(running): ", (char*)buf, 2);
     discard_command();
@@ -1212,21 +3109,16 @@ void process_runtime_command() {
   }
   byte b = buf[1];
   if (b >= 'A' && b <= 'Z' && b != 'Y') {
-    if (bufi < 3) return;
+    if (!need_buf(3)) return;
     byte ch = b;
     b = buf[2];
     switch(b) {
-      case '@': /* TODO */ break;
-      case '#':
-        msg[0] = '$';
-        process_get_channel(ch)->e.write(msg+1);
-        msg[61] = '\n';
-        msg[62] = 0;
-        Serial.write((char*)msg);
-        Serial.send_now();
-        break;
+      case '@': process_say_the_channel(ch); break;
+      case '#': process_say_the_errors(ch); break;
       case '/': process_stop_running(ch); break;
       case '?': process_say_the_voltage(ch); break;
+      case '<':
+      case '>': process_say_the_lateness(ch, b); break;
       default:
         error_with_message("Channel command not valid (running): ", (char*)buf, 3);
     }
@@ -1235,12 +3127,31 @@ void process_runtime_command() {
   else {
     switch(b) {
       case '@': Serial.write("~*"); Serial.send_now(); break;
+      case '=': process_say_the_snapshot(); break;
+      case ';': process_say_the_trigger(); break;
+      case ',': process_say_the_board_time(); break;
       case '.': process_reset(); break;
       case '#': process_say_the_time(); break;
       case '?': tell_who(); break;
       case '/': process_stop_running(); break;
       case '\'': process_say_empty(); break;
-      case '^': if (!process_drift_command()) return; break;
+      case '&': process_say_the_credits(); break;
+      case ')':
+      case '<': process_trace_command(b); break;
+      case '{':
+        if (!need_buf(14)) return;
+        process_acquire_command();
+        discard_buf(14);
+        return;
+      case '}': acquire.finish(); break;
+      case '^':
+      case '%': if (!process_drift_command()) return; break;
+      case '-':
+        if (!need_buf(12)) return;
+        process_discipline_command();
+        discard_buf(12);
+        return;
+      case '`': process_say_the_discipline(); break;
       default:
         error_with_message("Command not valid (running): ", (char*)buf, 2);
     }
@@ -1248,6 +3159,50 @@ void process_runtime_command() {
   }
 }
 
+void process_armed_command() {
+  if (!need_buf(2)) return;
+  if (buf[0] == '~' && buf[1] == '[') {
+    process_binary_command(false);
+    return;
+  }
+  if (buf[0] != '~') {
+    error_with_message("Command not valid (armed): ", (char*)buf, 2);
+    discard_command();
+    return;
+  }
+  byte b = buf[1];
+  if (b >= 'A' && b <= 'Z' && b != 'Y') {
+    if (!need_buf(3)) return;
+    if (buf[2] == '@') process_say_the_channel(b);
+    else if (buf[2] == '?') process_say_the_voltage(b);
+    else error_with_message("Channel command not valid (armed): ", (char*)buf, 3);
+    discard_buf(3);
+    return;
+  }
+  switch(b) {
+    case '@': Serial.write("~_"); Serial.send_now(); break;
+    case '=': process_say_the_snapshot(); break;
+    case ';': process_say_the_trigger(); break;
+    case ',': process_say_the_board_time(); break;
+    case '`': process_say_the_discipline(); break;
+    case '.': process_reset(); break;
+    case '#': process_say_the_time(); break;
+    case '?': tell_who(); break;
+    case '/': process_disarm(); break;
+    case '\'': process_say_empty(); break;
+    case '&': process_say_the_credits(); break;
+    case '{':
+      if (!need_buf(14)) return;
+      process_acquire_command();
+      discard_buf(14);
+      return;
+    case '}': acquire.finish(); break;
+    default:
+      error_with_message("Command not valid (armed): ", (char*)buf, 2);
+  }
+  discard_buf(2);
+}
+
 
 
 /*************
@@ -1266,9 +3221,9 @@ void setup() {
   ARM_DEMCR |= ARM_DEMCR_TRCENA;
   ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
   erri = 0;
-  bufi = 0;
-  global_clock = (Dura){ 0, 0 };
-  next_event = (Dura){ 0, 0 };
+  reset_buf();
+  global_clock = (Dura){0};
+  next_event = (Dura){0};
   led_is_on = false;
   tick = ARM_DWT_CYCCNT;
   tock = 0;
@@ -1280,38 +3235,51 @@ int lastrun = -10;
 #endif
 
 int time_passes() {
+  // Interrupts (the acquisition timer) read tick and the clocks together, so update them together
+  uint32_t held = hold_interrupts();
   int now = ARM_DWT_CYCCNT;
   int delta = now - tick;
   tick = now;
-  int x, y;
-  if (drift_rate != 0) {
-    x = (drift_rate > 0) ? drift_rate : -drift_rate;
-    tock += delta;
-    if (tock > x) {
-      if (tock > (x << 4)) {
-        y = tock/x;
-        tock = tock - y*x;
-      }
-      else {
-        y = 1;
-        tock -= x;
-        while (tock > x) {
-          y++;
-          tock -= x;
-        }
-      }
-      delta += (drift_rate > 0) ? y : -y;
-    }
+  if (drift_frac != 0) {
+    tock += ((int64_t)delta) * drift_frac;
+    int y = (int)(tock >> 32);
+    tock -= ((int64_t)y) << 32;
+    delta += y;
   }
   global_clock += delta;
+  board_clock += delta;
+  release_interrupts(held);
   return delta;
 }
 
+// Fires when the edge timer goes off; advances channels exactly as `loop()` would otherwise.
+void edge_interrupt() {
+  time_passes();
+  if (runlevel != RUN_GO || !edge_timer.on) return;
+  if (!(global_clock < next_event)) {
+    if (!run_iteration()) {
+      stop_running();
+      return;
+    }
+  }
+  Dura wait = next_event;
+  wait.k -= global_clock.k;
+  edge_timer.arm(wait.k);
+}
+
 // Runs over and over forever (after setup() finishes)
 void loop() {
-  int delta = time_passes();
+  int delta;
+  edge_timer.poll();
+  analog.poll();
+  acquire.poll();
+  trigger.poll();
+  discipline.poll();
+  // Channels are run (or about to be started) from an interrupt, not here; check armed first
+  bool timed = trigger.armed || edge_timer.on;
+  delta = time_passes();
   bool urgent = false;
-  if (next_event < global_clock) {
+  if (next_event < global_clock && !(timed && runlevel == RUN_GO) && runlevel != RUN_ARMED) {
     urgent = true;
     if (runlevel == RUN_GO) {
       bool alive = run_iteration();
@@ -1336,21 +3304,28 @@ void loop() {
   if (!urgent || io_anyway < global_clock) {
     Dura soon = global_clock;
     soon += MHZ * MIN_BUSY_US;
-    if (next_event < soon || io_anyway < next_event) {
+    if (timed || next_event < soon || io_anyway < next_event) {
       // Do not need to busywait for next event
+      if (runlevel == RUN_GO && timeline.on) timeline.fill(channels, schedule, protocols, TL_CHUNK);
       drain_to_buf();
-      switch(runlevel) {
+      if (!skip_input() && bufi >= cmd_need) switch(runlevel) {
         case RUN_ERROR:     process_error_command(); break;
         case RUN_COMPLETED: process_complete_command(); break;
         case RUN_PROGRAM:   process_init_command(); break;
         case RUN_GO:        process_runtime_command(); break;
+        case RUN_ARMED:     process_armed_command(); break;
         default: break;
       }
+      if (trace.dumping) process_trace_dump();
+      if (acquire.pending()) process_acquire_dump();
 #ifdef YELL_DEBUG
       if (io_anyway < global_clock) yell("io");
 #endif
+      // The edge interrupt moves global_clock on as well, so copy it (two words) with that held off
+      if (timed) noInterrupts();
       delta = time_passes();
       io_anyway = global_clock;
+      if (timed) interrupts();
       io_anyway += MHZ * MAX_BUSY_US;
     }
   }